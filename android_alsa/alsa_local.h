@@ -0,0 +1,140 @@
+#ifndef __ALSA_LOCAL_H
+#define __ALSA_LOCAL_H
+
+#include <alsa/asoundlib.h>
+
+/* Mirrors the private rawmidi and timer plugin layouts of the bundled alsa-lib (1.2.13, src/rawmidi/rawmidi_local.h and
+   src/timer/timer_local.h). alsa-lib has no public extension API for them, so the layout must be kept in sync with the rootfs library. */
+
+typedef struct {
+    int (*close)(snd_rawmidi_t* rawmidi);
+    int (*nonblock)(snd_rawmidi_t* rawmidi, int nonblock);
+    int (*info)(snd_rawmidi_t* rawmidi, snd_rawmidi_info_t* info);
+    int (*params)(snd_rawmidi_t* rawmidi, snd_rawmidi_params_t* params);
+    int (*status)(snd_rawmidi_t* rawmidi, snd_rawmidi_status_t* status);
+    int (*drop)(snd_rawmidi_t* rawmidi);
+    int (*drain)(snd_rawmidi_t* rawmidi);
+    ssize_t (*write)(snd_rawmidi_t* rawmidi, const void* buffer, size_t size);
+    ssize_t (*read)(snd_rawmidi_t* rawmidi, void* buffer, size_t size);
+    ssize_t (*tread)(snd_rawmidi_t* rawmidi, struct timespec* tstamp, void* buffer, size_t size);
+    int (*ump_ep_info)(snd_rawmidi_t* rawmidi, void* buf);
+    int (*ump_block_info)(snd_rawmidi_t* rawmidi, void* buf);
+} snd_rawmidi_ops_t;
+
+struct _snd_rawmidi {
+    void* dl_handle;
+    char* name;
+    snd_rawmidi_type_t type;
+    snd_rawmidi_stream_t stream;
+    int mode;
+    int poll_fd;
+    int version;
+    const snd_rawmidi_ops_t* ops;
+    void* private_data;
+    size_t buffer_size;
+    size_t avail_min;
+    unsigned int no_active_sensing: 1;
+    int params_mode;
+};
+
+typedef struct {
+    int (*close)(snd_timer_t* timer);
+    int (*nonblock)(snd_timer_t* timer, int nonblock);
+    int (*async)(snd_timer_t* timer, int sig, pid_t pid);
+    int (*info)(snd_timer_t* timer, snd_timer_info_t* info);
+    int (*params)(snd_timer_t* timer, snd_timer_params_t* params);
+    int (*status)(snd_timer_t* timer, snd_timer_status_t* status);
+    int (*rt_start)(snd_timer_t* timer);
+    int (*rt_stop)(snd_timer_t* timer);
+    int (*rt_continue)(snd_timer_t* timer);
+    ssize_t (*read)(snd_timer_t* timer, void* buffer, size_t size);
+} snd_timer_ops_t;
+
+struct _snd_timer {
+    int version;
+    void* dl_handle;
+    char* name;
+    snd_timer_type_t type;
+    int mode;
+    int poll_fd;
+    const snd_timer_ops_t* ops;
+    void* private_data;
+    struct {
+        void* next;
+        void* prev;
+    } async_handlers;
+};
+
+/* The opaque alsa-lib parameter types are the kernel structures from <sound/asound.h>, which cannot be included next to
+   <alsa/asoundlib.h> because of conflicting typedefs. */
+
+#define SNDRV_RAWMIDI_INFO_OUTPUT 0x00000001
+
+struct snd_rawmidi_info {
+    unsigned int device;
+    unsigned int subdevice;
+    int stream;
+    int card;
+    unsigned int flags;
+    unsigned char id[64];
+    unsigned char name[80];
+    unsigned char subname[32];
+    unsigned int subdevices_count;
+    unsigned int subdevices_avail;
+    unsigned char reserved[64];
+};
+
+struct snd_rawmidi_params {
+    int stream;
+    size_t buffer_size;
+    size_t avail_min;
+    unsigned int no_active_sensing: 1;
+    unsigned int mode;
+    unsigned char reserved[12];
+};
+
+struct snd_rawmidi_status {
+    int stream;
+    unsigned char pad1[sizeof(time_t) - sizeof(int)];
+    struct timespec tstamp;
+    size_t avail;
+    size_t xruns;
+    unsigned char reserved[16];
+};
+
+struct snd_timer_info {
+    unsigned int flags;
+    int card;
+    unsigned char id[64];
+    unsigned char name[80];
+    unsigned long reserved0;
+    unsigned long resolution;
+    unsigned char reserved[64];
+};
+
+struct snd_timer_params {
+    unsigned int flags;
+    unsigned int ticks;
+    unsigned int queue_size;
+    unsigned int reserved0;
+    unsigned int filter;
+    unsigned char reserved[60];
+};
+
+struct snd_timer_status {
+    struct timespec tstamp;
+    unsigned int resolution;
+    unsigned int lost;
+    unsigned int overrun;
+    unsigned int queue;
+    unsigned char reserved[64];
+};
+
+#define RAWMIDI_INFO(info) ((struct snd_rawmidi_info*)(info))
+#define RAWMIDI_PARAMS(params) ((struct snd_rawmidi_params*)(params))
+#define RAWMIDI_STATUS(status) ((struct snd_rawmidi_status*)(status))
+#define TIMER_INFO(info) ((struct snd_timer_info*)(info))
+#define TIMER_PARAMS(params) ((struct snd_timer_params*)(params))
+#define TIMER_STATUS(status) ((struct snd_timer_status*)(status))
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdbool.h> 
 #include <stdint.h> 
@@ -7,8 +8,9 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/mman.h>
+#include "android_ipc.h"
+#include "android_trace.h"
 
-#define MIN_REQUEST_LENGTH 5
 #define BUFFER_OFFSET 4
 
 #define REQUEST_CODE_CLOSE 0
@@ -20,6 +22,9 @@
 #define REQUEST_CODE_DRAIN 6
 #define REQUEST_CODE_POINTER 7
 #define REQUEST_CODE_MIN_BUFFER_SIZE 8
+#define REQUEST_CODE_POOL_ATTACH 13
+#define REQUEST_CODE_WRITE_CHUNK 14
+#define REQUEST_CODE_VERSION 15
 
 #define DATA_TYPE_U8 0
 #define DATA_TYPE_S16LE 1
@@ -27,8 +32,25 @@
 #define DATA_TYPE_FLOATLE 3
 #define DATA_TYPE_FLOATBE 4
 
+#define POOL_CHUNK_COUNT 4
+#define POOL_CHUNK_HEADER_SIZE 4
+
+#define POOL_PROTOCOL_VERSION 1
+#define VERSION_TIMEOUT_MS 250
+
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof(arr[0]))
 
+/* In socket mode the client can attach a memfd pool to the connection once per prepare, then each transfer copies the frames
+   into a free chunk and sends only REQUEST_CODE_WRITE_CHUNK with the chunk index and length, so the payload never goes through
+   the socket buffers. Every chunk starts with a 4-byte busy flag that the client sets and the server clears once it has consumed
+   the chunk. When no chunk is free the transfer falls back to a plain socket write.
+
+   A server that predates the pool does not know REQUEST_CODE_POOL_ATTACH, so the first connection of the process asks for the
+   protocol version with the payload-less REQUEST_CODE_VERSION, which an old server skips without losing its place in the stream.
+   The answer is kept for the whole process and the pool is only attached from POOL_PROTOCOL_VERSION on. The version is only waited
+   for a short time, after which the connection is dropped and opened again, since a late reply would be read as the answer to a
+   later request. */
+
 typedef struct snd_pcm_android_aserver {
     snd_pcm_ioplug_t io;
     int fd;
@@ -36,34 +58,37 @@ typedef struct snd_pcm_android_aserver {
     int shm_size;
     void* shm_ptr;
     bool use_shm;
+    int pool_size;
+    int pool_chunk_size;
+    int pool_next_chunk;
+    char* pool_ptr;
 } snd_pcm_android_aserver_t;
 
-static int android_aserver_recv_fd(int fd) {
-    char zero = 0;
-    struct iovec iovmsg = {.iov_base = &zero, .iov_len = 1};
-    struct {
-        struct cmsghdr align;
-        int fds[1];
-    } ctrlmsg;
-
-    struct msghdr msg = {
-        .msg_name = NULL,
-        .msg_namelen = 0,
-        .msg_iov = &iovmsg,
-        .msg_iovlen = 1,
-        .msg_flags = 0,
-        .msg_control = &ctrlmsg,
-        .msg_controllen = sizeof(struct cmsghdr) + sizeof(int)
-    };
-
-    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-    cmsg->cmsg_level = SOL_SOCKET;
-    cmsg->cmsg_type = SCM_RIGHTS;
-    cmsg->cmsg_len = msg.msg_controllen;
-    ((int*)CMSG_DATA(cmsg))[0] = -1;
-
-    recvmsg(fd, &msg, 0);
-    return ((int*)CMSG_DATA(cmsg))[0];
+static int android_aserver_socket_type = 0;
+static int android_aserver_server_version = -1;
+
+/* Requests carry the payload length in place of the argument. */
+static int android_aserver_request(snd_pcm_android_aserver_t* android_aserver, char request_code, const void* data, int length) {
+    bool sent = android_ipc_send(android_aserver->fd, request_code, length, data, length, NULL, 0);
+    return sent ? 0 : -EIO;
+}
+
+static int android_aserver_connect(void) {
+    const char* path = getenv("ANDROID_ALSA_SERVER");
+    int fd = android_ipc_connect(path, &android_aserver_socket_type);
+    if (fd < 0 || __atomic_load_n(&android_aserver_server_version, __ATOMIC_ACQUIRE) >= 0) return fd;
+
+    int version = 0;
+    bool answered = android_ipc_send(fd, REQUEST_CODE_VERSION, 0, NULL, 0, NULL, 0) && android_ipc_wait(fd, VERSION_TIMEOUT_MS) &&
+                    android_ipc_recv(fd, &version, 4, NULL, 0) >= 0;
+    if (!answered) {
+        version = 0;
+        close(fd);
+        fd = android_ipc_connect(path, &android_aserver_socket_type);
+    }
+
+    __atomic_store_n(&android_aserver_server_version, version > 0 ? version : 0, __ATOMIC_RELEASE);
+    return fd;
 }
 
 static char parse_data_type(snd_pcm_format_t format) {
@@ -95,36 +120,80 @@ static char parse_data_type(snd_pcm_format_t format) {
 static int android_aserver_min_buffer_size(snd_pcm_ioplug_t* io, char channels, snd_pcm_format_t format, int rate) {
     snd_pcm_android_aserver_t* android_aserver = io->private_data;
     
-    int request_length = 6;
-    char request_data[request_length + MIN_REQUEST_LENGTH];
-    request_data[0] = REQUEST_CODE_MIN_BUFFER_SIZE;
-    *(int*)(request_data + 1) = request_length;
-    request_data[5] = channels;
-    request_data[6] = parse_data_type(format);
-    *(int*)(request_data + 7) = rate;
+    char request_data[6];
+    request_data[0] = channels;
+    request_data[1] = parse_data_type(format);
+    *(int*)(request_data + 2) = rate;
     
-    int res = write(android_aserver->fd, &request_data, request_length + MIN_REQUEST_LENGTH);
-    if (res < 0) return 0;
+    if (android_aserver_request(android_aserver, REQUEST_CODE_MIN_BUFFER_SIZE, request_data, sizeof(request_data)) < 0) return 0;
     
     int min_buffer_size;
-    res = read(android_aserver->fd, &min_buffer_size, 4);
-    if (res != 4) return 0;
+    if (android_ipc_recv(android_aserver->fd, &min_buffer_size, 4, NULL, 0) < 0) return 0;
     
     return min_buffer_size;
 }
 
+static void android_aserver_release_pool(snd_pcm_android_aserver_t* android_aserver) {
+    if (android_aserver->pool_ptr) {
+        munmap(android_aserver->pool_ptr, android_aserver->pool_size);
+        android_aserver->pool_ptr = NULL;
+        android_aserver->pool_size = 0;
+        android_aserver->pool_chunk_size = 0;
+    }
+}
+
+static void android_aserver_attach_pool(snd_pcm_android_aserver_t* android_aserver, int chunk_size) {
+    if (__atomic_load_n(&android_aserver_server_version, __ATOMIC_ACQUIRE) < POOL_PROTOCOL_VERSION) return;
+
+    int fd = memfd_create("android_aserver_pool", MFD_CLOEXEC);
+    if (fd < 0) return;
+
+    chunk_size += POOL_CHUNK_HEADER_SIZE;
+    int pool_size = chunk_size * POOL_CHUNK_COUNT;
+    char* pool_ptr = MAP_FAILED;
+    if (ftruncate(fd, pool_size) == 0) pool_ptr = mmap(NULL, pool_size, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+
+    if (pool_ptr == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+
+    int request_data[2] = {POOL_CHUNK_COUNT, chunk_size};
+
+    char success = 0;
+    bool sent = android_ipc_send(android_aserver->fd, REQUEST_CODE_POOL_ATTACH, sizeof(request_data), request_data, sizeof(request_data), &fd, 1);
+    if (sent && android_ipc_recv(android_aserver->fd, &success, 1, NULL, 0) < 0) success = 0;
+    close(fd);
+
+    if (!sent || !success) {
+        munmap(pool_ptr, pool_size);
+        return;
+    }
+
+    android_aserver->pool_ptr = pool_ptr;
+    android_aserver->pool_size = pool_size;
+    android_aserver->pool_chunk_size = chunk_size;
+    android_aserver->pool_next_chunk = 0;
+}
+
+static char* android_aserver_acquire_chunk(snd_pcm_android_aserver_t* android_aserver, int* index) {
+    char* chunk = android_aserver->pool_ptr + android_aserver->pool_next_chunk * android_aserver->pool_chunk_size;
+    uint32_t* busy = (uint32_t*)chunk;
+    if (__atomic_load_n(busy, __ATOMIC_ACQUIRE)) return NULL;
+
+    __atomic_store_n(busy, 1, __ATOMIC_RELAXED);
+    *index = android_aserver->pool_next_chunk;
+    android_aserver->pool_next_chunk = (android_aserver->pool_next_chunk + 1) % POOL_CHUNK_COUNT;
+    return chunk + POOL_CHUNK_HEADER_SIZE;
+}
+
 static int android_aserver_close(snd_pcm_ioplug_t* io) {
     snd_pcm_android_aserver_t* android_aserver = io->private_data;
     if (!android_aserver) return 0;
         
     if (android_aserver->fd >= 0) {
-        int request_length = 0;
-        char request_data[MIN_REQUEST_LENGTH];
-        request_data[0] = REQUEST_CODE_CLOSE;
-        *(int*)(request_data + 1) = request_length;
-    
-        int res = write(android_aserver->fd, &request_data, MIN_REQUEST_LENGTH);
-        if (res > 0) close(android_aserver->fd);
+        android_aserver_request(android_aserver, REQUEST_CODE_CLOSE, NULL, 0);
+        close(android_aserver->fd);
     }
     
     if (android_aserver->shm_ptr) {
@@ -133,67 +202,38 @@ static int android_aserver_close(snd_pcm_ioplug_t* io) {
         android_aserver->shm_size = 0;
     }
     
+    android_aserver_release_pool(android_aserver);
     free(android_aserver);
     return 0;
 }
 
 static int android_aserver_start(snd_pcm_ioplug_t* io) {
     snd_pcm_android_aserver_t* android_aserver = io->private_data;
-    
-    int request_length = 0;
-    char request_data[MIN_REQUEST_LENGTH];
-    request_data[0] = REQUEST_CODE_START;
-    *(int*)(request_data + 1) = request_length;
-    
-    int res = write(android_aserver->fd, &request_data, MIN_REQUEST_LENGTH);
-    if (res < 0) return -EINVAL;
-    
-    return 0;
+    return android_aserver_request(android_aserver, REQUEST_CODE_START, NULL, 0);
 }
 
 static int android_aserver_stop(snd_pcm_ioplug_t* io) {
     snd_pcm_android_aserver_t* android_aserver = io->private_data;
-
-    int request_length = 0;
-    char request_data[MIN_REQUEST_LENGTH];
-    request_data[0] = REQUEST_CODE_STOP;
-    *(int*)(request_data + 1) = request_length;
-    
-    int res = write(android_aserver->fd, &request_data, MIN_REQUEST_LENGTH);
-    if (res < 0) return -EINVAL;
-    
-    return 0;
+    return android_aserver_request(android_aserver, REQUEST_CODE_STOP, NULL, 0);
 }
 
 static int android_aserver_pause(snd_pcm_ioplug_t* io, int enable) {
     snd_pcm_android_aserver_t* android_aserver = io->private_data;
-
-    int request_length = 0;
-    char request_data[MIN_REQUEST_LENGTH];
-    request_data[0] = REQUEST_CODE_PAUSE;
-    *(int*)(request_data + 1) = request_length;
-    
-    int res = write(android_aserver->fd, &request_data, MIN_REQUEST_LENGTH);
-    if (res < 0) return -EINVAL;
-    
-    return 0;
+    return android_aserver_request(android_aserver, REQUEST_CODE_PAUSE, NULL, 0);
 }
 
-static int android_aserver_prepare(snd_pcm_ioplug_t* io) {
+static int android_aserver_setup(snd_pcm_ioplug_t* io) {
     snd_pcm_android_aserver_t* android_aserver = io->private_data;
     android_aserver->frame_bytes = (snd_pcm_format_physical_width(io->format) * io->channels) / 8;
     
-    int request_length = 10;
-    char request_data[request_length + MIN_REQUEST_LENGTH];
-    request_data[0] = REQUEST_CODE_PREPARE;
-    *(int*)(request_data + 1) = request_length;
-    request_data[5] = (char)io->channels;
-    request_data[6] = parse_data_type(io->format);
-    *(int*)(request_data + 7) = io->rate;
-    *(int*)(request_data + 11) = io->buffer_size;
+    char request_data[10];
+    request_data[0] = (char)io->channels;
+    request_data[1] = parse_data_type(io->format);
+    *(int*)(request_data + 2) = io->rate;
+    *(int*)(request_data + 6) = io->buffer_size;
     
-    int res = write(android_aserver->fd, &request_data, request_length + MIN_REQUEST_LENGTH);
-    if (res < 0) return -EINVAL;
+    int res = android_aserver_request(android_aserver, REQUEST_CODE_PREPARE, request_data, sizeof(request_data));
+    if (res < 0) return res;
     
     if (android_aserver->use_shm) {
         if (android_aserver->shm_ptr) {
@@ -202,8 +242,14 @@ static int android_aserver_prepare(snd_pcm_ioplug_t* io) {
             android_aserver->shm_size = 0;
         } 
         
-        int fd = android_aserver_recv_fd(android_aserver->fd);
-        if (fd >= 0) {
+        char zero;
+        int fd = -1;
+        if (android_ipc_recv(android_aserver->fd, &zero, 1, &fd, 1) < 0) return -EIO;
+        
+        if (fd < 0) {
+            android_aserver->use_shm = false;
+        }
+        else {
             int shm_size = io->buffer_size * android_aserver->frame_bytes + BUFFER_OFFSET;
             void* shm_ptr = mmap(NULL, shm_size, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
             
@@ -217,10 +263,15 @@ static int android_aserver_prepare(snd_pcm_ioplug_t* io) {
         }
     }    
     
+    if (!android_aserver->use_shm) {
+        android_aserver_release_pool(android_aserver);
+        android_aserver_attach_pool(android_aserver, io->buffer_size * android_aserver->frame_bytes);
+    }
+    
     return 0;
 }
 
-static snd_pcm_sframes_t android_aserver_pointer(snd_pcm_ioplug_t* io) {
+static snd_pcm_sframes_t android_aserver_position(snd_pcm_ioplug_t* io) {
     snd_pcm_android_aserver_t* android_aserver = io->private_data;
     uint32_t position;
     
@@ -228,61 +279,76 @@ static snd_pcm_sframes_t android_aserver_pointer(snd_pcm_ioplug_t* io) {
         position = *(uint32_t*)(android_aserver->shm_ptr);
     }
     else {
-        int request_length = 0;
-        char request_data[MIN_REQUEST_LENGTH];
-        request_data[0] = REQUEST_CODE_POINTER;
-        *(int*)(request_data + 1) = request_length;
-        
-        int res = write(android_aserver->fd, &request_data, MIN_REQUEST_LENGTH);
-        if (res < 0) return 0;
+        int res = android_aserver_request(android_aserver, REQUEST_CODE_POINTER, NULL, 0);
+        if (res < 0) return res;
         
-        res = read(android_aserver->fd, &position, 4);
-        if (res != 4) return 0;
+        if (android_ipc_recv(android_aserver->fd, &position, 4, NULL, 0) < 0) return -EIO;
     }
     
     return position;
 }
 
-static snd_pcm_sframes_t android_aserver_transfer(snd_pcm_ioplug_t* io, const snd_pcm_channel_area_t* areas, snd_pcm_uframes_t offset, snd_pcm_uframes_t size) {
+static snd_pcm_sframes_t android_aserver_write(snd_pcm_ioplug_t* io, const snd_pcm_channel_area_t* areas, snd_pcm_uframes_t offset, snd_pcm_uframes_t size) {
     snd_pcm_android_aserver_t* android_aserver = io->private_data;
 
     char* data = (char*)areas->addr + (areas->first + areas->step * offset) / 8;
 
     int request_length = size * android_aserver->frame_bytes;
-    char request_data[MIN_REQUEST_LENGTH];
-    request_data[0] = REQUEST_CODE_WRITE;
-    *(int*)(request_data + 1) = request_length;
-    
-    if (android_aserver->use_shm) memcpy(android_aserver->shm_ptr + BUFFER_OFFSET, data, request_length);
     
-    int res = write(android_aserver->fd, &request_data, MIN_REQUEST_LENGTH);
-    if (res < 0) return 0;
+    int chunk_index;
+    char* chunk = android_aserver->pool_ptr ? android_aserver_acquire_chunk(android_aserver, &chunk_index) : NULL;
+    if (chunk) {
+        memcpy(chunk, data, request_length);
+        
+        int chunk_request_data[2] = {chunk_index, request_length};
+        int res = android_aserver_request(android_aserver, REQUEST_CODE_WRITE_CHUNK, chunk_request_data, sizeof(chunk_request_data));
+        return res < 0 ? res : size;
+    }
     
+    /* With shared memory the payload is already in place and only its length goes with the request, otherwise the payload
+       follows the request header in the same message. */
     if (android_aserver->use_shm) {
+        memcpy(android_aserver->shm_ptr + BUFFER_OFFSET, data, request_length);
+        
+        if (!android_ipc_send(android_aserver->fd, REQUEST_CODE_WRITE, request_length, NULL, 0, NULL, 0)) return -EIO;
+        
         char success = 0;
-        res = read(android_aserver->fd, &success, 1);
-        if (res != 1 || !success) return 0;
+        if (android_ipc_recv(android_aserver->fd, &success, 1, NULL, 0) < 0 || !success) return -EIO;
     }
     else {
-        res = write(android_aserver->fd, data, request_length);
-        if (res < 0) return 0;        
+        int res = android_aserver_request(android_aserver, REQUEST_CODE_WRITE, data, request_length);
+        if (res < 0) return res;
     }
     
     return size;
 }
 
+/* The callbacks that run per period or on stream setup are marked as trace_marker slices, see android_trace.h. */
+
+static int android_aserver_prepare(snd_pcm_ioplug_t* io) {
+    ANDROID_TRACE_BEGIN("aserver prepare");
+    int res = android_aserver_setup(io);
+    ANDROID_TRACE_END();
+    return res;
+}
+
+static snd_pcm_sframes_t android_aserver_pointer(snd_pcm_ioplug_t* io) {
+    ANDROID_TRACE_BEGIN("aserver pointer");
+    snd_pcm_sframes_t position = android_aserver_position(io);
+    ANDROID_TRACE_END();
+    return position;
+}
+
+static snd_pcm_sframes_t android_aserver_transfer(snd_pcm_ioplug_t* io, const snd_pcm_channel_area_t* areas, snd_pcm_uframes_t offset, snd_pcm_uframes_t size) {
+    ANDROID_TRACE_BEGIN("aserver transfer");
+    snd_pcm_sframes_t res = android_aserver_write(io, areas, offset, size);
+    ANDROID_TRACE_END();
+    return res;
+}
+
 static int android_aserver_drain(snd_pcm_ioplug_t* io) {
     snd_pcm_android_aserver_t* android_aserver = io->private_data;
-
-    int request_length = 0;
-    char request_data[MIN_REQUEST_LENGTH];
-    request_data[0] = REQUEST_CODE_DRAIN;
-    *(int*)(request_data + 1) = request_length;
-    
-    int res = write(android_aserver->fd, &request_data, MIN_REQUEST_LENGTH);
-    if (res < 0) return -EINVAL;
-    
-    return 0;
+    return android_aserver_request(android_aserver, REQUEST_CODE_DRAIN, NULL, 0);
 }
 
 static int android_aserver_hw_params(snd_pcm_ioplug_t* io, snd_pcm_hw_params_t* params) {
@@ -381,33 +447,6 @@ static snd_pcm_ioplug_callback_t android_aserver_callback = {
     .hw_params = android_aserver_hw_params,
 };
 
-static int android_aserver_connect() {
-    char* path = getenv("ANDROID_ALSA_SERVER");
-    
-    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (fd < 0) return -1;
-    
-    struct sockaddr_un server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sun_family = AF_LOCAL;
-    
-    strncpy(server_addr.sun_path, path, sizeof(server_addr.sun_path) - 1);
-    
-    int res;
-    do {
-        res = 0;
-        if (connect(fd, (struct sockaddr*)&server_addr, sizeof(struct sockaddr_un)) < 0) res = -errno;
-    } 
-    while (res == -EINTR);    
-    
-    if (res < 0) {
-        close(fd);
-        return -1;
-    }
-
-    return fd;        
-}
-
 static int android_aserver_create(snd_pcm_t** pcmp, const char* name, snd_pcm_stream_t stream, int mode) {
     snd_pcm_android_aserver_t* android_aserver;
     
@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <alsa/asoundlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include "alsa_local.h"
+#include "android_ipc.h"
+
+#define REQUEST_CODE_CLOSE 0
+#define REQUEST_CODE_STOP 2
+#define REQUEST_CODE_MIDI_OPEN 9
+#define REQUEST_CODE_MIDI_NOTIFY 10
+
+#define MIDI_RING_SIZE 4096
+#define MIDI_RECORD_HEADER_SIZE 12
+#define MIDI_WAIT_INTERVAL_NS 1000000
+
+/* The ring is created by the server and shared with the client, the client is the only writer of head and the server is the only writer
+   of tail. The server also fills in capacity, a power of two no larger than the size the client asked for, which the client checks
+   and then never reads from the ring again. Each record is a monotonic timestamp in nanoseconds, a 4-byte length and the raw MIDI
+   bytes. When the server finds the ring empty it sets server_waiting, looks at head once more and sleeps on the socket until the
+   client sends REQUEST_CODE_MIDI_NOTIFY. The client stores head before it exchanges server_waiting, both sides with sequentially
+   consistent operations, so that either the server sees the new head or the client sees server_waiting set.
+
+   Nothing tells the client when the server frees space, the socket is only the poll descriptor because alsa-lib needs one and it
+   always polls writable. A full ring makes a non-blocking write return -EAGAIN, and a blocking one sleeps in short steps until
+   the server catches up, so polling for room in a non-blocking loop is not supported. */
+
+typedef struct {
+    uint32_t capacity;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t server_waiting;
+} android_midi_ring_t;
+
+typedef struct snd_rawmidi_android_aserver {
+    int fd;
+    int shm_size;
+    uint32_t capacity;
+    android_midi_ring_t* ring;
+    uint8_t* ring_data;
+    bool nonblock;
+} snd_rawmidi_android_aserver_t;
+
+static int android_aserver_socket_type = 0;
+
+static int android_aserver_send_request(int fd, char request_code) {
+    return android_ipc_send(fd, request_code, 0, NULL, 0, NULL, 0) ? 0 : -EIO;
+}
+
+static uint32_t android_midi_ring_free_space(snd_rawmidi_android_aserver_t* android_midi) {
+    uint32_t tail = __atomic_load_n(&android_midi->ring->tail, __ATOMIC_ACQUIRE);
+    return android_midi->capacity - (android_midi->ring->head - tail);
+}
+
+static void android_midi_ring_copy(snd_rawmidi_android_aserver_t* android_midi, uint32_t position, const void* data, uint32_t size) {
+    uint32_t capacity = android_midi->capacity;
+    uint32_t offset = position & (capacity - 1);
+    uint32_t first = capacity - offset < size ? capacity - offset : size;
+
+    memcpy(android_midi->ring_data + offset, data, first);
+    if (first < size) memcpy(android_midi->ring_data, (const uint8_t*)data + first, size - first);
+}
+
+static void android_midi_notify(snd_rawmidi_android_aserver_t* android_midi) {
+    if (__atomic_exchange_n(&android_midi->ring->server_waiting, 0, __ATOMIC_SEQ_CST)) {
+        android_aserver_send_request(android_midi->fd, REQUEST_CODE_MIDI_NOTIFY);
+    }
+}
+
+static void android_midi_wait(snd_rawmidi_android_aserver_t* android_midi) {
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = MIDI_WAIT_INTERVAL_NS};
+    android_midi_notify(android_midi);
+    nanosleep(&interval, NULL);
+}
+
+static int android_midi_close(snd_rawmidi_t* rawmidi) {
+    snd_rawmidi_android_aserver_t* android_midi = rawmidi->private_data;
+
+    if (android_midi->fd >= 0) {
+        android_aserver_send_request(android_midi->fd, REQUEST_CODE_CLOSE);
+        close(android_midi->fd);
+    }
+
+    if (android_midi->ring) munmap(android_midi->ring, android_midi->shm_size);
+
+    /* snd_rawmidi_close() frees the name and the rawmidi itself once this returns. */
+    free(android_midi);
+    return 0;
+}
+
+static int android_midi_nonblock(snd_rawmidi_t* rawmidi, int nonblock) {
+    snd_rawmidi_android_aserver_t* android_midi = rawmidi->private_data;
+    android_midi->nonblock = nonblock != 0;
+    return 0;
+}
+
+static int android_midi_info(snd_rawmidi_t* rawmidi, snd_rawmidi_info_t* info) {
+    struct snd_rawmidi_info* rawmidi_info = RAWMIDI_INFO(info);
+
+    memset(rawmidi_info, 0, sizeof(struct snd_rawmidi_info));
+    rawmidi_info->stream = rawmidi->stream;
+    rawmidi_info->card = -1;
+    rawmidi_info->flags = SNDRV_RAWMIDI_INFO_OUTPUT;
+    strcpy((char*)rawmidi_info->id, "android_aserver");
+    strcpy((char*)rawmidi_info->name, "Android ALSA Server MIDI");
+    strcpy((char*)rawmidi_info->subname, "Android MIDI Synth");
+    rawmidi_info->subdevices_count = 1;
+    rawmidi_info->subdevices_avail = 1;
+    return 0;
+}
+
+static int android_midi_params(snd_rawmidi_t* rawmidi, snd_rawmidi_params_t* params) {
+    snd_rawmidi_android_aserver_t* android_midi = rawmidi->private_data;
+    struct snd_rawmidi_params* rawmidi_params = RAWMIDI_PARAMS(params);
+
+    rawmidi_params->buffer_size = android_midi->capacity;
+    if (rawmidi_params->avail_min > rawmidi_params->buffer_size) rawmidi_params->avail_min = rawmidi_params->buffer_size;
+    return 0;
+}
+
+static int android_midi_status(snd_rawmidi_t* rawmidi, snd_rawmidi_status_t* status) {
+    snd_rawmidi_android_aserver_t* android_midi = rawmidi->private_data;
+    struct snd_rawmidi_status* rawmidi_status = RAWMIDI_STATUS(status);
+
+    memset(rawmidi_status, 0, sizeof(struct snd_rawmidi_status));
+    rawmidi_status->stream = rawmidi->stream;
+    clock_gettime(CLOCK_MONOTONIC, &rawmidi_status->tstamp);
+    rawmidi_status->avail = android_midi_ring_free_space(android_midi);
+    return 0;
+}
+
+static int android_midi_drop(snd_rawmidi_t* rawmidi) {
+    snd_rawmidi_android_aserver_t* android_midi = rawmidi->private_data;
+    return android_aserver_send_request(android_midi->fd, REQUEST_CODE_STOP);
+}
+
+static int android_midi_drain(snd_rawmidi_t* rawmidi) {
+    snd_rawmidi_android_aserver_t* android_midi = rawmidi->private_data;
+
+    while (__atomic_load_n(&android_midi->ring->tail, __ATOMIC_ACQUIRE) != android_midi->ring->head) {
+        if (android_midi->nonblock) return -EAGAIN;
+        android_midi_wait(android_midi);
+    }
+    return 0;
+}
+
+static ssize_t android_midi_write(snd_rawmidi_t* rawmidi, const void* buffer, size_t size) {
+    snd_rawmidi_android_aserver_t* android_midi = rawmidi->private_data;
+    uint32_t max_size = android_midi->capacity - MIDI_RECORD_HEADER_SIZE;
+    if (size > max_size) size = max_size;
+
+    while (android_midi_ring_free_space(android_midi) < size + MIDI_RECORD_HEADER_SIZE) {
+        if (android_midi->nonblock) return -EAGAIN;
+        android_midi_wait(android_midi);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    char record_header[MIDI_RECORD_HEADER_SIZE];
+    *(uint64_t*)(record_header) = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    *(uint32_t*)(record_header + 8) = size;
+
+    uint32_t head = android_midi->ring->head;
+    android_midi_ring_copy(android_midi, head, record_header, MIDI_RECORD_HEADER_SIZE);
+    android_midi_ring_copy(android_midi, head + MIDI_RECORD_HEADER_SIZE, buffer, size);
+    __atomic_store_n(&android_midi->ring->head, head + MIDI_RECORD_HEADER_SIZE + size, __ATOMIC_SEQ_CST);
+
+    android_midi_notify(android_midi);
+    return size;
+}
+
+static ssize_t android_midi_read(snd_rawmidi_t* rawmidi, void* buffer, size_t size) {
+    return -ENOTSUP;
+}
+
+static ssize_t android_midi_tread(snd_rawmidi_t* rawmidi, struct timespec* tstamp, void* buffer, size_t size) {
+    return -ENOTSUP;
+}
+
+static const snd_rawmidi_ops_t android_midi_ops = {
+    .close = android_midi_close,
+    .nonblock = android_midi_nonblock,
+    .info = android_midi_info,
+    .params = android_midi_params,
+    .status = android_midi_status,
+    .drop = android_midi_drop,
+    .drain = android_midi_drain,
+    .write = android_midi_write,
+    .read = android_midi_read,
+    .tread = android_midi_tread,
+};
+
+static int android_midi_open_ring(snd_rawmidi_android_aserver_t* android_midi) {
+    int ring_size = MIDI_RING_SIZE;
+    if (!android_ipc_send(android_midi->fd, REQUEST_CODE_MIDI_OPEN, 4, &ring_size, 4, NULL, 0)) return -EIO;
+
+    char zero;
+    int fd = -1;
+    if (android_ipc_recv(android_midi->fd, &zero, 1, &fd, 1) < 0 || fd < 0) return -EIO;
+
+    int shm_size = sizeof(android_midi_ring_t) + MIDI_RING_SIZE;
+    void* shm_ptr = mmap(NULL, shm_size, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm_ptr == MAP_FAILED) return -ENOMEM;
+
+    android_midi->shm_size = shm_size;
+    android_midi->ring = shm_ptr;
+    android_midi->ring_data = (uint8_t*)shm_ptr + sizeof(android_midi_ring_t);
+
+    uint32_t capacity = __atomic_load_n(&android_midi->ring->capacity, __ATOMIC_ACQUIRE);
+    if (capacity <= MIDI_RECORD_HEADER_SIZE || capacity > MIDI_RING_SIZE || (capacity & (capacity - 1)) != 0) return -EPROTO;
+    android_midi->capacity = capacity;
+    return 0;
+}
+
+int _snd_rawmidi_android_aserver_open(snd_rawmidi_t** inputp, snd_rawmidi_t** outputp, char* name, snd_config_t* root, snd_config_t* conf, int mode) {
+    snd_config_iterator_t i, next;
+
+    snd_config_for_each(i, next, conf) {
+        snd_config_t* n = snd_config_iterator_entry(i);
+        const char* id;
+
+        if (snd_config_get_id(n, &id) < 0) continue;
+        if (strcmp(id, "comment") == 0 || strcmp(id, "type") == 0 || strcmp(id, "hint") == 0) continue;
+
+        return -EINVAL;
+    }
+
+    if (inputp || !outputp) return -ENOTSUP;
+
+    snd_rawmidi_android_aserver_t* android_midi = calloc(1, sizeof(snd_rawmidi_android_aserver_t));
+    if (!android_midi) return -ENOMEM;
+
+    snd_rawmidi_t* rawmidi = calloc(1, sizeof(snd_rawmidi_t));
+    if (!rawmidi) {
+        free(android_midi);
+        return -ENOMEM;
+    }
+
+    int res = -EINVAL;
+    android_midi->fd = android_ipc_connect(getenv("ANDROID_ALSA_SERVER"), &android_aserver_socket_type);
+    if (android_midi->fd < 0) goto error;
+
+    res = android_midi_open_ring(android_midi);
+    if (res < 0) goto error;
+
+    android_midi->nonblock = (mode & SND_RAWMIDI_NONBLOCK) != 0;
+
+    rawmidi->name = name ? strdup(name) : NULL;
+    rawmidi->type = SND_RAWMIDI_TYPE_VIRTUAL;
+    rawmidi->stream = SND_RAWMIDI_STREAM_OUTPUT;
+    rawmidi->mode = mode;
+    rawmidi->poll_fd = android_midi->fd;
+    rawmidi->ops = &android_midi_ops;
+    rawmidi->private_data = android_midi;
+
+    *outputp = rawmidi;
+    return 0;
+
+error:
+    if (android_midi->ring) munmap(android_midi->ring, android_midi->shm_size);
+    if (android_midi->fd >= 0) close(android_midi->fd);
+    free(android_midi);
+    free(rawmidi);
+    return res;
+}
+
+SND_DLSYM_BUILD_VERSION(_snd_rawmidi_android_aserver_open, SND_RAWMIDI_DLSYM_VERSION);
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <alsa/asoundlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include "alsa_local.h"
+#include "android_ipc.h"
+
+#define TIMER_EVENT_LENGTH 16
+#define TIMER_PROTOCOL_VERSION ((2 << 16) | (0 << 8) | 7)
+
+#define REQUEST_CODE_CLOSE 0
+#define REQUEST_CODE_START 1
+#define REQUEST_CODE_STOP 2
+#define REQUEST_CODE_TIMER_OPEN 11
+#define REQUEST_CODE_TIMER_PARAMS 12
+
+/* After REQUEST_CODE_TIMER_OPEN the server replies with the period duration in nanoseconds and then, while started, writes one
+   event each time its output has consumed the requested number of periods: a 4-byte tick count, a 4-byte resolution in
+   nanoseconds and an 8-byte CLOCK_MONOTONIC timestamp in nanoseconds. The socket itself is the poll descriptor, so readers wake
+   exactly on period boundaries of the Android output clock.
+
+   The open request names no PCM stream, each PCM has its own connection and nothing identifies it to the timer. The timer therefore
+   assumes a single stream is playing through the server, the usual case of one game or sequencer. With several streams open the
+   periods it follows are whichever stream the server picks, and the ticks say nothing about the others. */
+
+typedef struct snd_timer_android_aserver {
+    int fd;
+    unsigned int resolution;
+    unsigned int ticks;
+    unsigned int lost;
+    bool nonblock;
+    struct timespec last_tstamp;
+} snd_timer_android_aserver_t;
+
+static int android_aserver_socket_type = 0;
+
+static int android_aserver_send_request(int fd, char request_code) {
+    return android_ipc_send(fd, request_code, 0, NULL, 0, NULL, 0) ? 0 : -EIO;
+}
+
+static int android_timer_close(snd_timer_t* timer) {
+    snd_timer_android_aserver_t* android_timer = timer->private_data;
+
+    if (android_timer->fd >= 0) {
+        android_aserver_send_request(android_timer->fd, REQUEST_CODE_CLOSE);
+        close(android_timer->fd);
+    }
+
+    /* snd_timer_close() frees the name and the timer itself once this returns. */
+    free(android_timer);
+    return 0;
+}
+
+static int android_timer_nonblock(snd_timer_t* timer, int nonblock) {
+    snd_timer_android_aserver_t* android_timer = timer->private_data;
+    android_timer->nonblock = nonblock != 0;
+    return 0;
+}
+
+static int android_timer_async(snd_timer_t* timer, int sig, pid_t pid) {
+    return -ENOSYS;
+}
+
+static int android_timer_info(snd_timer_t* timer, snd_timer_info_t* info) {
+    snd_timer_android_aserver_t* android_timer = timer->private_data;
+    struct snd_timer_info* timer_info = TIMER_INFO(info);
+
+    memset(timer_info, 0, sizeof(struct snd_timer_info));
+    timer_info->card = -1;
+    strcpy((char*)timer_info->id, "android_aserver");
+    strcpy((char*)timer_info->name, "Android ALSA Server Period Timer");
+    timer_info->resolution = android_timer->resolution;
+    return 0;
+}
+
+static int android_timer_params(snd_timer_t* timer, snd_timer_params_t* params) {
+    snd_timer_android_aserver_t* android_timer = timer->private_data;
+    struct snd_timer_params* timer_params = TIMER_PARAMS(params);
+
+    unsigned int ticks = timer_params->ticks > 0 ? timer_params->ticks : 1;
+    if (ticks == android_timer->ticks) return 0;
+
+    if (!android_ipc_send(android_timer->fd, REQUEST_CODE_TIMER_PARAMS, 4, &ticks, 4, NULL, 0)) return -EIO;
+
+    android_timer->ticks = ticks;
+    return 0;
+}
+
+static int android_timer_status(snd_timer_t* timer, snd_timer_status_t* status) {
+    snd_timer_android_aserver_t* android_timer = timer->private_data;
+    struct snd_timer_status* timer_status = TIMER_STATUS(status);
+
+    int pending = 0;
+    ioctl(android_timer->fd, FIONREAD, &pending);
+
+    memset(timer_status, 0, sizeof(struct snd_timer_status));
+    timer_status->tstamp = android_timer->last_tstamp;
+    timer_status->resolution = android_timer->resolution;
+    timer_status->lost = android_timer->lost;
+    timer_status->queue = pending / TIMER_EVENT_LENGTH;
+    return 0;
+}
+
+static int android_timer_start(snd_timer_t* timer) {
+    snd_timer_android_aserver_t* android_timer = timer->private_data;
+    return android_aserver_send_request(android_timer->fd, REQUEST_CODE_START);
+}
+
+static int android_timer_stop(snd_timer_t* timer) {
+    snd_timer_android_aserver_t* android_timer = timer->private_data;
+    return android_aserver_send_request(android_timer->fd, REQUEST_CODE_STOP);
+}
+
+static int android_timer_read_event(snd_timer_android_aserver_t* android_timer, char* event_data) {
+    int res = recv(android_timer->fd, event_data, TIMER_EVENT_LENGTH, android_timer->nonblock ? MSG_DONTWAIT : 0);
+    if (res < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? -EAGAIN : -EIO;
+    if (res == 0) return -ENODEV;
+
+    if (res < TIMER_EVENT_LENGTH) {
+        int remaining = recv(android_timer->fd, event_data + res, TIMER_EVENT_LENGTH - res, MSG_WAITALL);
+        if (remaining != TIMER_EVENT_LENGTH - res) return -EIO;
+    }
+
+    uint64_t timestamp = *(uint64_t*)(event_data + 8);
+    android_timer->resolution = *(uint32_t*)(event_data + 4);
+    android_timer->last_tstamp.tv_sec = timestamp / 1000000000ULL;
+    android_timer->last_tstamp.tv_nsec = timestamp % 1000000000ULL;
+    return 0;
+}
+
+static ssize_t android_timer_read(snd_timer_t* timer, void* buffer, size_t size) {
+    snd_timer_android_aserver_t* android_timer = timer->private_data;
+    bool tread = (timer->mode & SND_TIMER_OPEN_TREAD) != 0;
+    size_t record_size = tread ? sizeof(snd_timer_tread_t) : sizeof(snd_timer_read_t);
+    size_t count = 0;
+
+    while (count + record_size <= size) {
+        char event_data[TIMER_EVENT_LENGTH];
+        if (count > 0) {
+            int pending = 0;
+            ioctl(android_timer->fd, FIONREAD, &pending);
+            if (pending < TIMER_EVENT_LENGTH) break;
+        }
+
+        int res = android_timer_read_event(android_timer, event_data);
+        if (res < 0) return count > 0 ? count : res;
+
+        unsigned int ticks = *(uint32_t*)(event_data);
+        if (tread) {
+            snd_timer_tread_t* record = (snd_timer_tread_t*)((char*)buffer + count);
+            record->event = SND_TIMER_EVENT_TICK;
+            record->tstamp = android_timer->last_tstamp;
+            record->val = ticks;
+        }
+        else {
+            snd_timer_read_t* record = (snd_timer_read_t*)((char*)buffer + count);
+            record->resolution = android_timer->resolution;
+            record->ticks = ticks;
+        }
+
+        if (ticks > android_timer->ticks) android_timer->lost += ticks - android_timer->ticks;
+        count += record_size;
+    }
+
+    return count;
+}
+
+static const snd_timer_ops_t android_timer_ops = {
+    .close = android_timer_close,
+    .nonblock = android_timer_nonblock,
+    .async = android_timer_async,
+    .info = android_timer_info,
+    .params = android_timer_params,
+    .status = android_timer_status,
+    .rt_start = android_timer_start,
+    .rt_stop = android_timer_stop,
+    .rt_continue = android_timer_start,
+    .read = android_timer_read,
+};
+
+static int android_timer_open_source(snd_timer_android_aserver_t* android_timer) {
+    int res = android_aserver_send_request(android_timer->fd, REQUEST_CODE_TIMER_OPEN);
+    if (res < 0) return res;
+
+    int resolution;
+    if (android_ipc_recv(android_timer->fd, &resolution, 4, NULL, 0) < 0 || resolution <= 0) return -EIO;
+
+    android_timer->resolution = resolution;
+    android_timer->ticks = 1;
+    return 0;
+}
+
+int _snd_timer_android_aserver_open(snd_timer_t** timerp, char* name, snd_config_t* root, snd_config_t* conf, int mode) {
+    snd_config_iterator_t i, next;
+
+    snd_config_for_each(i, next, conf) {
+        snd_config_t* n = snd_config_iterator_entry(i);
+        const char* id;
+
+        if (snd_config_get_id(n, &id) < 0) continue;
+        if (strcmp(id, "comment") == 0 || strcmp(id, "type") == 0 || strcmp(id, "hint") == 0) continue;
+
+        return -EINVAL;
+    }
+
+    snd_timer_android_aserver_t* android_timer = calloc(1, sizeof(snd_timer_android_aserver_t));
+    if (!android_timer) return -ENOMEM;
+
+    snd_timer_t* timer = calloc(1, sizeof(snd_timer_t));
+    if (!timer) {
+        free(android_timer);
+        return -ENOMEM;
+    }
+
+    int res = -EINVAL;
+    android_timer->fd = android_ipc_connect(getenv("ANDROID_ALSA_SERVER"), &android_aserver_socket_type);
+    if (android_timer->fd < 0) goto error;
+
+    res = android_timer_open_source(android_timer);
+    if (res < 0) goto error;
+
+    android_timer->nonblock = (mode & SND_TIMER_OPEN_NONBLOCK) != 0;
+
+    timer->version = TIMER_PROTOCOL_VERSION;
+    timer->name = name ? strdup(name) : NULL;
+    timer->type = SND_TIMER_TYPE_SHM;
+    timer->mode = mode;
+    timer->poll_fd = android_timer->fd;
+    timer->ops = &android_timer_ops;
+    timer->private_data = android_timer;
+    timer->async_handlers.next = &timer->async_handlers;
+    timer->async_handlers.prev = &timer->async_handlers;
+
+    *timerp = timer;
+    return 0;
+
+error:
+    if (android_timer->fd >= 0) close(android_timer->fd);
+    free(android_timer);
+    free(timer);
+    return res;
+}
+
+SND_DLSYM_BUILD_VERSION(_snd_timer_android_aserver_open, SND_TIMER_DLSYM_VERSION);
@@ -0,0 +1,124 @@
+#ifndef __COMPONENT_INSTALLER
+#define __COMPONENT_INSTALLER
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "sha256.h"
+
+#define COMPONENT_ERROR_LENGTH 256
+#define MANIFEST_NAME "manifest.txt"
+
+/* Every component directory has a manifest.txt next to its archives, written by "component_installer manifest". Lines are
+   space separated and the path is always the last field, so it may contain spaces:
+     component <name>
+     version <name> <archive file> <archive size> <archive sha256> <installed size>
+     file <octal mode> <size> <sha256> <path>
+   The file lines following a version line are the regular files of that archive, sorted by path, which is relative to the
+   directory the archive is extracted into. Hard links are listed as files with the contents of their target. */
+
+typedef struct {
+    char* path;
+    int mode;
+    uint64_t size;
+    uint8_t hash[SHA256_SIZE];
+} manifest_file_t;
+
+typedef struct {
+    char* name;
+    char* archive;
+    uint64_t archive_size;
+    uint8_t archive_hash[SHA256_SIZE];
+    uint64_t installed_size;
+    int file_count;
+    int file_capacity;
+    manifest_file_t* files;
+} manifest_version_t;
+
+typedef struct {
+    char* component;
+    int version_count;
+    manifest_version_t* versions;
+} manifest_t;
+
+typedef struct {
+    const char* archive_path;
+    const char* dest_path;
+    const char* store_path;
+    const manifest_version_t* manifest;
+    manifest_version_t* scan;
+    const char* const* filters;
+    int filter_count;
+    int result;
+    char error[COMPONENT_ERROR_LENGTH];
+} tzst_job_t;
+
+/* Extracts the archive of each job into its destination directory, which is created when missing. Up to
+   TZST_MAX_PARALLEL_ARCHIVES archives are extracted at once and share a pool of writer_count threads (0 picks the default).
+   Each job ends with result 0 or a negative errno and a message in error, the call returns 0 when every job succeeded.
+
+   With a manifest, the job fails up front when the destination lacks the space for the files it has to write, skips the files
+   that are already there with the same hash, and checks the archive and every file it writes against their hash while they
+   stream. Without a dest_path the archive is only read, and scan receives its size, hash and files.
+
+   With a store_path the regular files go into the store instead, and are linked into the destination once all of them are
+   written. A manifest then lets the job skip the files the store already has, whichever component or version brought them.
+
+   With filters only the paths under one of them are extracted, straight from their frames when the archive is seekable and none
+   of them is a link. */
+
+#define TZST_MAX_PARALLEL_ARCHIVES 4
+
+extern int tzst_extract(tzst_job_t* jobs, int count, int writer_count);
+extern bool tzst_path_selected(const tzst_job_t* job, const char* path);
+extern char* tzst_clean_path(char* path);
+extern int tzst_open_parent(int dir_fd, const char* path, bool create, const char** name);
+extern bool tzst_has_file(int dir_fd, const char* path, uint64_t size, const uint8_t* hash);
+extern uint64_t tzst_parse_number(const char* field, int length);
+extern bool tzst_verify_header(const unsigned char* header);
+
+/* Seekable packages, which keep a file index and a frame per file, see seekable.c. seekable_extract() returns -ENOTSUP for any
+   other archive, which is then streamed. */
+
+#define SEEKABLE_DEFAULT_LEVEL 19
+
+extern int seekable_pack(const char* dir_path, const char* archive_path, int level, char* error);
+extern int seekable_extract(tzst_job_t* job, int dest_fd, int thread_count);
+extern int seekable_verify(const char* archive_path, int thread_count, int* file_count, char* error);
+
+/* A content-addressed store of component files shared by all containers, see store.c. */
+
+#define STORE_OBJECTS_DIR "objects"
+#define STORE_TEMP_DIR "tmp"
+#define STORE_VERSIONS_DIR "versions"
+#define STORE_LINKS_DIR ".components"
+#define STORE_OBJECT_MODE 0555
+#define STORE_OBJECT_PATH_LENGTH (sizeof(STORE_OBJECTS_DIR) + SHA256_HEX_SIZE + 16)
+
+extern int store_open(const char* path);
+extern void store_object_path(const uint8_t* hash, int mode, char* path);
+extern int store_prepare_object(int store_fd, const char* object_path);
+extern bool store_has_object(int store_fd, const manifest_file_t* file);
+extern int store_link(int store_fd, const manifest_version_t* version, int dest_fd, char* error);
+extern int store_prune(int store_fd, uint64_t* freed_bytes, int* freed_objects);
+extern int store_list_tree(const char* path, manifest_version_t* list);
+extern int store_activate(const char* store_path, const char* component, const char* version, const char* dest_path, char* error);
+
+/* Delta packages between two unpacked versions of a component, see delta.c. */
+
+#define DELTA_DEFAULT_LEVEL 19
+
+extern int delta_create(const char* from_path, const char* to_path, const char* delta_path, int level, char* error);
+extern int delta_apply(const char* delta_path, const char* from_path, const char* dest_path, const char* store_path, char* error);
+
+extern int manifest_load(const char* path, manifest_t* manifest);
+extern int manifest_save(const char* path, const manifest_t* manifest);
+extern void manifest_free(manifest_t* manifest);
+extern void manifest_version_free(manifest_version_t* version);
+extern manifest_file_t* manifest_add_file(manifest_version_t* version, const char* path, int mode, uint64_t size, const uint8_t* hash);
+extern void manifest_sort_files(manifest_version_t* version);
+extern const manifest_version_t* manifest_find_archive(const manifest_t* manifest, const char* archive);
+extern const manifest_version_t* manifest_find_version(const manifest_t* manifest, const char* name);
+extern const manifest_file_t* manifest_find_file(const manifest_version_t* version, const char* path);
+
+#endif
@@ -0,0 +1,539 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <zstd.h>
+#include "component_installer.h"
+
+#define DELTA_MAGIC "zdelta 1"
+#define DELTA_MIN_WINDOW_LOG 10
+#define DELTA_MAX_WINDOW_LOG 27
+
+/* A delta package turns the unpacked tree of one version of a component into the next one. It starts with a text index:
+     zdelta 1
+     base <size> <sha256> <path>
+     file <octal mode> <size> <mtime> <sha256> <path>
+     end
+   followed by a single zstd frame. The base lines are the files of the previous version, and their contents concatenated in
+   that order are the prefix the frame was compressed against, the way "zstd --patch-from" does. The file lines are the files of
+   the new version. One with the same hash as a base is copied from it, the contents of the others are the frame, in order.
+
+   The whole tree goes in one frame rather than one per file, because the 32 and 64-bit builds of a library have a lot in common
+   and recompiled binaries match their previous version in many small pieces spread over the whole file. The frame is
+   decompressed in one call into a buffer the size of the changed files, so the decoder needs no window next to the prefix.
+
+   The base files are checked against their hash before anything is decompressed, which catches a previous version that was
+   modified after it was unpacked, and every rebuilt file against its own. With a store the rebuilt files become objects, and
+   nothing is decompressed at all when the store already has every file. */
+
+typedef struct {
+    char* path;
+    int mode;
+    uint64_t size;
+    time_t mtime;
+    uint8_t hash[SHA256_SIZE];
+    int base;
+} delta_entry_t;
+
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} delta_buffer_t;
+
+typedef struct {
+    int base_count;
+    delta_entry_t* bases;
+    int file_count;
+    delta_entry_t* files;
+} delta_index_t;
+
+static void delta_error(char* error, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(error, COMPONENT_ERROR_LENGTH, format, args);
+    va_end(args);
+}
+
+static void delta_hash(const void* data, size_t size, uint8_t* digest) {
+    sha256_t sha;
+    sha256_init(&sha);
+    sha256_update(&sha, data, size);
+    sha256_final(&sha, digest);
+}
+
+static int delta_window_log(size_t size) {
+    int log = DELTA_MIN_WINDOW_LOG;
+    while (log < DELTA_MAX_WINDOW_LOG && ((size_t)1 << log) < size) log++;
+    return log;
+}
+
+/* Appends the file at path beneath dir_fd to buffer and fills in the size, mode, mtime and hash of entry. Neither the file nor a
+   directory on the way may be a symlink. */
+static int delta_read_file(int dir_fd, const char* path, delta_buffer_t* buffer, delta_entry_t* entry) {
+    const char* name;
+    int parent_fd = tzst_open_parent(dir_fd, path, false, &name);
+    if (parent_fd < 0) return errno == ELOOP || errno == ENOTDIR || errno == EXDEV ? -EINVAL : -errno;
+
+    int fd = openat(parent_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    int error = errno;
+    close(parent_fd);
+    if (fd < 0) return error == ELOOP ? -EINVAL : -error;
+
+    struct stat file_stat;
+    int res = fstat(fd, &file_stat) == 0 ? 0 : -errno;
+    if (res == 0 && !S_ISREG(file_stat.st_mode)) res = -EINVAL;
+
+    if (res == 0 && buffer->length + file_stat.st_size > buffer->capacity) {
+        size_t capacity = (buffer->length + file_stat.st_size) * 2;
+        char* data = realloc(buffer->data, capacity);
+        if (data) {
+            buffer->data = data;
+            buffer->capacity = capacity;
+        }
+        else res = -ENOMEM;
+    }
+
+    for (off_t offset = 0; res == 0 && offset < file_stat.st_size; ) {
+        ssize_t count = read(fd, buffer->data + buffer->length + offset, file_stat.st_size - offset);
+        if (count < 0 && errno != EINTR) res = -errno;
+        if (count == 0) res = -EIO;
+        if (count > 0) offset += count;
+    }
+
+    if (res == 0) {
+        entry->mode = file_stat.st_mode & 07777;
+        entry->size = file_stat.st_size;
+        entry->mtime = file_stat.st_mtime;
+        delta_hash(buffer->data + buffer->length, entry->size, entry->hash);
+        buffer->length += entry->size;
+    }
+
+    close(fd);
+    return res;
+}
+
+static int delta_find_base(const delta_index_t* index, const uint8_t* hash) {
+    for (int i = 0; i < index->base_count; i++) {
+        if (memcmp(index->bases[i].hash, hash, SHA256_SIZE) == 0) return i;
+    }
+    return -1;
+}
+
+static delta_entry_t* delta_add_entry(delta_entry_t** entries, int* count, const char* path) {
+    delta_entry_t* grown = realloc(*entries, (*count + 1) * sizeof(delta_entry_t));
+    if (!grown) return NULL;
+    *entries = grown;
+
+    delta_entry_t* entry = &grown[(*count)++];
+    memset(entry, 0, sizeof(delta_entry_t));
+    entry->base = -1;
+    entry->path = strdup(path);
+    return entry->path ? entry : NULL;
+}
+
+static void delta_index_free(delta_index_t* index) {
+    for (int i = 0; i < index->base_count; i++) free(index->bases[i].path);
+    for (int i = 0; i < index->file_count; i++) free(index->files[i].path);
+    free(index->bases);
+    free(index->files);
+    memset(index, 0, sizeof(delta_index_t));
+}
+
+/* Reads every file below dir_path into buffer, in path order, adding an entry for each. */
+static int delta_read_tree(const char* dir_path, delta_buffer_t* buffer, delta_entry_t** entries, int* count, char* error) {
+    manifest_version_t list = {0};
+    int res = store_list_tree(dir_path, &list);
+    if (res < 0) delta_error(error, "%s: %s", dir_path, strerror(-res));
+    manifest_sort_files(&list);
+
+    int dir_fd = res == 0 ? open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+    if (res == 0 && dir_fd < 0) {
+        res = -errno;
+        delta_error(error, "%s: %s", dir_path, strerror(-res));
+    }
+
+    for (int i = 0; i < list.file_count && res == 0; i++) {
+        delta_entry_t* entry = delta_add_entry(entries, count, list.files[i].path);
+        res = entry ? delta_read_file(dir_fd, list.files[i].path, buffer, entry) : -ENOMEM;
+        if (res == -EINVAL) {
+            delta_error(error, "%s/%s: only regular files can go in a delta", dir_path, list.files[i].path);
+        }
+        else if (res < 0) delta_error(error, "%s/%s: %s", dir_path, list.files[i].path, strerror(-res));
+    }
+
+    if (dir_fd >= 0) close(dir_fd);
+    manifest_version_free(&list);
+    return res;
+}
+
+int delta_create(const char* from_path, const char* to_path, const char* delta_path, int level, char* error) {
+    delta_index_t index = {0};
+    delta_buffer_t prefix = {0}, files = {0};
+
+    int res = delta_read_tree(from_path, &prefix, &index.bases, &index.base_count, error);
+    if (res == 0) res = delta_read_tree(to_path, &files, &index.files, &index.file_count, error);
+
+    /* Moves the files that are not already somewhere in the previous version to the front, they are all the frame holds. */
+    size_t target_size = 0;
+    size_t offset = 0;
+    for (int i = 0; i < index.file_count && res == 0; i++) {
+        delta_entry_t* entry = &index.files[i];
+        entry->base = delta_find_base(&index, entry->hash);
+        if (entry->base < 0) {
+            memmove(files.data + target_size, files.data + offset, entry->size);
+            target_size += entry->size;
+        }
+        offset += entry->size;
+    }
+
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    size_t capacity = ZSTD_compressBound(target_size);
+    char* frame = malloc(capacity);
+    size_t frame_size = 0;
+    if (res == 0 && (!cctx || !frame)) {
+        delta_error(error, "out of memory");
+        res = -ENOMEM;
+    }
+
+    if (res == 0) {
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, delta_window_log(prefix.length + target_size));
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, 1);
+        if (prefix.length > 0) ZSTD_CCtx_refPrefix(cctx, prefix.data, prefix.length);
+
+        frame_size = ZSTD_compress2(cctx, frame, capacity, files.data, target_size);
+        if (ZSTD_isError(frame_size)) {
+            delta_error(error, "%s: %s", delta_path, ZSTD_getErrorName(frame_size));
+            res = -EIO;
+        }
+    }
+
+    if (res == 0) {
+        char temp_path[PATH_MAX];
+        snprintf(temp_path, sizeof(temp_path), "%s.tmp", delta_path);
+
+        FILE* file = fopen(temp_path, "we");
+        if (file) {
+            char hex[SHA256_HEX_SIZE];
+            fprintf(file, "%s\n", DELTA_MAGIC);
+            for (int i = 0; i < index.base_count; i++) {
+                sha256_to_hex(index.bases[i].hash, hex);
+                fprintf(file, "base %" PRIu64 " %s %s\n", index.bases[i].size, hex, index.bases[i].path);
+            }
+            for (int i = 0; i < index.file_count; i++) {
+                const delta_entry_t* entry = &index.files[i];
+                sha256_to_hex(entry->hash, hex);
+                fprintf(file, "file %o %" PRIu64 " %lld %s %s\n", entry->mode, entry->size, (long long)entry->mtime, hex, entry->path);
+            }
+            fprintf(file, "end\n");
+            fwrite(frame, 1, frame_size, file);
+
+            res = ferror(file) ? -EIO : 0;
+            if (fclose(file) != 0 && res == 0) res = -errno;
+            if (res == 0 && rename(temp_path, delta_path) < 0) res = -errno;
+            if (res < 0) remove(temp_path);
+        }
+        else res = -errno;
+        if (res < 0) delta_error(error, "%s: %s", delta_path, strerror(-res));
+    }
+
+    free(frame);
+    if (cctx) ZSTD_freeCCtx(cctx);
+    free(prefix.data);
+    free(files.data);
+    delta_index_free(&index);
+    return res;
+}
+
+/* Returns the field starting at line and moves line past it and the space that follows, or NULL when line is at its end. */
+static char* delta_next_field(char** line) {
+    char* field = *line;
+    if (!*field) return NULL;
+
+    char* space = strchr(field, ' ');
+    if (space) {
+        *space = '\0';
+        *line = space + 1;
+    }
+    else *line = field + strlen(field);
+    return field;
+}
+
+/* Paths come from the package and get the checks archive entries get: the rest of the line must be a relative path without a
+   ".." component, and every file is then opened or written through tzst_open_parent(), which refuses a symlink on the way. */
+static char* delta_parse_path(char* line) {
+    char* path = *line ? tzst_clean_path(line) : NULL;
+    return path && *path ? path : NULL;
+}
+
+static int delta_parse_line(delta_index_t* index, char* line) {
+    char* kind = delta_next_field(&line);
+    if (!kind) return -EINVAL;
+
+    if (strcmp(kind, "base") == 0) {
+        char* size = delta_next_field(&line);
+        char* hash = delta_next_field(&line);
+        char* path = delta_parse_path(line);
+        if (!hash || !path) return -EINVAL;
+
+        delta_entry_t* entry = delta_add_entry(&index->bases, &index->base_count, path);
+        if (!entry) return -ENOMEM;
+        entry->size = strtoull(size, NULL, 10);
+        return sha256_from_hex(hash, entry->hash) == 0 ? 0 : -EINVAL;
+    }
+
+    if (strcmp(kind, "file") == 0) {
+        char* mode = delta_next_field(&line);
+        char* size = delta_next_field(&line);
+        char* mtime = delta_next_field(&line);
+        char* hash = delta_next_field(&line);
+        char* path = delta_parse_path(line);
+        if (!hash || !path) return -EINVAL;
+
+        delta_entry_t* entry = delta_add_entry(&index->files, &index->file_count, path);
+        if (!entry) return -ENOMEM;
+        entry->mode = strtol(mode, NULL, 8);
+        entry->size = strtoull(size, NULL, 10);
+        entry->mtime = strtoll(mtime, NULL, 10);
+        if (sha256_from_hex(hash, entry->hash) < 0) return -EINVAL;
+
+        entry->base = delta_find_base(index, entry->hash);
+        return 0;
+    }
+
+    return -EINVAL;
+}
+
+/* Reads the index up to its end line, leaving file at the frame. */
+static int delta_read_index(FILE* file, delta_index_t* index) {
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int res = -EINVAL;
+    bool magic = false;
+
+    while ((length = getline(&line, &capacity, file)) >= 0) {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) line[--length] = '\0';
+
+        if (!magic) {
+            magic = strcmp(line, DELTA_MAGIC) == 0;
+            if (!magic) break;
+        }
+        else if (strcmp(line, "end") == 0) {
+            res = 0;
+            break;
+        }
+        else if (delta_parse_line(index, line) < 0) break;
+    }
+
+    free(line);
+    return res;
+}
+
+static int delta_make_parents(int dir_fd, const char* path) {
+    char parent[PATH_MAX];
+    snprintf(parent, sizeof(parent), "%s", path);
+
+    for (char* slash = strchr(parent, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdirat(dir_fd, parent, 0755) < 0 && errno != EEXIST) return -errno;
+        *slash = '/';
+    }
+    return 0;
+}
+
+/* Writes data to temp_path and renames it to path, both relative to dir_fd, whose parent directories the caller has made. */
+static int delta_write_file(int dir_fd, const char* temp_path, const char* path, int mode, time_t mtime, const void* data, size_t size) {
+    int res = 0;
+    unlinkat(dir_fd, temp_path, 0);
+    int fd = openat(dir_fd, temp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+    if (fd < 0) return -errno;
+
+    for (size_t written = 0; written < size && res == 0; ) {
+        ssize_t count = write(fd, (const char*)data + written, size - written);
+        if (count < 0 && errno != EINTR) res = -errno;
+        if (count > 0) written += count;
+    }
+
+    struct timespec times[2] = {{0, UTIME_OMIT}, {mtime, 0}};
+    if (res == 0) futimens(fd, times);
+    if (close(fd) < 0 && res == 0) res = -errno;
+    if (res == 0 && renameat(dir_fd, temp_path, dir_fd, path) < 0) res = -errno;
+    if (res < 0) unlinkat(dir_fd, temp_path, 0);
+    return res;
+}
+
+/* Loads the previous version in base order into prefix and decompresses the frame against it into output. */
+static int delta_rebuild(FILE* file, const char* from_path, const delta_index_t* index, delta_buffer_t* prefix, delta_buffer_t* output, char* error) {
+    int from_fd = open(from_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (from_fd < 0) {
+        delta_error(error, "%s: %s", from_path, strerror(errno));
+        return -errno;
+    }
+
+    for (int i = 0; i < index->base_count; i++) {
+        const delta_entry_t* base = &index->bases[i];
+        delta_entry_t found;
+
+        int res = delta_read_file(from_fd, base->path, prefix, &found);
+        if (res == 0 && (found.size != base->size || memcmp(found.hash, base->hash, SHA256_SIZE) != 0)) {
+            delta_error(error, "%s/%s differs from the version the delta was made from", from_path, base->path);
+            res = -EBADMSG;
+        }
+        else if (res < 0) delta_error(error, "%s/%s: %s", from_path, base->path, strerror(-res));
+        if (res < 0) {
+            close(from_fd);
+            return res;
+        }
+    }
+    close(from_fd);
+
+    size_t target_size = 0;
+    for (int i = 0; i < index->file_count; i++) {
+        if (index->files[i].base < 0) target_size += index->files[i].size;
+    }
+
+    struct stat file_stat;
+    long frame_start = ftell(file);
+    size_t frame_size = fstat(fileno(file), &file_stat) == 0 && file_stat.st_size > frame_start ? file_stat.st_size - frame_start : 0;
+
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    char* frame = malloc(frame_size + 1);
+    output->data = malloc(target_size + 1);
+    int res = 0;
+    if (!dctx || !frame || !output->data) {
+        delta_error(error, "out of memory");
+        res = -ENOMEM;
+    }
+    else if (fread(frame, 1, frame_size, file) != frame_size) {
+        delta_error(error, "cannot read the delta package");
+        res = -EIO;
+    }
+
+    if (res == 0) {
+        ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, DELTA_MAX_WINDOW_LOG);
+        if (prefix->length > 0) ZSTD_DCtx_refPrefix(dctx, prefix->data, prefix->length);
+
+        size_t size = ZSTD_decompressDCtx(dctx, output->data, target_size + 1, frame, frame_size);
+        if (ZSTD_isError(size) || size != target_size) {
+            delta_error(error, "corrupt delta package: %s", ZSTD_isError(size) ? ZSTD_getErrorName(size) : "wrong size");
+            res = -EBADMSG;
+        }
+        else output->length = size;
+    }
+
+    if (dctx) ZSTD_freeDCtx(dctx);
+    free(frame);
+    return res;
+}
+
+int delta_apply(const char* delta_path, const char* from_path, const char* dest_path, const char* store_path, char* error) {
+    FILE* file = fopen(delta_path, "re");
+    if (!file) {
+        delta_error(error, "%s: %s", delta_path, strerror(errno));
+        return -errno;
+    }
+
+    delta_index_t index = {0};
+    int res = delta_read_index(file, &index);
+    if (res < 0) delta_error(error, "%s: not a delta package", delta_path);
+
+    int store_fd = -1;
+    if (res == 0 && store_path && (store_fd = store_open(store_path)) < 0) {
+        res = store_fd;
+        delta_error(error, "%s: %s", store_path, strerror(-res));
+    }
+
+    mkdir(dest_path, 0755);
+    int dest_fd = res == 0 ? open(dest_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+    if (res == 0 && dest_fd < 0) {
+        res = -errno;
+        delta_error(error, "%s: %s", dest_path, strerror(-res));
+    }
+
+    manifest_version_t files = {0};
+    bool* present = calloc(index.file_count + 1, sizeof(bool));
+    size_t* base_offsets = calloc(index.base_count + 1, sizeof(size_t));
+    bool needed = false;
+    if (res == 0 && (!present || !base_offsets)) {
+        delta_error(error, "out of memory");
+        res = -ENOMEM;
+    }
+
+    for (int i = 0; i < index.file_count && res == 0; i++) {
+        const delta_entry_t* entry = &index.files[i];
+        if (store_fd >= 0) {
+            manifest_file_t* listed = manifest_add_file(&files, entry->path, entry->mode, entry->size, entry->hash);
+            if (!listed) {
+                delta_error(error, "out of memory");
+                res = -ENOMEM;
+            }
+            else present[i] = store_has_object(store_fd, listed);
+        }
+        if (!present[i]) needed = true;
+    }
+
+    delta_buffer_t prefix = {0}, output = {0};
+    if (res == 0 && needed) res = delta_rebuild(file, from_path, &index, &prefix, &output, error);
+
+    size_t offset = 0;
+    for (int i = 0; i < index.base_count && res == 0; i++) {
+        base_offsets[i] = offset;
+        offset += index.bases[i].size;
+    }
+
+    offset = 0;
+    for (int i = 0; i < index.file_count && res == 0; i++) {
+        const delta_entry_t* entry = &index.files[i];
+        const char* data = entry->base >= 0 ? prefix.data + base_offsets[entry->base] : output.data + offset;
+        if (entry->base < 0) offset += entry->size;
+        if (present[i]) continue;
+
+        uint8_t digest[SHA256_SIZE];
+        delta_hash(data, entry->size, digest);
+        if (memcmp(digest, entry->hash, SHA256_SIZE) != 0) {
+            delta_error(error, "%s: rebuilt file does not match the delta", entry->path);
+            res = -EBADMSG;
+        }
+        else if (store_fd >= 0) {
+            char object_path[STORE_OBJECT_PATH_LENGTH];
+            char temp_path[64];
+            store_object_path(entry->hash, entry->mode, object_path);
+            snprintf(temp_path, sizeof(temp_path), "%s/%d.delta", STORE_TEMP_DIR, getpid());
+            res = delta_make_parents(store_fd, object_path);
+            if (res == 0) res = delta_write_file(store_fd, temp_path, object_path, entry->mode & STORE_OBJECT_MODE, entry->mtime, data, entry->size);
+            if (res < 0) delta_error(error, "%s: %s", object_path, strerror(-res));
+        }
+        else {
+            const char* name;
+            char temp_name[NAME_MAX + 1];
+            int parent_fd = tzst_open_parent(dest_fd, entry->path, true, &name);
+            if (parent_fd < 0) res = -errno;
+            else if (snprintf(temp_name, sizeof(temp_name), "%s.%d.tmp", name, getpid()) >= (int)sizeof(temp_name)) res = -ENAMETOOLONG;
+            else res = delta_write_file(parent_fd, temp_name, name, entry->mode, entry->mtime, data, entry->size);
+            if (parent_fd >= 0) close(parent_fd);
+            if (res < 0) delta_error(error, "%s: %s", entry->path, strerror(-res));
+        }
+    }
+
+    if (res == 0 && store_fd >= 0) res = store_link(store_fd, &files, dest_fd, error);
+
+    free(base_offsets);
+    free(present);
+    free(prefix.data);
+    free(output.data);
+    manifest_version_free(&files);
+    delta_index_free(&index);
+    if (dest_fd >= 0) close(dest_fd);
+    if (store_fd >= 0) close(store_fd);
+    fclose(file);
+    return res;
+}
@@ -0,0 +1,443 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "component_installer.h"
+
+#define ARCHIVE_SUFFIX ".tzst"
+#define INDEX_NAME "index.txt"
+#define MAX_MANIFESTS 16
+#define MAX_FILTERS 16
+
+static int usage(void) {
+    fprintf(stderr, "usage: component_installer extract [-j writers] [-m manifest...] [-s store | -p path...] <archive.tzst> <dest dir> [<archive.tzst> <dest dir>...]\n");
+    fprintf(stderr, "       component_installer manifest <component dir>\n");
+    fprintf(stderr, "       component_installer link <store> <manifest> <version> <dest dir>\n");
+    fprintf(stderr, "       component_installer prune <store>\n");
+    fprintf(stderr, "       component_installer add <store> <component dir> [<version>...]\n");
+    fprintf(stderr, "       component_installer activate <store> <component> <version> <dest dir>\n");
+    fprintf(stderr, "       component_installer delta [-l level] <from dir> <to dir> <delta file>\n");
+    fprintf(stderr, "       component_installer patch [-s store] <delta file> <from dir> <dest dir>\n");
+    fprintf(stderr, "       component_installer pack [-l level] <dir> <archive.tzst>\n");
+    fprintf(stderr, "       component_installer verify [-j threads] <archive.tzst>\n");
+    return 2;
+}
+
+static bool has_suffix(const char* name, const char* suffix) {
+    int length = strlen(name);
+    int suffix_length = strlen(suffix);
+    return length > suffix_length && strcmp(name + length - suffix_length, suffix) == 0;
+}
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static int command_extract(int argc, char** argv) {
+    int writer_count = 0;
+    const char* manifest_paths[MAX_MANIFESTS];
+    int manifest_count = 0;
+    const char* store_path = NULL;
+    const char* filters[MAX_FILTERS];
+    int filter_count = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:m:s:p:")) != -1) {
+        if (opt == 'j') {
+            writer_count = atoi(optarg);
+        }
+        else if (opt == 's') {
+            store_path = optarg;
+        }
+        else if (opt == 'm' && manifest_count < MAX_MANIFESTS) {
+            manifest_paths[manifest_count++] = optarg;
+        }
+        else if (opt == 'p' && filter_count < MAX_FILTERS) {
+            filters[filter_count++] = optarg;
+        }
+        else return usage();
+    }
+
+    int count = (argc - optind) / 2;
+    if (count == 0 || (argc - optind) % 2 != 0 || (store_path && filter_count > 0)) return usage();
+
+    int result = 0;
+    manifest_t manifests[MAX_MANIFESTS] = {0};
+    for (int i = 0; i < manifest_count && result == 0; i++) {
+        result = manifest_load(manifest_paths[i], &manifests[i]);
+        if (result < 0) fprintf(stderr, "component_installer: %s: %s\n", manifest_paths[i], strerror(-result));
+    }
+
+    tzst_job_t* jobs = calloc(count, sizeof(tzst_job_t));
+    if (!jobs) return 1;
+
+    for (int i = 0; i < count; i++) {
+        jobs[i].archive_path = argv[optind + i * 2];
+        jobs[i].dest_path = argv[optind + i * 2 + 1];
+        jobs[i].store_path = store_path;
+        jobs[i].filters = filters;
+        jobs[i].filter_count = filter_count;
+
+        if (manifest_count > 0) {
+            char archive_path[PATH_MAX];
+            snprintf(archive_path, sizeof(archive_path), "%s", jobs[i].archive_path);
+            for (int j = 0; j < manifest_count && !jobs[i].manifest; j++) {
+                jobs[i].manifest = manifest_find_archive(&manifests[j], basename(archive_path));
+            }
+            if (!jobs[i].manifest) {
+                fprintf(stderr, "component_installer: %s is in none of the manifests\n", jobs[i].archive_path);
+                result = -1;
+            }
+        }
+    }
+
+    if (result == 0) result = tzst_extract(jobs, count, writer_count);
+    for (int i = 0; i < count; i++) {
+        if (jobs[i].result != 0) fprintf(stderr, "component_installer: %s\n", jobs[i].error);
+    }
+
+    free(jobs);
+    for (int i = 0; i < manifest_count; i++) manifest_free(&manifests[i]);
+    return result == 0 ? 0 : 1;
+}
+
+/* Lists the archives of a component directory in the order of its index.txt, followed by the ones the index does not name. */
+static int list_archives(const char* dir_path, char*** archives) {
+    DIR* dir = opendir(dir_path);
+    if (!dir) return -errno;
+
+    int count = 0;
+    char** names = NULL;
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+        if (!has_suffix(entry->d_name, ARCHIVE_SUFFIX)) continue;
+
+        char** grown = realloc(names, (count + 1) * sizeof(char*));
+        if (!grown) break;
+        names = grown;
+        names[count++] = strdup(entry->d_name);
+    }
+    closedir(dir);
+    if (count > 1) qsort(names, count, sizeof(char*), compare_names);
+
+    char index_path[PATH_MAX];
+    snprintf(index_path, sizeof(index_path), "%s/%s", dir_path, INDEX_NAME);
+
+    int ordered = 0;
+    FILE* index = fopen(index_path, "re");
+    if (index) {
+        char line[NAME_MAX + 2];
+        while (fgets(line, sizeof(line), index)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (!*line) continue;
+
+            int found = -1;
+            for (int i = ordered; i < count && found < 0; i++) {
+                if (strcmp(names[i], line) == 0) found = i;
+            }
+
+            if (found < 0) {
+                fprintf(stderr, "component_installer: %s lists %s, which is not in %s\n", INDEX_NAME, line, dir_path);
+                continue;
+            }
+
+            char* name = names[found];
+            memmove(&names[ordered + 1], &names[ordered], (found - ordered) * sizeof(char*));
+            names[ordered++] = name;
+        }
+        fclose(index);
+    }
+
+    *archives = names;
+    return count;
+}
+
+static int command_manifest(int argc, char** argv) {
+    if (argc != 2) return usage();
+    const char* dir_path = argv[1];
+
+    char** archives = NULL;
+    int count = list_archives(dir_path, &archives);
+    if (count < 0) {
+        fprintf(stderr, "component_installer: %s: %s\n", dir_path, strerror(-count));
+        return 1;
+    }
+
+    char component[PATH_MAX];
+    snprintf(component, sizeof(component), "%s", dir_path);
+
+    manifest_t manifest = {0};
+    manifest.component = strdup(basename(component));
+    manifest.version_count = count;
+    manifest.versions = calloc(count + 1, sizeof(manifest_version_t));
+    tzst_job_t* jobs = calloc(count + 1, sizeof(tzst_job_t));
+    char (*archive_paths)[PATH_MAX] = calloc(count + 1, PATH_MAX);
+    if (!manifest.component || !manifest.versions || !jobs || !archive_paths) return 1;
+
+    for (int i = 0; i < count; i++) {
+        manifest_version_t* version = &manifest.versions[i];
+        version->archive = archives[i];
+        version->name = strndup(archives[i], strlen(archives[i]) - strlen(ARCHIVE_SUFFIX));
+
+        snprintf(archive_paths[i], PATH_MAX, "%s/%s", dir_path, archives[i]);
+        jobs[i].archive_path = archive_paths[i];
+        jobs[i].scan = version;
+    }
+
+    int result = tzst_extract(jobs, count, 0);
+    for (int i = 0; i < count; i++) {
+        if (jobs[i].result != 0) fprintf(stderr, "component_installer: %s\n", jobs[i].error);
+    }
+
+    if (result == 0) {
+        char manifest_path[PATH_MAX];
+        snprintf(manifest_path, sizeof(manifest_path), "%s/%s", dir_path, MANIFEST_NAME);
+        result = manifest_save(manifest_path, &manifest);
+        if (result < 0) fprintf(stderr, "component_installer: %s: %s\n", manifest_path, strerror(-result));
+    }
+
+    free(archives);
+    free(archive_paths);
+    free(jobs);
+    manifest_free(&manifest);
+    return result == 0 ? 0 : 1;
+}
+
+/* Links a version that is already in the store into a destination, without reading its archive. */
+static int command_link(int argc, char** argv) {
+    if (argc != 5) return usage();
+
+    manifest_t manifest;
+    int result = manifest_load(argv[2], &manifest);
+    if (result < 0) {
+        fprintf(stderr, "component_installer: %s: %s\n", argv[2], strerror(-result));
+        return 1;
+    }
+
+    const manifest_version_t* version = manifest_find_version(&manifest, argv[3]);
+    int store_fd = store_open(argv[1]);
+    int dest_fd = -1;
+    char error[COMPONENT_ERROR_LENGTH];
+
+    if (!version) {
+        snprintf(error, sizeof(error), "%s is not in %s", argv[3], argv[2]);
+        result = -ENOENT;
+    }
+    else if (store_fd < 0) {
+        snprintf(error, sizeof(error), "%s: %s", argv[1], strerror(-store_fd));
+        result = store_fd;
+    }
+    else if ((mkdir(argv[4], 0755) < 0 && errno != EEXIST) || (dest_fd = open(argv[4], O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        snprintf(error, sizeof(error), "%s: %s", argv[4], strerror(errno));
+        result = -errno;
+    }
+    else result = store_link(store_fd, version, dest_fd, error);
+
+    if (result < 0) fprintf(stderr, "component_installer: %s\n", error);
+
+    if (dest_fd >= 0) close(dest_fd);
+    if (store_fd >= 0) close(store_fd);
+    manifest_free(&manifest);
+    return result == 0 ? 0 : 1;
+}
+
+static int command_prune(int argc, char** argv) {
+    if (argc != 2) return usage();
+
+    int store_fd = store_open(argv[1]);
+    uint64_t freed_bytes = 0;
+    int freed_objects = 0;
+    int result = store_fd < 0 ? store_fd : store_prune(store_fd, &freed_bytes, &freed_objects);
+    if (store_fd >= 0) close(store_fd);
+
+    if (result < 0) {
+        fprintf(stderr, "component_installer: %s: %s\n", argv[1], strerror(-result));
+        return 1;
+    }
+
+    printf("removed %d objects, %llu bytes\n", freed_objects, (unsigned long long)freed_bytes);
+    return 0;
+}
+
+/* Unpacks versions of a component into the store next to the ones already there, all of them unless some are named. */
+static int command_add(int argc, char** argv) {
+    if (argc < 3) return usage();
+    const char* store_path = argv[1];
+    const char* dir_path = argv[2];
+
+    char manifest_path[PATH_MAX];
+    snprintf(manifest_path, sizeof(manifest_path), "%s/%s", dir_path, MANIFEST_NAME);
+
+    manifest_t manifest;
+    int result = manifest_load(manifest_path, &manifest);
+    if (result < 0) {
+        fprintf(stderr, "component_installer: %s: %s\n", manifest_path, strerror(-result));
+        return 1;
+    }
+
+    int store_fd = store_open(store_path);
+    if (store_fd < 0) {
+        fprintf(stderr, "component_installer: %s: %s\n", store_path, strerror(-store_fd));
+        manifest_free(&manifest);
+        return 1;
+    }
+    close(store_fd);
+
+    char component_path[PATH_MAX];
+    snprintf(component_path, sizeof(component_path), "%s/%s/%s", store_path, STORE_VERSIONS_DIR, manifest.component);
+    mkdir(component_path, 0755);
+
+    tzst_job_t* jobs = calloc(manifest.version_count + 1, sizeof(tzst_job_t));
+    char (*paths)[PATH_MAX] = calloc(manifest.version_count * 2 + 1, PATH_MAX);
+    if (!jobs || !paths) return 1;
+
+    int count = 0;
+    for (int i = 0; i < manifest.version_count; i++) {
+        const manifest_version_t* version = &manifest.versions[i];
+        bool selected = argc == 3;
+        for (int j = 3; j < argc && !selected; j++) selected = strcmp(argv[j], version->name) == 0;
+
+        struct stat version_stat;
+        char* archive_path = paths[count * 2];
+        char* temp_path = paths[count * 2 + 1];
+        snprintf(temp_path, PATH_MAX, "%s/%s/%s/%s", store_path, STORE_VERSIONS_DIR, manifest.component, version->name);
+        if (!selected || stat(temp_path, &version_stat) == 0) continue;
+
+        /* Unpacked under a temporary name, so that a version only shows up once it is complete. */
+        strcat(temp_path, ".tmp");
+        snprintf(archive_path, PATH_MAX, "%s/%s", dir_path, version->archive);
+        jobs[count].archive_path = archive_path;
+        jobs[count].dest_path = temp_path;
+        jobs[count].store_path = store_path;
+        jobs[count].manifest = version;
+        count++;
+    }
+
+    result = tzst_extract(jobs, count, 0);
+    for (int i = 0; i < count; i++) {
+        char version_path[PATH_MAX];
+        snprintf(version_path, sizeof(version_path), "%s", jobs[i].dest_path);
+        version_path[strlen(version_path) - strlen(".tmp")] = '\0';
+
+        if (jobs[i].result == 0 && rename(jobs[i].dest_path, version_path) < 0) {
+            snprintf(jobs[i].error, sizeof(jobs[i].error), "%s: %s", version_path, strerror(errno));
+            jobs[i].result = result = -errno;
+        }
+        if (jobs[i].result != 0) fprintf(stderr, "component_installer: %s\n", jobs[i].error);
+    }
+
+    free(paths);
+    free(jobs);
+    manifest_free(&manifest);
+    return result == 0 ? 0 : 1;
+}
+
+static int command_activate(int argc, char** argv) {
+    if (argc != 5) return usage();
+
+    char error[COMPONENT_ERROR_LENGTH];
+    if (store_activate(argv[1], argv[2], argv[3], argv[4], error) < 0) {
+        fprintf(stderr, "component_installer: %s\n", error);
+        return 1;
+    }
+    return 0;
+}
+
+static int command_delta(int argc, char** argv) {
+    int level = DELTA_DEFAULT_LEVEL;
+    int opt;
+    while ((opt = getopt(argc, argv, "l:")) != -1) {
+        if (opt == 'l') {
+            level = atoi(optarg);
+        }
+        else return usage();
+    }
+    if (argc - optind != 3) return usage();
+
+    char error[COMPONENT_ERROR_LENGTH];
+    if (delta_create(argv[optind], argv[optind + 1], argv[optind + 2], level, error) < 0) {
+        fprintf(stderr, "component_installer: %s\n", error);
+        return 1;
+    }
+    return 0;
+}
+
+static int command_patch(int argc, char** argv) {
+    const char* store_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        if (opt == 's') {
+            store_path = optarg;
+        }
+        else return usage();
+    }
+    if (argc - optind != 3) return usage();
+
+    char error[COMPONENT_ERROR_LENGTH];
+    if (delta_apply(argv[optind], argv[optind + 1], argv[optind + 2], store_path, error) < 0) {
+        fprintf(stderr, "component_installer: %s\n", error);
+        return 1;
+    }
+    return 0;
+}
+
+static int command_pack(int argc, char** argv) {
+    int level = SEEKABLE_DEFAULT_LEVEL;
+    int opt;
+    while ((opt = getopt(argc, argv, "l:")) != -1) {
+        if (opt == 'l') {
+            level = atoi(optarg);
+        }
+        else return usage();
+    }
+    if (argc - optind != 2) return usage();
+
+    char error[COMPONENT_ERROR_LENGTH];
+    if (seekable_pack(argv[optind], argv[optind + 1], level, error) < 0) {
+        fprintf(stderr, "component_installer: %s\n", error);
+        return 1;
+    }
+    return 0;
+}
+
+static int command_verify(int argc, char** argv) {
+    int thread_count = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:")) != -1) {
+        if (opt == 'j') {
+            thread_count = atoi(optarg);
+        }
+        else return usage();
+    }
+    if (argc - optind != 1) return usage();
+
+    char error[COMPONENT_ERROR_LENGTH];
+    int file_count = 0;
+    if (seekable_verify(argv[optind], thread_count, &file_count, error) < 0) {
+        fprintf(stderr, "component_installer: %s\n", error);
+        return 1;
+    }
+    printf("%s: %d files ok\n", argv[optind], file_count);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) return usage();
+
+    if (strcmp(argv[1], "extract") == 0) return command_extract(argc - 1, argv + 1);
+    if (strcmp(argv[1], "manifest") == 0) return command_manifest(argc - 1, argv + 1);
+    if (strcmp(argv[1], "link") == 0) return command_link(argc - 1, argv + 1);
+    if (strcmp(argv[1], "prune") == 0) return command_prune(argc - 1, argv + 1);
+    if (strcmp(argv[1], "add") == 0) return command_add(argc - 1, argv + 1);
+    if (strcmp(argv[1], "activate") == 0) return command_activate(argc - 1, argv + 1);
+    if (strcmp(argv[1], "delta") == 0) return command_delta(argc - 1, argv + 1);
+    if (strcmp(argv[1], "patch") == 0) return command_patch(argc - 1, argv + 1);
+    if (strcmp(argv[1], "pack") == 0) return command_pack(argc - 1, argv + 1);
+    if (strcmp(argv[1], "verify") == 0) return command_verify(argc - 1, argv + 1);
+    return usage();
+}
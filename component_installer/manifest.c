@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include "component_installer.h"
+
+#define MIN_FILE_CAPACITY 16
+
+static int manifest_compare_files(const void* a, const void* b) {
+    return strcmp(((const manifest_file_t*)a)->path, ((const manifest_file_t*)b)->path);
+}
+
+static manifest_version_t* manifest_add_version(manifest_t* manifest) {
+    manifest_version_t* versions = realloc(manifest->versions, (manifest->version_count + 1) * sizeof(manifest_version_t));
+    if (!versions) return NULL;
+
+    manifest->versions = versions;
+    manifest_version_t* version = &versions[manifest->version_count++];
+    memset(version, 0, sizeof(manifest_version_t));
+    return version;
+}
+
+manifest_file_t* manifest_add_file(manifest_version_t* version, const char* path, int mode, uint64_t size, const uint8_t* hash) {
+    if (version->file_count == version->file_capacity) {
+        int capacity = version->file_capacity > 0 ? version->file_capacity * 2 : MIN_FILE_CAPACITY;
+        manifest_file_t* files = realloc(version->files, capacity * sizeof(manifest_file_t));
+        if (!files) return NULL;
+
+        version->files = files;
+        version->file_capacity = capacity;
+    }
+
+    manifest_file_t* file = &version->files[version->file_count];
+    file->path = strdup(path);
+    if (!file->path) return NULL;
+
+    file->mode = mode;
+    file->size = size;
+    memcpy(file->hash, hash, SHA256_SIZE);
+    version->file_count++;
+    return file;
+}
+
+void manifest_sort_files(manifest_version_t* version) {
+    if (version->file_count > 1) qsort(version->files, version->file_count, sizeof(manifest_file_t), manifest_compare_files);
+}
+
+void manifest_version_free(manifest_version_t* version) {
+    for (int i = 0; i < version->file_count; i++) free(version->files[i].path);
+    free(version->files);
+    free(version->name);
+    free(version->archive);
+    memset(version, 0, sizeof(manifest_version_t));
+}
+
+void manifest_free(manifest_t* manifest) {
+    for (int i = 0; i < manifest->version_count; i++) manifest_version_free(&manifest->versions[i]);
+    free(manifest->versions);
+    free(manifest->component);
+    memset(manifest, 0, sizeof(manifest_t));
+}
+
+/* Returns the field starting at line and moves line past it and the space that follows, or NULL when line is at its end. */
+static char* manifest_next_field(char** line) {
+    char* field = *line;
+    if (!*field) return NULL;
+
+    char* space = strchr(field, ' ');
+    if (space) {
+        *space = '\0';
+        *line = space + 1;
+    }
+    else *line = field + strlen(field);
+    return field;
+}
+
+static int manifest_parse_line(manifest_t* manifest, char* line) {
+    char* kind = manifest_next_field(&line);
+    if (!kind || kind[0] == '#') return 0;
+
+    if (strcmp(kind, "component") == 0) {
+        free(manifest->component);
+        manifest->component = strdup(line);
+        return manifest->component ? 0 : -ENOMEM;
+    }
+
+    if (strcmp(kind, "version") == 0) {
+        char* name = manifest_next_field(&line);
+        char* archive = manifest_next_field(&line);
+        char* archive_size = manifest_next_field(&line);
+        char* archive_hash = manifest_next_field(&line);
+        char* installed_size = manifest_next_field(&line);
+        if (!installed_size) return -EINVAL;
+
+        manifest_version_t* version = manifest_add_version(manifest);
+        if (!version) return -ENOMEM;
+
+        version->name = strdup(name);
+        version->archive = strdup(archive);
+        version->archive_size = strtoull(archive_size, NULL, 10);
+        version->installed_size = strtoull(installed_size, NULL, 10);
+        if (!version->name || !version->archive) return -ENOMEM;
+        return sha256_from_hex(archive_hash, version->archive_hash) == 0 ? 0 : -EINVAL;
+    }
+
+    if (strcmp(kind, "file") == 0) {
+        if (manifest->version_count == 0) return -EINVAL;
+
+        char* mode = manifest_next_field(&line);
+        char* size = manifest_next_field(&line);
+        char* hash = manifest_next_field(&line);
+        if (!hash || !*line) return -EINVAL;
+
+        uint8_t digest[SHA256_SIZE];
+        if (sha256_from_hex(hash, digest) < 0) return -EINVAL;
+
+        manifest_version_t* version = &manifest->versions[manifest->version_count - 1];
+        manifest_file_t* file = manifest_add_file(version, line, strtol(mode, NULL, 8), strtoull(size, NULL, 10), digest);
+        return file ? 0 : -ENOMEM;
+    }
+
+    return -EINVAL;
+}
+
+int manifest_load(const char* path, manifest_t* manifest) {
+    memset(manifest, 0, sizeof(manifest_t));
+
+    FILE* file = fopen(path, "re");
+    if (!file) return -errno;
+
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int res = 0;
+    while (res == 0 && (length = getline(&line, &capacity, file)) >= 0) {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) line[--length] = '\0';
+        res = manifest_parse_line(manifest, line);
+    }
+
+    free(line);
+    fclose(file);
+
+    if (res < 0) {
+        manifest_free(manifest);
+        return res;
+    }
+
+    for (int i = 0; i < manifest->version_count; i++) manifest_sort_files(&manifest->versions[i]);
+    return 0;
+}
+
+/* Written to a temporary file first so that a reader never sees a partial manifest. */
+int manifest_save(const char* path, const manifest_t* manifest) {
+    char temp_path[4096];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    FILE* file = fopen(temp_path, "we");
+    if (!file) return -errno;
+
+    if (manifest->component) fprintf(file, "component %s\n", manifest->component);
+
+    for (int i = 0; i < manifest->version_count; i++) {
+        const manifest_version_t* version = &manifest->versions[i];
+        char hex[SHA256_HEX_SIZE];
+        sha256_to_hex(version->archive_hash, hex);
+        fprintf(file, "version %s %s %" PRIu64 " %s %" PRIu64 "\n", version->name, version->archive, version->archive_size, hex,
+                version->installed_size);
+
+        for (int j = 0; j < version->file_count; j++) {
+            const manifest_file_t* entry = &version->files[j];
+            sha256_to_hex(entry->hash, hex);
+            fprintf(file, "file %o %" PRIu64 " %s %s\n", entry->mode, entry->size, hex, entry->path);
+        }
+    }
+
+    int res = ferror(file) ? -EIO : 0;
+    if (fclose(file) != 0 && res == 0) res = -errno;
+    if (res == 0 && rename(temp_path, path) < 0) res = -errno;
+    if (res < 0) remove(temp_path);
+    return res;
+}
+
+const manifest_version_t* manifest_find_archive(const manifest_t* manifest, const char* archive) {
+    for (int i = 0; i < manifest->version_count; i++) {
+        if (strcmp(manifest->versions[i].archive, archive) == 0) return &manifest->versions[i];
+    }
+    return NULL;
+}
+
+const manifest_version_t* manifest_find_version(const manifest_t* manifest, const char* name) {
+    for (int i = 0; i < manifest->version_count; i++) {
+        if (strcmp(manifest->versions[i].name, name) == 0) return &manifest->versions[i];
+    }
+    return NULL;
+}
+
+const manifest_file_t* manifest_find_file(const manifest_version_t* version, const char* path) {
+    manifest_file_t key = {.path = (char*)path};
+    return bsearch(&key, version->files, version->file_count, sizeof(manifest_file_t), manifest_compare_files);
+}
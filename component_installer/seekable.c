@@ -0,0 +1,800 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zstd.h>
+#include "component_installer.h"
+
+#define SEEK_TABLE_MAGIC 0x184D2A5E
+#define SEEK_TABLE_FOOTER_MAGIC 0x8F92EAB1
+#define SEEK_TABLE_FOOTER_SIZE 9
+#define SEEK_TABLE_CHECKSUM_FLAG 0x80
+#define FILE_INDEX_MAGIC 0x184D2A5D
+#define FILE_INDEX_HEADER "tzst index 2"
+#define SKIPPABLE_HEADER_SIZE 8
+#define MAX_THREADS 16
+#define DEFAULT_THREADS 4
+
+#define TAR_RECORD_SIZE 512
+#define TAR_NAME_SIZE 100
+#define TAR_PREFIX_OFFSET 345
+
+/* A seekable package is still a tar in zstd that any zstd and tar extract, and that tzst_extract() streams like the others, but
+   the tar is cut into independent frames, one per regular file along with the directories and symlinks before it. The package
+   ends with two skippable frames that decoders pass over: the file index, which lists every regular file as
+     file <frame> <offset> <octal mode> <size> <mtime> <sha256> <path>
+   where offset is that of its contents in the decompressed frame, and every symlink or hard link as
+     link <frame> <path>
+   and the seek table of the zstd seekable format, which gives the
+   compressed and decompressed size of every frame. The file index is counted in the seek table as one more frame, which
+   decompresses to nothing, so it is found from the end of the package without a scan.
+
+   A single file then costs reading and decompressing its own frame, so the files of one architecture (syswow64/) are installed
+   without touching the others, and both extraction and verification hand the files to a few threads. Only regular files are
+   extracted from their frames, so a filter that selects a link has the package streamed instead, and empty directories are only
+   restored by a full extract. Packages with an older index are streamed too, since it does not list their links.
+
+   The index is not trusted on its own. Its paths get the checks archive entries get, every data frame must hold exactly one of
+   its files, and the tar headers of a frame are walked whenever it is decompressed, so that a file is only extracted or
+   verified from where a plain tar would find it, under the same name, mode and mtime. */
+
+typedef struct {
+    char* path;
+    int mode;
+    uint64_t size;
+    time_t mtime;
+    uint8_t hash[SHA256_SIZE];
+    int frame;
+    uint32_t offset;
+} seekable_file_t;
+
+typedef struct {
+    char* path;
+    int frame;
+} seekable_link_t;
+
+typedef struct {
+    int fd;
+    int frame_count;
+    uint64_t* frame_offsets;
+    uint32_t* compressed_sizes;
+    uint32_t* decompressed_sizes;
+    int file_count;
+    seekable_file_t* files;
+    int link_count;
+    seekable_link_t* links;
+} seekable_t;
+
+typedef struct {
+    seekable_t* seekable;
+    tzst_job_t* job;
+    int dest_fd;
+    const char* archive_path;
+    int next;
+    pthread_mutex_t mutex;
+    int result;
+    char error[COMPONENT_ERROR_LENGTH];
+} seekable_run_t;
+
+typedef struct {
+    FILE* file;
+    ZSTD_CCtx* cctx;
+    char* frame;
+    size_t length;
+    size_t capacity;
+    bool has_file;
+    int frame_count;
+    uint32_t* compressed_sizes;
+    uint32_t* decompressed_sizes;
+    FILE* index;
+    char* index_data;
+    size_t index_size;
+} seekable_pack_t;
+
+static void seekable_error(char* error, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(error, COMPONENT_ERROR_LENGTH, format, args);
+    va_end(args);
+}
+
+static uint32_t seekable_read32(const uint8_t* data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static void seekable_write32(uint8_t* data, uint32_t value) {
+    data[0] = value;
+    data[1] = value >> 8;
+    data[2] = value >> 16;
+    data[3] = value >> 24;
+}
+
+static void seekable_close(seekable_t* seekable) {
+    if (seekable->fd >= 0) close(seekable->fd);
+    for (int i = 0; i < seekable->file_count; i++) free(seekable->files[i].path);
+    free(seekable->files);
+    for (int i = 0; i < seekable->link_count; i++) free(seekable->links[i].path);
+    free(seekable->links);
+    free(seekable->frame_offsets);
+    free(seekable->compressed_sizes);
+    free(seekable->decompressed_sizes);
+    memset(seekable, 0, sizeof(seekable_t));
+    seekable->fd = -1;
+}
+
+static bool seekable_pread(int fd, void* data, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t res = pread(fd, data, length, offset);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) return false;
+        data = (char*)data + res;
+        length -= res;
+        offset += res;
+    }
+    return true;
+}
+
+/* Paths in the index get the checks archive entries get: they must be relative, without . or .. components. */
+static bool seekable_valid_path(char* path) {
+    size_t length = strlen(path);
+    return *path && tzst_clean_path(path) == path && strlen(path) == length;
+}
+
+static int seekable_parse_link(seekable_t* seekable, char* line) {
+    seekable_link_t link = {0};
+    int path_start = 0;
+    if (sscanf(line, "link %d %n", &link.frame, &path_start) != 1 || path_start == 0) return -EINVAL;
+    if (link.frame < 0 || link.frame >= seekable->frame_count - 1 || !seekable_valid_path(line + path_start)) return -EINVAL;
+
+    seekable_link_t* links = realloc(seekable->links, (seekable->link_count + 1) * sizeof(seekable_link_t));
+    if (!links) return -ENOMEM;
+    seekable->links = links;
+
+    link.path = strdup(line + path_start);
+    if (!link.path) return -ENOMEM;
+    links[seekable->link_count++] = link;
+    return 0;
+}
+
+/* Returns -ENOTSUP for an index of an older version. */
+static int seekable_parse_index(seekable_t* seekable, char* data) {
+    char* line = strtok(data, "\n");
+    if (!line || strncmp(line, "tzst index ", 11) != 0) return -EINVAL;
+    if (strcmp(line, FILE_INDEX_HEADER) != 0) return -ENOTSUP;
+
+    while ((line = strtok(NULL, "\n"))) {
+        if (strncmp(line, "link ", 5) == 0) {
+            int res = seekable_parse_link(seekable, line);
+            if (res < 0) return res;
+            continue;
+        }
+
+        seekable_file_t file = {0};
+        char hex[SHA256_HEX_SIZE];
+        long long mtime;
+        int path_start = 0;
+        if (sscanf(line, "file %d %" SCNu32 " %o %" SCNu64 " %lld %64s %n", &file.frame, &file.offset, &file.mode, &file.size,
+                   &mtime, hex, &path_start) != 6 || path_start == 0 || sha256_from_hex(hex, file.hash) < 0) return -EINVAL;
+        if (file.frame < 0 || file.frame >= seekable->frame_count ||
+            (uint64_t)file.offset + file.size > seekable->decompressed_sizes[file.frame]) return -EINVAL;
+
+        seekable_file_t* files = realloc(seekable->files, (seekable->file_count + 1) * sizeof(seekable_file_t));
+        if (!files) return -ENOMEM;
+        seekable->files = files;
+
+        char* path = line + path_start;
+        if (!seekable_valid_path(path)) return -EINVAL;
+
+        file.mtime = mtime;
+        file.path = strdup(path);
+        if (!file.path) return -ENOMEM;
+        files[seekable->file_count++] = file;
+    }
+
+    /* Every frame but the file index holds one file, or there is a single one without any, so that walking the frames of the
+       files covers the whole tar. */
+    bool* used = calloc(seekable->frame_count, sizeof(bool));
+    if (!used) return -ENOMEM;
+
+    int res = seekable->file_count > 0 || seekable->frame_count == 2 ? 0 : -EINVAL;
+    for (int i = 0; i < seekable->file_count && res == 0; i++) {
+        if (used[seekable->files[i].frame]) res = -EINVAL;
+        used[seekable->files[i].frame] = true;
+    }
+    for (int i = 0; i < seekable->frame_count - 1 && res == 0 && seekable->file_count > 0; i++) {
+        if (!used[i]) res = -EINVAL;
+    }
+    free(used);
+    return res;
+}
+
+/* Returns -ENOTSUP for a package without a seek table and file index, which can still be streamed. */
+static int seekable_open(const char* path, seekable_t* seekable) {
+    memset(seekable, 0, sizeof(seekable_t));
+    seekable->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (seekable->fd < 0) return -errno;
+
+    struct stat archive_stat;
+    uint8_t footer[SEEK_TABLE_FOOTER_SIZE];
+    if (fstat(seekable->fd, &archive_stat) < 0) return -errno;
+    if (archive_stat.st_size < SEEK_TABLE_FOOTER_SIZE + SKIPPABLE_HEADER_SIZE ||
+        !seekable_pread(seekable->fd, footer, sizeof(footer), archive_stat.st_size - sizeof(footer)) ||
+        seekable_read32(footer + 5) != SEEK_TABLE_FOOTER_MAGIC) return -ENOTSUP;
+
+    int count = seekable_read32(footer);
+    int entry_size = footer[4] & SEEK_TABLE_CHECKSUM_FLAG ? 12 : 8;
+    off_t table_size = (off_t)count * entry_size;
+    off_t table_start = archive_stat.st_size - SEEK_TABLE_FOOTER_SIZE - table_size;
+    if (count <= 0 || table_start < SKIPPABLE_HEADER_SIZE) return -EINVAL;
+
+    uint8_t header[SKIPPABLE_HEADER_SIZE];
+    uint8_t* table = malloc(table_size);
+    seekable->frame_count = count;
+    seekable->frame_offsets = calloc(count, sizeof(uint64_t));
+    seekable->compressed_sizes = calloc(count, sizeof(uint32_t));
+    seekable->decompressed_sizes = calloc(count, sizeof(uint32_t));
+    if (!table || !seekable->frame_offsets || !seekable->compressed_sizes || !seekable->decompressed_sizes) {
+        free(table);
+        return -ENOMEM;
+    }
+
+    int res = 0;
+    if (!seekable_pread(seekable->fd, header, sizeof(header), table_start - SKIPPABLE_HEADER_SIZE) ||
+        !seekable_pread(seekable->fd, table, table_size, table_start) || seekable_read32(header) != SEEK_TABLE_MAGIC ||
+        seekable_read32(header + 4) != table_size + SEEK_TABLE_FOOTER_SIZE) res = -EINVAL;
+
+    uint64_t offset = 0;
+    for (int i = 0; i < count && res == 0; i++) {
+        seekable->frame_offsets[i] = offset;
+        seekable->compressed_sizes[i] = seekable_read32(table + i * entry_size);
+        seekable->decompressed_sizes[i] = seekable_read32(table + i * entry_size + 4);
+        offset += seekable->compressed_sizes[i];
+    }
+    free(table);
+    if (res == 0 && offset != (uint64_t)table_start - SKIPPABLE_HEADER_SIZE) res = -EINVAL;
+    if (res < 0) return res;
+
+    /* The file index is the last frame before the seek table. */
+    int last = count - 1;
+    uint32_t index_size = seekable->compressed_sizes[last];
+    if (seekable->decompressed_sizes[last] != 0 || index_size < SKIPPABLE_HEADER_SIZE) return -ENOTSUP;
+
+    char* index = malloc(index_size + 1);
+    if (!index) return -ENOMEM;
+    if (!seekable_pread(seekable->fd, index, index_size, seekable->frame_offsets[last])) {
+        res = -EIO;
+    }
+    else if (seekable_read32((uint8_t*)index) != FILE_INDEX_MAGIC) {
+        res = -ENOTSUP;
+    }
+    else {
+        index[index_size] = '\0';
+        res = seekable_parse_index(seekable, index + SKIPPABLE_HEADER_SIZE);
+    }
+    free(index);
+    return res;
+}
+
+/* Decompresses frame into buffer, which is grown as needed. */
+static int seekable_read_frame(seekable_t* seekable, ZSTD_DCtx* dctx, int frame, char** buffer, size_t* capacity) {
+    uint32_t compressed_size = seekable->compressed_sizes[frame];
+    uint32_t decompressed_size = seekable->decompressed_sizes[frame];
+    size_t needed = (size_t)compressed_size + decompressed_size;
+    if (needed > *capacity) {
+        char* grown = realloc(*buffer, needed);
+        if (!grown) return -ENOMEM;
+        *buffer = grown;
+        *capacity = needed;
+    }
+
+    char* compressed = *buffer + decompressed_size;
+    if (!seekable_pread(seekable->fd, compressed, compressed_size, seekable->frame_offsets[frame])) return -EIO;
+
+    size_t size = ZSTD_decompressDCtx(dctx, *buffer, decompressed_size, compressed, compressed_size);
+    return ZSTD_isError(size) || size != decompressed_size ? -EBADMSG : 0;
+}
+
+static bool seekable_has_link(const seekable_t* seekable, int frame, const char* name, size_t length) {
+    for (int i = 0; i < seekable->link_count; i++) {
+        const seekable_link_t* link = &seekable->links[i];
+        if (link->frame == frame && strlen(link->path) == length && memcmp(link->path, name, length) == 0) return true;
+    }
+    return false;
+}
+
+/* Walks the tar headers of a decompressed frame the way tzst_extract() would read them and checks that the only regular file is
+   the one the index puts there, or that there is none when file is NULL, and that the index lists every link of the frame. The
+   entries must not run past the frame, and only the last frame before the file index may hold the end of the archive. Returns
+   -EINVAL when the frame does not match. */
+static int seekable_check_frame(const seekable_t* seekable, int frame, const char* data, const seekable_file_t* file) {
+    uint64_t size = seekable->decompressed_sizes[frame];
+    const char* long_name = NULL;
+    size_t long_length = 0;
+    bool found = false;
+
+    for (uint64_t position = 0; position < size; ) {
+        const unsigned char* header = (const unsigned char*)data + position;
+        if (size - position < TAR_RECORD_SIZE) return -EINVAL;
+
+        bool zero = true;
+        for (int i = 0; i < TAR_RECORD_SIZE && zero; i++) zero = header[i] == 0;
+        if (zero) return frame == seekable->frame_count - 2 && found == (file != NULL) ? 0 : -EINVAL;
+        if (!tzst_verify_header(header)) return -EINVAL;
+
+        char type = header[156];
+        uint64_t entry_size = tzst_parse_number((const char*)header + 124, 12);
+        position += TAR_RECORD_SIZE;
+        if (entry_size > size - position) return -EINVAL;
+        uint64_t padded = (entry_size + TAR_RECORD_SIZE - 1) / TAR_RECORD_SIZE * TAR_RECORD_SIZE;
+        if (padded > size - position) return -EINVAL;
+
+        bool regular = type == '0' || type == '\0' || type == '7';
+        bool link = type == '1' || type == '2';
+        const char* name = long_name ? long_name : (const char*)header;
+        size_t length = long_name ? long_length : strnlen(name, TAR_NAME_SIZE);
+        if ((regular || link) && !long_name && memcmp(header + 257, "ustar\0", 6) == 0 && header[TAR_PREFIX_OFFSET]) return -EINVAL;
+
+        if (link) {
+            if (!seekable_has_link(seekable, frame, name, length)) return -EINVAL;
+        }
+        else if (regular) {
+            if (found || !file || position != file->offset || entry_size != file->size || length != strlen(file->path) ||
+                memcmp(name, file->path, length) != 0 || tzst_parse_number((const char*)header + 100, 8) != (uint64_t)(file->mode & 07777) ||
+                (time_t)tzst_parse_number((const char*)header + 136, 12) != file->mtime) return -EINVAL;
+            found = true;
+        }
+        else if (type != '5' && type != 'L' && type != 'K') return -EINVAL;
+
+        if (type == 'L') {
+            long_name = data + position;
+            long_length = strnlen(long_name, entry_size);
+        }
+        else if (type != 'K') long_name = NULL;
+        position += padded;
+    }
+    return found == (file != NULL) ? 0 : -EINVAL;
+}
+
+/* Decompresses the frame holding file into buffer and checks it and the contents against the index. */
+static int seekable_read_file(seekable_t* seekable, ZSTD_DCtx* dctx, const seekable_file_t* file, char** buffer, size_t* capacity,
+                              const char** data) {
+    int res = seekable_read_frame(seekable, dctx, file->frame, buffer, capacity);
+    if (res == 0) res = seekable_check_frame(seekable, file->frame, *buffer, file);
+    if (res < 0) return res;
+
+    uint8_t digest[SHA256_SIZE];
+    sha256_t sha;
+    sha256_init(&sha);
+    sha256_update(&sha, *buffer + file->offset, file->size);
+    sha256_final(&sha, digest);
+    if (memcmp(digest, file->hash, SHA256_SIZE) != 0) return -EBADMSG;
+
+    *data = *buffer + file->offset;
+    return 0;
+}
+
+/* Existing files are unlinked rather than overwritten, like tzst_extract() does, and skipped when they already have the contents.
+   The parent directory comes from tzst_open_parent(), so a symlink on the way fails the file. */
+static int seekable_write_file(int dest_fd, const seekable_file_t* file, const char* data) {
+    if (tzst_has_file(dest_fd, file->path, file->size, file->hash)) return 0;
+
+    const char* name;
+    int parent_fd = tzst_open_parent(dest_fd, file->path, true, &name);
+    if (parent_fd < 0) return -errno;
+
+    unlinkat(parent_fd, name, 0);
+    int fd = openat(parent_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, file->mode & 07777);
+    int res = fd >= 0 ? 0 : -errno;
+    close(parent_fd);
+    if (fd < 0) return res;
+
+    for (uint64_t written = 0; written < file->size && res == 0; ) {
+        ssize_t count = write(fd, data + written, file->size - written);
+        if (count < 0 && errno != EINTR) res = -errno;
+        if (count > 0) written += count;
+    }
+
+    struct timespec times[2] = {{0, UTIME_OMIT}, {file->mtime, 0}};
+    if (res == 0) futimens(fd, times);
+    if (close(fd) < 0 && res == 0) res = -errno;
+    return res;
+}
+
+static void seekable_fail(seekable_run_t* run, int res, const char* format, ...) {
+    pthread_mutex_lock(&run->mutex);
+    if (run->result == 0) {
+        run->result = res;
+        va_list args;
+        va_start(args, format);
+        vsnprintf(run->error, sizeof(run->error), format, args);
+        va_end(args);
+    }
+    pthread_mutex_unlock(&run->mutex);
+}
+
+/* Extracts, or with no destination only verifies, the selected files until there are none left. */
+static void* seekable_run_main(void* param) {
+    seekable_run_t* run = param;
+    seekable_t* seekable = run->seekable;
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    char* buffer = NULL;
+    size_t capacity = 0;
+
+    if (!dctx) seekable_fail(run, -ENOMEM, "out of memory");
+
+    while (dctx && __atomic_load_n(&run->result, __ATOMIC_RELAXED) == 0) {
+        int index = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED);
+        if (index >= seekable->file_count) break;
+
+        const seekable_file_t* file = &seekable->files[index];
+        if (run->job && !tzst_path_selected(run->job, file->path)) continue;
+
+        if (run->job && run->job->manifest) {
+            const manifest_file_t* entry = manifest_find_file(run->job->manifest, file->path);
+            if (!entry || entry->size != file->size || memcmp(entry->hash, file->hash, SHA256_SIZE) != 0) {
+                seekable_fail(run, -EBADMSG, "%s: %s does not match the manifest", run->archive_path, file->path);
+                break;
+            }
+        }
+
+        const char* data;
+        int res = seekable_read_file(seekable, dctx, file, &buffer, &capacity, &data);
+        if (res < 0) {
+            const char* reason = res == -EBADMSG ? "corrupt contents" : res == -EINVAL ? "index does not match the tar" : strerror(-res);
+            seekable_fail(run, res, "%s: %s: %s", run->archive_path, file->path, reason);
+            break;
+        }
+
+        res = run->dest_fd >= 0 ? seekable_write_file(run->dest_fd, file, data) : 0;
+        if (res < 0) {
+            seekable_fail(run, res, "%s: %s", file->path, strerror(-res));
+            break;
+        }
+    }
+
+    free(buffer);
+    if (dctx) ZSTD_freeDCtx(dctx);
+    return NULL;
+}
+
+static int seekable_run(seekable_run_t* run, int thread_count) {
+    if (thread_count <= 0) thread_count = DEFAULT_THREADS;
+    if (thread_count > MAX_THREADS) thread_count = MAX_THREADS;
+    pthread_mutex_init(&run->mutex, NULL);
+
+    pthread_t threads[MAX_THREADS];
+    int started = 0;
+    for (int i = 1; i < thread_count; i++) {
+        if (pthread_create(&threads[started], NULL, seekable_run_main, run) == 0) started++;
+    }
+    seekable_run_main(run);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&run->mutex);
+    return run->result;
+}
+
+int seekable_extract(tzst_job_t* job, int dest_fd, int thread_count) {
+    seekable_t seekable;
+    int res = seekable_open(job->archive_path, &seekable);
+
+    /* Links are only restored by tzst_extract(), so a filter that selects one has the package streamed. */
+    for (int i = 0; i < seekable.link_count && res == 0; i++) {
+        if (tzst_path_selected(job, seekable.links[i].path)) res = -ENOTSUP;
+    }
+    if (res == -ENOTSUP) {
+        seekable_close(&seekable);
+        return res;
+    }
+    if (res < 0) snprintf(job->error, sizeof(job->error), "%s: %s", job->archive_path, strerror(-res));
+
+    struct stat archive_stat;
+    if (res == 0 && job->manifest && fstat(seekable.fd, &archive_stat) == 0 && archive_stat.st_size != job->manifest->archive_size) {
+        snprintf(job->error, sizeof(job->error), "%s: archive does not match the manifest", job->archive_path);
+        res = -EBADMSG;
+    }
+
+    seekable_run_t run = {.seekable = &seekable, .job = job, .dest_fd = dest_fd, .archive_path = job->archive_path};
+    if (res == 0 && (res = seekable_run(&run, thread_count)) < 0) snprintf(job->error, sizeof(job->error), "%s", run.error);
+
+    seekable_close(&seekable);
+    job->result = res;
+    return res;
+}
+
+int seekable_verify(const char* archive_path, int thread_count, int* file_count, char* error) {
+    seekable_t seekable;
+    int res = seekable_open(archive_path, &seekable);
+    if (res < 0) {
+        seekable_error(error, "%s: %s", archive_path, res == -ENOTSUP ? "not a seekable package" : strerror(-res));
+        seekable_close(&seekable);
+        return res;
+    }
+
+    seekable_run_t run = {.seekable = &seekable, .job = NULL, .dest_fd = -1, .archive_path = archive_path};
+    res = seekable_run(&run, thread_count);
+    if (res < 0) seekable_error(error, "%s", run.error);
+
+    /* Without any file the one data frame is not read by the run, it must still hold no regular file. */
+    if (res == 0 && seekable.file_count == 0) {
+        ZSTD_DCtx* dctx = ZSTD_createDCtx();
+        char* buffer = NULL;
+        size_t capacity = 0;
+        res = dctx ? seekable_read_frame(&seekable, dctx, 0, &buffer, &capacity) : -ENOMEM;
+        if (res == 0) res = seekable_check_frame(&seekable, 0, buffer, NULL);
+        if (res < 0) seekable_error(error, "%s: %s", archive_path, res == -EINVAL ? "index does not match the tar" : strerror(-res));
+        free(buffer);
+        if (dctx) ZSTD_freeDCtx(dctx);
+    }
+
+    *file_count = seekable.file_count;
+    seekable_close(&seekable);
+    return res;
+}
+
+static int seekable_flush(seekable_pack_t* pack) {
+    if (pack->length == 0) return 0;
+
+    uint32_t* compressed_sizes = realloc(pack->compressed_sizes, (pack->frame_count + 2) * sizeof(uint32_t));
+    if (compressed_sizes) pack->compressed_sizes = compressed_sizes;
+    uint32_t* decompressed_sizes = realloc(pack->decompressed_sizes, (pack->frame_count + 2) * sizeof(uint32_t));
+    if (decompressed_sizes) pack->decompressed_sizes = decompressed_sizes;
+
+    size_t capacity = ZSTD_compressBound(pack->length);
+    char* output = malloc(capacity);
+    if (!compressed_sizes || !decompressed_sizes || !output || pack->length > UINT32_MAX) {
+        free(output);
+        return -ENOMEM;
+    }
+
+    size_t size = ZSTD_compress2(pack->cctx, output, capacity, pack->frame, pack->length);
+    int res = ZSTD_isError(size) ? -EIO : 0;
+    if (res == 0 && fwrite(output, 1, size, pack->file) != size) res = -EIO;
+    free(output);
+
+    if (res == 0) {
+        pack->compressed_sizes[pack->frame_count] = size;
+        pack->decompressed_sizes[pack->frame_count] = pack->length;
+        pack->frame_count++;
+        pack->length = 0;
+        pack->has_file = false;
+    }
+    return res;
+}
+
+static char* seekable_reserve(seekable_pack_t* pack, size_t length) {
+    if (pack->length + length > pack->capacity) {
+        size_t capacity = (pack->length + length) * 2;
+        char* frame = realloc(pack->frame, capacity);
+        if (!frame) return NULL;
+        pack->frame = frame;
+        pack->capacity = capacity;
+    }
+
+    char* data = pack->frame + pack->length;
+    memset(data, 0, length);
+    pack->length += length;
+    return data;
+}
+
+static void seekable_tar_number(char* field, int length, uint64_t value) {
+    snprintf(field, length, "%0*llo", length - 1, (unsigned long long)value);
+}
+
+static int seekable_tar_header(seekable_pack_t* pack, const char* name, char type, int mode, uint64_t size, time_t mtime, const char* link_name) {
+    int name_length = strlen(name);
+    if (name_length >= TAR_NAME_SIZE) {
+        int res = seekable_tar_header(pack, "././@LongLink", 'L', 0, name_length + 1, 0, NULL);
+        char* data = res == 0 ? seekable_reserve(pack, (name_length + 1 + TAR_RECORD_SIZE - 1) / TAR_RECORD_SIZE * TAR_RECORD_SIZE) : NULL;
+        if (!data) return -ENOMEM;
+        memcpy(data, name, name_length);
+    }
+
+    int link_length = link_name ? strlen(link_name) : 0;
+    if (link_length >= TAR_NAME_SIZE) {
+        int res = seekable_tar_header(pack, "././@LongLink", 'K', 0, link_length + 1, 0, NULL);
+        char* data = res == 0 ? seekable_reserve(pack, (link_length + 1 + TAR_RECORD_SIZE - 1) / TAR_RECORD_SIZE * TAR_RECORD_SIZE) : NULL;
+        if (!data) return -ENOMEM;
+        memcpy(data, link_name, link_length);
+    }
+
+    char* header = seekable_reserve(pack, TAR_RECORD_SIZE);
+    if (!header) return -ENOMEM;
+
+    memcpy(header, name, name_length < TAR_NAME_SIZE ? name_length : TAR_NAME_SIZE - 1);
+    seekable_tar_number(header + 100, 8, mode & 07777);
+    seekable_tar_number(header + 108, 8, 0);
+    seekable_tar_number(header + 116, 8, 0);
+    seekable_tar_number(header + 124, 12, size);
+    seekable_tar_number(header + 136, 12, mtime);
+    header[156] = type;
+    if (link_name) memcpy(header + 157, link_name, link_length < TAR_NAME_SIZE ? link_length : TAR_NAME_SIZE - 1);
+    memcpy(header + 257, "ustar  ", 8);
+
+    unsigned int sum = 0;
+    memset(header + 148, ' ', 8);
+    for (int i = 0; i < TAR_RECORD_SIZE; i++) sum += (unsigned char)header[i];
+    snprintf(header + 148, 8, "%06o", sum);
+    return 0;
+}
+
+static int seekable_compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static int seekable_pack_file(seekable_pack_t* pack, int dir_fd, const char* name, const char* path, const struct stat* file_stat) {
+    int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return -errno;
+
+    /* Each regular file starts a frame, which also holds the directories that came before it. */
+    int res = pack->has_file ? seekable_flush(pack) : 0;
+    if (res == 0) res = seekable_tar_header(pack, path, '0', file_stat->st_mode, file_stat->st_size, file_stat->st_mtime, NULL);
+
+    size_t offset = pack->length;
+    size_t padded = (file_stat->st_size + TAR_RECORD_SIZE - 1) / TAR_RECORD_SIZE * TAR_RECORD_SIZE;
+    char* data = res == 0 ? seekable_reserve(pack, padded) : NULL;
+    if (res == 0 && !data) res = -ENOMEM;
+
+    for (off_t read_size = 0; res == 0 && read_size < file_stat->st_size; ) {
+        ssize_t count = read(fd, data + read_size, file_stat->st_size - read_size);
+        if (count < 0 && errno != EINTR) res = -errno;
+        if (count == 0) res = -EIO;
+        if (count > 0) read_size += count;
+    }
+    close(fd);
+
+    if (res == 0) {
+        uint8_t digest[SHA256_SIZE];
+        char hex[SHA256_HEX_SIZE];
+        sha256_t sha;
+        sha256_init(&sha);
+        sha256_update(&sha, pack->frame + offset, file_stat->st_size);
+        sha256_final(&sha, digest);
+        sha256_to_hex(digest, hex);
+
+        fprintf(pack->index, "file %d %zu %o %lld %lld %s %s\n", pack->frame_count, offset, file_stat->st_mode & 07777,
+                (long long)file_stat->st_size, (long long)file_stat->st_mtime, hex, path);
+        pack->has_file = true;
+    }
+    return res;
+}
+
+static int seekable_pack_dir(seekable_pack_t* pack, int dir_fd, const char* prefix, char* error) {
+    DIR* dir = fdopendir(dir_fd);
+    if (!dir) {
+        close(dir_fd);
+        return -errno;
+    }
+
+    int count = 0;
+    char** names = NULL;
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        char** grown = realloc(names, (count + 1) * sizeof(char*));
+        if (!grown) break;
+        names = grown;
+        names[count++] = strdup(entry->d_name);
+    }
+    if (count > 1) qsort(names, count, sizeof(char*), seekable_compare_names);
+
+    int res = 0;
+    for (int i = 0; i < count && res == 0; i++) {
+        char path[PATH_MAX];
+        struct stat file_stat;
+        snprintf(path, sizeof(path), "%s%s", prefix, names[i]);
+
+        if (!names[i] || fstatat(dirfd(dir), names[i], &file_stat, AT_SYMLINK_NOFOLLOW) < 0) {
+            res = names[i] ? -errno : -ENOMEM;
+        }
+        else if (S_ISDIR(file_stat.st_mode)) {
+            strcat(path, "/");
+            res = seekable_tar_header(pack, path, '5', file_stat.st_mode, 0, file_stat.st_mtime, NULL);
+
+            int child_fd = openat(dirfd(dir), names[i], O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (res == 0) res = child_fd >= 0 ? seekable_pack_dir(pack, child_fd, path, error) : -errno;
+            else if (child_fd >= 0) close(child_fd);
+        }
+        else if (S_ISLNK(file_stat.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t length = readlinkat(dirfd(dir), names[i], target, sizeof(target) - 1);
+            if (length >= 0) target[length] = '\0';
+            res = length >= 0 ? seekable_tar_header(pack, path, '2', 0777, 0, file_stat.st_mtime, target) : -errno;
+            if (res == 0) fprintf(pack->index, "link %d %s\n", pack->frame_count, path);
+        }
+        else if (S_ISREG(file_stat.st_mode)) {
+            res = seekable_pack_file(pack, dirfd(dir), names[i], path, &file_stat);
+        }
+
+        if (res < 0 && !*error) seekable_error(error, "%s: %s", path, strerror(-res));
+    }
+
+    for (int i = 0; i < count; i++) free(names[i]);
+    free(names);
+    closedir(dir);
+    return res;
+}
+
+int seekable_pack(const char* dir_path, const char* archive_path, int level, char* error) {
+    error[0] = '\0';
+
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", archive_path);
+
+    seekable_pack_t pack = {0};
+    pack.file = fopen(temp_path, "we");
+    pack.cctx = ZSTD_createCCtx();
+    pack.index = open_memstream(&pack.index_data, &pack.index_size);
+    if (!pack.file || !pack.cctx || !pack.index) {
+        seekable_error(error, "%s: %s", temp_path, strerror(pack.file ? ENOMEM : errno));
+        if (pack.file) fclose(pack.file);
+        if (pack.index) fclose(pack.index);
+        free(pack.index_data);
+        if (pack.cctx) ZSTD_freeCCtx(pack.cctx);
+        return -EIO;
+    }
+
+    ZSTD_CCtx_setParameter(pack.cctx, ZSTD_c_compressionLevel, level);
+    ZSTD_CCtx_setParameter(pack.cctx, ZSTD_c_checksumFlag, 1);
+    fprintf(pack.index, "%s\n", FILE_INDEX_HEADER);
+
+    int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int res = dir_fd >= 0 ? seekable_pack_dir(&pack, dir_fd, "", error) : -errno;
+    if (res < 0 && !*error) seekable_error(error, "%s: %s", dir_path, strerror(-res));
+
+    /* The end of archive records go into the last frame. */
+    if (res == 0 && !seekable_reserve(&pack, TAR_RECORD_SIZE * 2)) res = -ENOMEM;
+    if (res == 0) res = seekable_flush(&pack);
+    fclose(pack.index);
+
+    if (res == 0) {
+        uint8_t header[SKIPPABLE_HEADER_SIZE];
+        seekable_write32(header, FILE_INDEX_MAGIC);
+        seekable_write32(header + 4, pack.index_size);
+        fwrite(header, 1, sizeof(header), pack.file);
+        fwrite(pack.index_data, 1, pack.index_size, pack.file);
+        pack.compressed_sizes[pack.frame_count] = SKIPPABLE_HEADER_SIZE + pack.index_size;
+        pack.decompressed_sizes[pack.frame_count] = 0;
+        pack.frame_count++;
+
+        seekable_write32(header, SEEK_TABLE_MAGIC);
+        seekable_write32(header + 4, pack.frame_count * 8 + SEEK_TABLE_FOOTER_SIZE);
+        fwrite(header, 1, sizeof(header), pack.file);
+        for (int i = 0; i < pack.frame_count; i++) {
+            uint8_t entry[8];
+            seekable_write32(entry, pack.compressed_sizes[i]);
+            seekable_write32(entry + 4, pack.decompressed_sizes[i]);
+            fwrite(entry, 1, sizeof(entry), pack.file);
+        }
+
+        uint8_t footer[SEEK_TABLE_FOOTER_SIZE] = {0};
+        seekable_write32(footer, pack.frame_count);
+        seekable_write32(footer + 5, SEEK_TABLE_FOOTER_MAGIC);
+        fwrite(footer, 1, sizeof(footer), pack.file);
+        if (ferror(pack.file)) res = -EIO;
+    }
+    else if (res == -ENOMEM && !*error) seekable_error(error, "out of memory");
+
+    if (fclose(pack.file) != 0 && res == 0) res = -errno;
+    if (res == 0 && rename(temp_path, archive_path) < 0) res = -errno;
+    if (res < 0) {
+        if (!*error) seekable_error(error, "%s: %s", archive_path, strerror(-res));
+        remove(temp_path);
+    }
+
+    free(pack.index_data);
+    free(pack.frame);
+    free(pack.compressed_sizes);
+    free(pack.decompressed_sizes);
+    ZSTD_freeCCtx(pack.cctx);
+    return res;
+}
@@ -0,0 +1,25 @@
+#ifndef __SHA256
+#define __SHA256
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA256_SIZE 32
+#define SHA256_HEX_SIZE (SHA256_SIZE * 2 + 1)
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t buffer[64];
+    int buffer_length;
+} sha256_t;
+
+extern void sha256_init(sha256_t* sha);
+extern void sha256_update(sha256_t* sha, const void* data, size_t length);
+extern void sha256_final(sha256_t* sha, uint8_t* digest);
+extern void sha256_to_hex(const uint8_t* digest, char* hex);
+extern int sha256_from_hex(const char* hex, uint8_t* digest);
+extern int sha256_fd(int fd, uint8_t* digest);
+
+#endif
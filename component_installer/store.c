@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include "component_installer.h"
+
+/* Every regular file of every installed component version is stored once under objects/, named after the SHA-256 of its
+   contents and its mode (objects/ab/cdef...-644), with the write bits removed. A container gets a reflink of the object when the
+   filesystem can clone, otherwise a hard link, and a copy only when the store is on another filesystem. A hard link shares the
+   inode with the store, so the object being read-only is what keeps an in-place write in one container from reaching the
+   others. Replacing the file (unlink or rename over it, as Wine and the installers do) is unaffected.
+
+   Objects whose link count has dropped back to one are not used by any container and are removed by store_prune().
+
+   versions/<component>/<version> holds the unpacked tree of every version added to the store, made of links to its objects, so
+   keeping all of them side by side costs no more than their distinct files. A destination uses one version of a component
+   through .components/<component>, a symlink to that tree, and a relative symlink per file going through it
+   (system32/d3d9.dll -> ../.components/dxvk/system32/d3d9.dll). Activating another version replaces .components/<component>
+   with a single rename, after which every file resolves into the new tree, and only the per-file links of the files that one
+   of the two versions lacks are created or removed. */
+
+static void store_error(char* error, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(error, COMPONENT_ERROR_LENGTH, format, args);
+    va_end(args);
+}
+
+static int store_make_parents(int dir_fd, const char* path) {
+    char parent[PATH_MAX];
+    snprintf(parent, sizeof(parent), "%s", path);
+
+    for (char* slash = strchr(parent, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdirat(dir_fd, parent, 0755) < 0 && errno != EEXIST) return -errno;
+        *slash = '/';
+    }
+    return 0;
+}
+
+int store_open(const char* path) {
+    mkdir(path, 0755);
+
+    int store_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (store_fd < 0) return -errno;
+
+    if ((mkdirat(store_fd, STORE_OBJECTS_DIR, 0755) < 0 && errno != EEXIST) ||
+        (mkdirat(store_fd, STORE_TEMP_DIR, 0755) < 0 && errno != EEXIST) ||
+        (mkdirat(store_fd, STORE_VERSIONS_DIR, 0755) < 0 && errno != EEXIST)) {
+        int res = -errno;
+        close(store_fd);
+        return res;
+    }
+    return store_fd;
+}
+
+void store_object_path(const uint8_t* hash, int mode, char* path) {
+    char hex[SHA256_HEX_SIZE];
+    sha256_to_hex(hash, hex);
+    snprintf(path, STORE_OBJECT_PATH_LENGTH, "%s/%.2s/%s-%o", STORE_OBJECTS_DIR, hex, hex + 2, mode & STORE_OBJECT_MODE);
+}
+
+int store_prepare_object(int store_fd, const char* object_path) {
+    return store_make_parents(store_fd, object_path);
+}
+
+static int store_copy(int source_fd, int dest_fd) {
+    struct stat source_stat;
+    if (fstat(source_fd, &source_stat) < 0) return -errno;
+
+    off_t offset = 0;
+    while (offset < source_stat.st_size) {
+        ssize_t res = sendfile(dest_fd, source_fd, &offset, source_stat.st_size - offset);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        if (res == 0) return -EIO;
+    }
+    return 0;
+}
+
+/* Creates temp_path in dest as a clone or copy of the object, trying a clone first while can_clone is set and clearing it when
+   the filesystem turns out not to support it. */
+static int store_clone_or_copy(int store_fd, const char* object_path, int dest_fd, const char* temp_path, bool copy, bool* can_clone) {
+    int source_fd = openat(store_fd, object_path, O_RDONLY | O_CLOEXEC);
+    if (source_fd < 0) return -errno;
+
+    struct stat source_stat;
+    fstat(source_fd, &source_stat);
+
+    int fd = openat(dest_fd, temp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, source_stat.st_mode & 07777);
+    if (fd < 0) {
+        int res = -errno;
+        close(source_fd);
+        return res;
+    }
+
+    int res = -EOPNOTSUPP;
+    if (*can_clone) {
+        res = ioctl(fd, FICLONE, source_fd) == 0 ? 0 : -errno;
+        if (res < 0 && res != -EXDEV) *can_clone = false;
+    }
+    if (res < 0 && copy) res = store_copy(source_fd, fd);
+
+    struct timespec times[2] = {{0, UTIME_OMIT}, source_stat.st_mtim};
+    if (res == 0) futimens(fd, times);
+
+    close(fd);
+    close(source_fd);
+    if (res < 0) unlinkat(dest_fd, temp_path, 0);
+    return res;
+}
+
+/* Puts the object at path in dest, replacing whatever is there in one rename. Like extracted files, path is resolved with
+   tzst_open_parent() so that a symlink in the destination cannot send it elsewhere. */
+static int store_place(int store_fd, const char* object_path, int dest_fd, const char* path, bool* can_clone) {
+    struct stat object_stat, dest_stat;
+    if (fstatat(store_fd, object_path, &object_stat, 0) < 0) return -errno;
+
+    const char* name;
+    int parent_fd = tzst_open_parent(dest_fd, path, true, &name);
+    if (parent_fd < 0) return -errno;
+
+    if (fstatat(parent_fd, name, &dest_stat, AT_SYMLINK_NOFOLLOW) == 0 && dest_stat.st_ino == object_stat.st_ino &&
+        dest_stat.st_dev == object_stat.st_dev) {
+        close(parent_fd);
+        return 0;
+    }
+
+    char temp_name[NAME_MAX + 1];
+    if (snprintf(temp_name, sizeof(temp_name), "%s.%d.tmp", name, getpid()) >= (int)sizeof(temp_name)) {
+        close(parent_fd);
+        return -ENAMETOOLONG;
+    }
+    unlinkat(parent_fd, temp_name, 0);
+
+    int res = *can_clone ? store_clone_or_copy(store_fd, object_path, parent_fd, temp_name, false, can_clone) : -EOPNOTSUPP;
+    if (res < 0) res = linkat(store_fd, object_path, parent_fd, temp_name, 0) == 0 ? 0 : -errno;
+    if (res == -EXDEV || res == -EMLINK || res == -EPERM) res = store_clone_or_copy(store_fd, object_path, parent_fd, temp_name, true, can_clone);
+
+    if (res == 0 && renameat(parent_fd, temp_name, parent_fd, name) < 0) {
+        res = -errno;
+        unlinkat(parent_fd, temp_name, 0);
+    }
+    close(parent_fd);
+    return res;
+}
+
+bool store_has_object(int store_fd, const manifest_file_t* file) {
+    char object_path[STORE_OBJECT_PATH_LENGTH];
+    store_object_path(file->hash, file->mode, object_path);
+
+    struct stat object_stat;
+    return fstatat(store_fd, object_path, &object_stat, 0) == 0 && object_stat.st_size == file->size;
+}
+
+int store_link(int store_fd, const manifest_version_t* version, int dest_fd, char* error) {
+    bool can_clone = true;
+
+    for (int i = 0; i < version->file_count; i++) {
+        const manifest_file_t* file = &version->files[i];
+        if (!store_has_object(store_fd, file)) {
+            store_error(error, "%s is not in the store", file->path);
+            return -ENOENT;
+        }
+
+        char object_path[STORE_OBJECT_PATH_LENGTH];
+        store_object_path(file->hash, file->mode, object_path);
+
+        int res = store_place(store_fd, object_path, dest_fd, file->path, &can_clone);
+        if (res < 0) {
+            store_error(error, "%s: %s", file->path, strerror(-res));
+            return res;
+        }
+    }
+    return 0;
+}
+
+/* Must not run while an install into the same store is in progress, its objects are not linked anywhere yet. */
+int store_prune(int store_fd, uint64_t* freed_bytes, int* freed_objects) {
+    *freed_bytes = 0;
+    *freed_objects = 0;
+
+    int temp_fd = openat(store_fd, STORE_TEMP_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR* temp_dir = temp_fd >= 0 ? fdopendir(temp_fd) : NULL;
+    if (temp_dir) {
+        struct dirent* entry;
+        while ((entry = readdir(temp_dir))) {
+            if (entry->d_name[0] != '.') unlinkat(temp_fd, entry->d_name, 0);
+        }
+        closedir(temp_dir);
+    }
+
+    int objects_fd = openat(store_fd, STORE_OBJECTS_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR* objects_dir = objects_fd >= 0 ? fdopendir(objects_fd) : NULL;
+    if (!objects_dir) return -errno;
+
+    struct dirent* bucket;
+    while ((bucket = readdir(objects_dir))) {
+        if (bucket->d_name[0] == '.') continue;
+
+        int bucket_fd = openat(objects_fd, bucket->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DIR* bucket_dir = bucket_fd >= 0 ? fdopendir(bucket_fd) : NULL;
+        if (!bucket_dir) continue;
+
+        struct dirent* entry;
+        while ((entry = readdir(bucket_dir))) {
+            struct stat object_stat;
+            if (entry->d_name[0] == '.' || fstatat(bucket_fd, entry->d_name, &object_stat, AT_SYMLINK_NOFOLLOW) < 0) continue;
+            if (object_stat.st_nlink > 1 || unlinkat(bucket_fd, entry->d_name, 0) < 0) continue;
+
+            *freed_bytes += object_stat.st_size;
+            (*freed_objects)++;
+        }
+        closedir(bucket_dir);
+        unlinkat(objects_fd, bucket->d_name, AT_REMOVEDIR);
+    }
+
+    closedir(objects_dir);
+    return 0;
+}
+
+/* Adds every file and symlink below dir_fd to list, with its path relative to the top directory and no hash. */
+static int store_list_files(int dir_fd, const char* prefix, manifest_version_t* list) {
+    DIR* dir = fdopendir(dir_fd);
+    if (!dir) {
+        close(dir_fd);
+        return -errno;
+    }
+
+    int res = 0;
+    struct dirent* entry;
+    while (res == 0 && (entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s%s", prefix, entry->d_name);
+
+        struct stat entry_stat;
+        if (fstatat(dirfd(dir), entry->d_name, &entry_stat, AT_SYMLINK_NOFOLLOW) < 0) {
+            res = -errno;
+        }
+        else if (S_ISDIR(entry_stat.st_mode)) {
+            int child_fd = openat(dirfd(dir), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            strcat(path, "/");
+            res = child_fd >= 0 ? store_list_files(child_fd, path, list) : -errno;
+        }
+        else {
+            static const uint8_t no_hash[SHA256_SIZE] = {0};
+            if (!manifest_add_file(list, path, entry_stat.st_mode & 07777, entry_stat.st_size, no_hash)) res = -ENOMEM;
+        }
+    }
+
+    closedir(dir);
+    return res;
+}
+
+int store_list_tree(const char* path, manifest_version_t* list) {
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return dir_fd >= 0 ? store_list_files(dir_fd, "", list) : -errno;
+}
+
+/* Writes the path of to relative to the directory from_dir, both of which have to exist. */
+static int store_relative_path(const char* from_dir, const char* to, char* path) {
+    char from_real[PATH_MAX], to_real[PATH_MAX];
+    if (!realpath(from_dir, from_real) || !realpath(to, to_real)) return -errno;
+
+    /* The length of the directories both have in common, which ends where both paths end or have a slash. */
+    int common = 0;
+    for (int i = 0; ; i++) {
+        bool from_end = from_real[i] == '/' || from_real[i] == '\0';
+        bool to_end = to_real[i] == '/' || to_real[i] == '\0';
+        if (from_end && to_end) common = i;
+        if (from_real[i] != to_real[i] || from_real[i] == '\0') break;
+    }
+
+    path[0] = '\0';
+    for (const char* slash = from_real + common; *slash; slash++) {
+        if (*slash == '/') strcat(path, "../");
+    }
+    snprintf(path + strlen(path), PATH_MAX - strlen(path), "%s", to_real[common] == '/' ? to_real + common + 1 : to_real + common);
+    return 0;
+}
+
+static bool store_is_symlink_to(int dir_fd, const char* path, const char* target) {
+    char current[PATH_MAX];
+    ssize_t length = readlinkat(dir_fd, path, current, sizeof(current) - 1);
+    if (length < 0) return false;
+
+    current[length] = '\0';
+    return strcmp(current, target) == 0;
+}
+
+/* Points path at target, replacing whatever is there in one rename. */
+static int store_replace_symlink(int dir_fd, const char* path, const char* target) {
+    if (store_is_symlink_to(dir_fd, path, target)) return 0;
+
+    int res = store_make_parents(dir_fd, path);
+    if (res < 0) return res;
+
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, getpid());
+    unlinkat(dir_fd, temp_path, 0);
+
+    if (symlinkat(target, dir_fd, temp_path) < 0) return -errno;
+    if (renameat(dir_fd, temp_path, dir_fd, path) < 0) {
+        res = -errno;
+        unlinkat(dir_fd, temp_path, 0);
+    }
+    return res;
+}
+
+static void store_file_link_target(const char* component, const char* path, char* target) {
+    target[0] = '\0';
+    for (const char* slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/')) strcat(target, "../");
+    snprintf(target + strlen(target), PATH_MAX - strlen(target), "%s/%s/%s", STORE_LINKS_DIR, component, path);
+}
+
+int store_activate(const char* store_path, const char* component, const char* version, const char* dest_path, char* error) {
+    char version_path[PATH_MAX], links_path[PATH_MAX], component_link[PATH_MAX], target[PATH_MAX];
+    snprintf(version_path, sizeof(version_path), "%s/%s/%s/%s", store_path, STORE_VERSIONS_DIR, component, version);
+    snprintf(links_path, sizeof(links_path), "%s/%s", dest_path, STORE_LINKS_DIR);
+    snprintf(component_link, sizeof(component_link), "%s/%s", STORE_LINKS_DIR, component);
+
+    manifest_version_t files = {0}, old_files = {0};
+    int dest_fd = -1;
+    int res = 0;
+
+    mkdir(dest_path, 0755);
+    mkdir(links_path, 0755);
+
+    res = store_relative_path(links_path, version_path, target);
+    int version_fd = res == 0 ? open(version_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+    if (res == 0 && version_fd < 0) res = -errno;
+    if (res < 0) {
+        store_error(error, "%s: %s", version_path, strerror(-res));
+        return res;
+    }
+
+    res = store_list_files(version_fd, "", &files);
+    if (res == 0 && (dest_fd = open(dest_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) res = -errno;
+
+    /* The version active so far, found through the component link before it is replaced. */
+    int old_fd = dest_fd >= 0 ? openat(dest_fd, component_link, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+    if (old_fd >= 0 && res == 0) {
+        res = store_list_files(old_fd, "", &old_files);
+    }
+    else if (old_fd >= 0) close(old_fd);
+    if (res < 0) store_error(error, "%s: %s", dest_fd < 0 ? dest_path : version_path, strerror(-res));
+
+    /* Links for the files the old version lacks dangle until the swap, the others keep resolving into the old version. */
+    for (int i = 0; i < files.file_count && res == 0; i++) {
+        char file_target[PATH_MAX];
+        store_file_link_target(component, files.files[i].path, file_target);
+        res = store_replace_symlink(dest_fd, files.files[i].path, file_target);
+        if (res < 0) store_error(error, "%s: %s", files.files[i].path, strerror(-res));
+    }
+
+    if (res == 0) {
+        res = store_replace_symlink(dest_fd, component_link, target);
+        if (res < 0) store_error(error, "%s: %s", component_link, strerror(-res));
+    }
+
+    if (res == 0) {
+        manifest_sort_files(&files);
+        for (int i = 0; i < old_files.file_count; i++) {
+            const char* path = old_files.files[i].path;
+            char file_target[PATH_MAX];
+            store_file_link_target(component, path, file_target);
+            if (!manifest_find_file(&files, path) && store_is_symlink_to(dest_fd, path, file_target)) unlinkat(dest_fd, path, 0);
+        }
+    }
+
+    if (dest_fd >= 0) close(dest_fd);
+    manifest_version_free(&files);
+    manifest_version_free(&old_files);
+    return res;
+}
@@ -0,0 +1,1138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <zstd.h>
+#include "component_installer.h"
+
+#if __has_include(<linux/openat2.h>)
+#include <linux/openat2.h>
+#define HAVE_OPENAT2
+#endif
+
+#define BLOCK_SIZE (1024 * 1024)
+#define STREAM_BLOCK_COUNT 8
+#define MAX_OPEN_FILES 256
+#define MAX_WRITERS 16
+#define DEFAULT_WRITERS 4
+#define MAX_LONG_NAME 65536
+
+#define TAR_RECORD_SIZE 512
+#define TAR_TYPE_FILE '0'
+#define TAR_TYPE_HARDLINK '1'
+#define TAR_TYPE_SYMLINK '2'
+#define TAR_TYPE_DIRECTORY '5'
+#define TAR_TYPE_CONTIGUOUS '7'
+#define TAR_TYPE_GNU_LONG_NAME 'L'
+#define TAR_TYPE_GNU_LONG_LINK 'K'
+#define TAR_TYPE_PAX 'x'
+
+/* Each archive goes through a pipeline of three stages. A decompression thread fills fixed-size blocks with the tar stream, the
+   job thread parses the headers out of them, creates directories and links, and opens and preallocates the regular files, and a
+   pool of writer threads shared by all archives pwrite() the file contents straight out of the blocks. A block is reference
+   counted by the writes pointing into it and returns to its archive's free list when the last one completes, so every archive
+   holds at most STREAM_BLOCK_COUNT blocks and a slow disk stalls the decompressor instead of growing memory. A file is closed by
+   whichever of the parser and its writes finishes last.
+
+   Entry paths are taken relative to the destination. An absolute path or one going through ".." fails the job, and so does an
+   entry whose directories go through a symlink, whether an earlier entry or the destination itself put it there, since every
+   entry is created relative to its parent directory opened by tzst_open_parent(). Existing files are unlinked rather than
+   overwritten, so a library that is mapped by a running process keeps its old contents.
+
+   The parser hashes the contents of the files it dispatches when the job has a manifest or scans the archive, and the
+   decompression thread hashes the compressed input, so verifying needs no second pass over either.
+
+   In store mode a regular file is written to a temporary name in the store and renamed to its object name when it is closed,
+   so an object is never visible before its contents are complete. The destination gets its files from store_link() after the
+   last write, from the manifest, or from the files collected while parsing when there is none. */
+
+typedef struct tzst_stream tzst_stream_t;
+
+typedef struct tzst_block {
+    char* data;
+    int length;
+    int refs;
+    tzst_stream_t* stream;
+    struct tzst_block* next;
+} tzst_block_t;
+
+typedef struct {
+    int fd;
+    int refs;
+    struct timespec mtime;
+    int dir_fd;
+    char* path;
+    bool temporary;
+    char* object_path;
+    tzst_stream_t* stream;
+} tzst_file_t;
+
+typedef struct tzst_write {
+    tzst_file_t* file;
+    tzst_block_t* block;
+    const char* data;
+    int length;
+    off_t offset;
+    struct tzst_write* next;
+} tzst_write_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    tzst_write_t* head;
+    tzst_write_t* tail;
+    bool stop;
+    int thread_count;
+    pthread_t threads[MAX_WRITERS];
+} tzst_writer_pool_t;
+
+struct tzst_stream {
+    tzst_job_t* job;
+    tzst_writer_pool_t* writers;
+    int archive_fd;
+    int dest_fd;
+    int store_fd;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    tzst_block_t blocks[STREAM_BLOCK_COUNT];
+    tzst_block_t* free_blocks;
+    int free_block_count;
+    tzst_block_t* filled_head;
+    tzst_block_t* filled_tail;
+    bool end_of_archive;
+    bool failed;
+    int open_files;
+    tzst_block_t* current;
+    int position;
+    const manifest_version_t* manifest;
+    bool* present;
+    manifest_version_t* scan;
+    manifest_version_t collected;
+    sha256_t archive_sha;
+    uint64_t archive_size;
+};
+
+typedef struct {
+    tzst_job_t* jobs;
+    int count;
+    int next;
+    tzst_writer_pool_t* writers;
+} tzst_runner_t;
+
+static void tzst_fail(tzst_stream_t* stream, int error, const char* format, ...) {
+    pthread_mutex_lock(&stream->mutex);
+    if (!stream->failed) {
+        stream->failed = true;
+        stream->job->result = error > 0 ? -error : -EIO;
+
+        va_list args;
+        va_start(args, format);
+        vsnprintf(stream->job->error, sizeof(stream->job->error), format, args);
+        va_end(args);
+    }
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->mutex);
+}
+
+static bool tzst_failed(tzst_stream_t* stream) {
+    return __atomic_load_n(&stream->failed, __ATOMIC_ACQUIRE);
+}
+
+static void tzst_release_block(tzst_block_t* block) {
+    tzst_stream_t* stream = block->stream;
+    pthread_mutex_lock(&stream->mutex);
+    block->next = stream->free_blocks;
+    stream->free_blocks = block;
+    stream->free_block_count++;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->mutex);
+}
+
+static void tzst_block_unref(tzst_block_t* block) {
+    if (__atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL) == 0) tzst_release_block(block);
+}
+
+static void tzst_file_unref(tzst_file_t* file) {
+    if (__atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+
+    tzst_stream_t* stream = file->stream;
+    struct timespec times[2] = {{0, UTIME_OMIT}, file->mtime};
+    futimens(file->fd, times);
+    if (close(file->fd) < 0) tzst_fail(stream, errno, "%s: %s", file->path, strerror(errno));
+
+    if (file->temporary && (!file->object_path || tzst_failed(stream))) {
+        unlinkat(file->dir_fd, file->path, 0);
+    }
+    else if (file->temporary && renameat(file->dir_fd, file->path, file->dir_fd, file->object_path) < 0) {
+        tzst_fail(stream, errno, "%s: %s", file->object_path, strerror(errno));
+        unlinkat(file->dir_fd, file->path, 0);
+    }
+
+    free(file->object_path);
+    free(file->path);
+    free(file);
+
+    pthread_mutex_lock(&stream->mutex);
+    stream->open_files--;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->mutex);
+}
+
+static void tzst_run_write(tzst_write_t* request) {
+    tzst_file_t* file = request->file;
+    const char* data = request->data;
+    int remaining = request->length;
+    off_t offset = request->offset;
+
+    while (remaining > 0 && !tzst_failed(file->stream)) {
+        ssize_t res = pwrite(file->fd, data, remaining, offset);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            tzst_fail(file->stream, errno, "%s: %s", file->path, strerror(errno));
+            break;
+        }
+        data += res;
+        offset += res;
+        remaining -= res;
+    }
+
+    tzst_block_unref(request->block);
+    tzst_file_unref(file);
+    free(request);
+}
+
+static void* tzst_writer_main(void* param) {
+    tzst_writer_pool_t* pool = param;
+
+    while (true) {
+        pthread_mutex_lock(&pool->mutex);
+        while (!pool->head && !pool->stop) pthread_cond_wait(&pool->cond, &pool->mutex);
+
+        tzst_write_t* request = pool->head;
+        if (request) {
+            pool->head = request->next;
+            if (!pool->head) pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (!request) break;
+        tzst_run_write(request);
+    }
+    return NULL;
+}
+
+static void tzst_queue_write(tzst_writer_pool_t* pool, tzst_write_t* request) {
+    request->next = NULL;
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->tail) {
+        pool->tail->next = request;
+    }
+    else pool->head = request;
+    pool->tail = request;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static tzst_block_t* tzst_take_free_block(tzst_stream_t* stream) {
+    pthread_mutex_lock(&stream->mutex);
+    while (!stream->free_blocks && !stream->failed) pthread_cond_wait(&stream->cond, &stream->mutex);
+
+    tzst_block_t* block = stream->failed ? NULL : stream->free_blocks;
+    if (block) {
+        stream->free_blocks = block->next;
+        stream->free_block_count--;
+        block->length = 0;
+        block->refs = 1;
+        block->next = NULL;
+    }
+    pthread_mutex_unlock(&stream->mutex);
+    return block;
+}
+
+static void tzst_queue_block(tzst_stream_t* stream, tzst_block_t* block) {
+    pthread_mutex_lock(&stream->mutex);
+    if (stream->filled_tail) {
+        stream->filled_tail->next = block;
+    }
+    else stream->filled_head = block;
+    stream->filled_tail = block;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->mutex);
+}
+
+/* Blocks are always queued full except for the last one, so tar records never straddle two blocks in practice, the parser does
+   not rely on it though. */
+static void* tzst_decompress_main(void* param) {
+    tzst_stream_t* stream = param;
+
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    size_t input_capacity = ZSTD_DStreamInSize();
+    char* input_data = malloc(input_capacity);
+    if (!dctx || !input_data) {
+        tzst_fail(stream, ENOMEM, "out of memory");
+        goto end;
+    }
+
+    ZSTD_inBuffer input = {input_data, 0, 0};
+    tzst_block_t* block = NULL;
+    size_t frame_remaining = 0;
+    bool output_full = false;
+
+    while (!tzst_failed(stream)) {
+        if (input.pos == input.size && !output_full) {
+            ssize_t res = read(stream->archive_fd, input_data, input_capacity);
+            if (res < 0) {
+                if (errno == EINTR) continue;
+                tzst_fail(stream, errno, "%s: %s", stream->job->archive_path, strerror(errno));
+                break;
+            }
+            if (res == 0) break;
+
+            if (stream->manifest || stream->scan) sha256_update(&stream->archive_sha, input_data, res);
+            stream->archive_size += res;
+            input.size = res;
+            input.pos = 0;
+        }
+
+        if (!block && !(block = tzst_take_free_block(stream))) break;
+
+        ZSTD_outBuffer output = {block->data, BLOCK_SIZE, block->length};
+        frame_remaining = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(frame_remaining)) {
+            tzst_fail(stream, EINVAL, "%s: %s", stream->job->archive_path, ZSTD_getErrorName(frame_remaining));
+            break;
+        }
+
+        /* A full output buffer may leave decoded data inside the context, which has to be flushed before reading more input. */
+        output_full = output.pos == output.size;
+        block->length = output.pos;
+        if (block->length == BLOCK_SIZE) {
+            tzst_queue_block(stream, block);
+            block = NULL;
+        }
+    }
+
+    if (block) {
+        if (block->length > 0 && !tzst_failed(stream)) {
+            tzst_queue_block(stream, block);
+        }
+        else tzst_block_unref(block);
+    }
+
+    if (!tzst_failed(stream) && frame_remaining != 0) {
+        tzst_fail(stream, EINVAL, "%s: truncated archive", stream->job->archive_path);
+    }
+
+    if (!tzst_failed(stream) && (stream->manifest || stream->scan)) {
+        uint8_t digest[SHA256_SIZE];
+        sha256_final(&stream->archive_sha, digest);
+
+        if (stream->scan) {
+            memcpy(stream->scan->archive_hash, digest, SHA256_SIZE);
+            stream->scan->archive_size = stream->archive_size;
+        }
+        else if (stream->archive_size != stream->manifest->archive_size || memcmp(digest, stream->manifest->archive_hash, SHA256_SIZE) != 0) {
+            tzst_fail(stream, EBADMSG, "%s: archive does not match the manifest", stream->job->archive_path);
+        }
+    }
+
+end:
+    if (dctx) ZSTD_freeDCtx(dctx);
+    free(input_data);
+
+    pthread_mutex_lock(&stream->mutex);
+    stream->end_of_archive = true;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->mutex);
+    return NULL;
+}
+
+/* Returns the block holding the next unread byte, or NULL at the end of the archive or after a failure. */
+static tzst_block_t* tzst_current_block(tzst_stream_t* stream) {
+    if (stream->current) {
+        if (stream->position < stream->current->length) return stream->current;
+        tzst_block_unref(stream->current);
+        stream->current = NULL;
+    }
+
+    pthread_mutex_lock(&stream->mutex);
+    while (!stream->filled_head && !stream->end_of_archive && !stream->failed) pthread_cond_wait(&stream->cond, &stream->mutex);
+
+    tzst_block_t* block = stream->failed ? NULL : stream->filled_head;
+    if (block) {
+        stream->filled_head = block->next;
+        if (!stream->filled_head) stream->filled_tail = NULL;
+    }
+    pthread_mutex_unlock(&stream->mutex);
+
+    stream->current = block;
+    stream->position = 0;
+    return block;
+}
+
+static bool tzst_read(tzst_stream_t* stream, void* data, uint64_t length) {
+    while (length > 0) {
+        tzst_block_t* block = tzst_current_block(stream);
+        if (!block) {
+            tzst_fail(stream, EINVAL, "%s: unexpected end of archive", stream->job->archive_path);
+            return false;
+        }
+
+        int count = block->length - stream->position;
+        if (count > length) count = length;
+        if (data) {
+            memcpy(data, block->data + stream->position, count);
+            data = (char*)data + count;
+        }
+        stream->position += count;
+        length -= count;
+    }
+    return true;
+}
+
+/* Queues the next length bytes as writes to file, or skips them when file is NULL, hashing them into sha when it is set. */
+static bool tzst_dispatch(tzst_stream_t* stream, tzst_file_t* file, uint64_t length, sha256_t* sha) {
+    off_t offset = 0;
+    while (length > 0) {
+        tzst_block_t* block = tzst_current_block(stream);
+        if (!block) {
+            tzst_fail(stream, EINVAL, "%s: unexpected end of archive", stream->job->archive_path);
+            return false;
+        }
+
+        int count = block->length - stream->position;
+        if (count > length) count = length;
+        if (sha) sha256_update(sha, block->data + stream->position, count);
+
+        if (!file) {
+            stream->position += count;
+            length -= count;
+            continue;
+        }
+
+        tzst_write_t* request = malloc(sizeof(tzst_write_t));
+        if (!request) {
+            tzst_fail(stream, ENOMEM, "out of memory");
+            return false;
+        }
+
+        __atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&file->refs, 1, __ATOMIC_RELAXED);
+        request->file = file;
+        request->block = block;
+        request->data = block->data + stream->position;
+        request->length = count;
+        request->offset = offset;
+        tzst_queue_write(stream->writers, request);
+
+        stream->position += count;
+        offset += count;
+        length -= count;
+    }
+    return true;
+}
+
+static bool tzst_skip(tzst_stream_t* stream, uint64_t length) {
+    return tzst_dispatch(stream, NULL, length, NULL);
+}
+
+uint64_t tzst_parse_number(const char* field, int length) {
+    uint64_t value = 0;
+
+    /* GNU tar stores values that do not fit in octal as big-endian base-256 with the high bit of the first byte set. */
+    if (field[0] & 0x80) {
+        value = field[0] & 0x7f;
+        for (int i = 1; i < length; i++) value = (value << 8) | (unsigned char)field[i];
+        return value;
+    }
+
+    int i = 0;
+    while (i < length && field[i] == ' ') i++;
+    for (; i < length && field[i] >= '0' && field[i] <= '7'; i++) value = (value << 3) | (field[i] - '0');
+    return value;
+}
+
+bool tzst_verify_header(const unsigned char* header) {
+    unsigned int sum = 0;
+    for (int i = 0; i < TAR_RECORD_SIZE; i++) sum += i >= 148 && i < 156 ? ' ' : header[i];
+    return sum == tzst_parse_number((const char*)header + 148, 8);
+}
+
+/* Strips leading "./" and trailing slashes in place. Returns NULL for an absolute path or one with a ".." component. This alone
+   does not keep writes inside the destination, which also needs tzst_open_parent(). */
+char* tzst_clean_path(char* path) {
+    if (path[0] == '/') return NULL;
+    while (path[0] == '.' && path[1] == '/') {
+        path += 2;
+        while (*path == '/') path++;
+    }
+    if (strcmp(path, ".") == 0) path += 1;
+
+    int length = strlen(path);
+    while (length > 0 && path[length - 1] == '/') path[--length] = '\0';
+
+    for (char* component = path; *component; ) {
+        char* end = strchr(component, '/');
+        int component_length = end ? end - component : strlen(component);
+        if (component_length == 2 && component[0] == '.' && component[1] == '.') return NULL;
+        if (!end) break;
+        component = end + 1;
+    }
+    return path;
+}
+
+/* Opens the directory holding path beneath dir_fd, creating the missing ones when create is set, and points name at the last
+   component. No symlink is followed on the way, whether the archive created it or it was already in the destination, so that an
+   entry like lib/file after a symlink lib -> /elsewhere fails instead of being written outside. Returns the directory fd, or -1
+   with errno set. */
+int tzst_open_parent(int dir_fd, const char* path, bool create, const char** name) {
+    const char* slash = strrchr(path, '/');
+    *name = slash ? slash + 1 : path;
+    if (!**name || strcmp(*name, ".") == 0 || strcmp(*name, "..") == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!slash) return fcntl(dir_fd, F_DUPFD_CLOEXEC, 0);
+
+    char parent[PATH_MAX];
+    int length = slash - path;
+    if (length >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(parent, path, length);
+    parent[length] = '\0';
+
+#ifdef HAVE_OPENAT2
+    struct open_how how = {.flags = O_PATH | O_DIRECTORY | O_CLOEXEC, .resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS};
+    int parent_fd = syscall(SYS_openat2, dir_fd, parent, &how, sizeof(how));
+    if (parent_fd >= 0 || (errno != ENOSYS && errno != EAGAIN && !(create && errno == ENOENT))) return parent_fd;
+#endif
+
+    /* Without openat2() (Linux 5.6), and to create the missing directories, the path is walked one component at a time. */
+    int fd = fcntl(dir_fd, F_DUPFD_CLOEXEC, 0);
+    for (char* component = parent; fd >= 0 && component; ) {
+        char* end = strchr(component, '/');
+        if (end) *end = '\0';
+
+        if (*component && strcmp(component, ".") != 0) {
+            int child_fd = strcmp(component, "..") != 0 ? openat(fd, component, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) : -1;
+            if (child_fd < 0 && strcmp(component, "..") == 0) errno = EXDEV;
+            if (child_fd < 0 && errno == ENOENT && create && (mkdirat(fd, component, 0755) == 0 || errno == EEXIST)) {
+                child_fd = openat(fd, component, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            }
+
+            int error = errno;
+            close(fd);
+            fd = child_fd;
+            errno = error;
+        }
+        component = end ? end + 1 : NULL;
+    }
+    return fd;
+}
+
+/* Whether path beneath dir_fd is a regular file with the given size and hash. */
+bool tzst_has_file(int dir_fd, const char* path, uint64_t size, const uint8_t* hash) {
+    const char* name;
+    int parent_fd = tzst_open_parent(dir_fd, path, false, &name);
+    if (parent_fd < 0) return false;
+
+    struct stat file_stat;
+    uint8_t digest[SHA256_SIZE];
+    bool same = false;
+    if (fstatat(parent_fd, name, &file_stat, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size == size) {
+        int fd = openat(parent_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        same = fd >= 0 && sha256_fd(fd, digest) == 0 && memcmp(digest, hash, SHA256_SIZE) == 0;
+        if (fd >= 0) close(fd);
+    }
+    close(parent_fd);
+    return same;
+}
+
+static bool tzst_extract_file(tzst_stream_t* stream, const char* path, int mode, uint64_t size, time_t mtime, const manifest_file_t* entry) {
+    static unsigned int temp_counter = 0;
+    bool store = stream->store_fd >= 0;
+    char temp_path[64];
+    if (store) {
+        snprintf(temp_path, sizeof(temp_path), "%s/%d.%u", STORE_TEMP_DIR, getpid(), __atomic_fetch_add(&temp_counter, 1, __ATOMIC_RELAXED));
+    }
+
+    pthread_mutex_lock(&stream->mutex);
+    while (stream->open_files >= MAX_OPEN_FILES && !stream->failed) pthread_cond_wait(&stream->cond, &stream->mutex);
+    stream->open_files++;
+    pthread_mutex_unlock(&stream->mutex);
+
+    tzst_file_t* file = calloc(1, sizeof(tzst_file_t));
+    if (file) file->path = strdup(store ? temp_path : path);
+    if (!file || !file->path) {
+        free(file);
+        file = NULL;
+        tzst_fail(stream, ENOMEM, "out of memory");
+    }
+
+    int fd = -1;
+    if (file && store) {
+        file->dir_fd = stream->store_fd;
+        file->temporary = true;
+        fd = openat(stream->store_fd, temp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode & STORE_OBJECT_MODE);
+        if (fd < 0) tzst_fail(stream, errno, "%s: %s", temp_path, strerror(errno));
+    }
+    else if (file) {
+        const char* name;
+        int parent_fd = tzst_open_parent(stream->dest_fd, path, true, &name);
+        file->dir_fd = stream->dest_fd;
+        if (parent_fd >= 0) {
+            unlinkat(parent_fd, name, 0);
+            fd = openat(parent_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, mode & 07777);
+            int error = errno;
+            close(parent_fd);
+            errno = error;
+        }
+        if (fd < 0) tzst_fail(stream, errno, "%s: %s", path, strerror(errno));
+    }
+
+    /* Preallocating lets the filesystem lay the file out in one piece even though its blocks are written out of order, and fails
+       with ENOSPC before anything is written. */
+    if (fd >= 0 && size > 0 && fallocate(fd, 0, 0, size) < 0 && errno != EOPNOTSUPP && errno != ENOSYS && errno != EINVAL) {
+        tzst_fail(stream, errno, "%s: %s", path, strerror(errno));
+    }
+
+    if (fd < 0) {
+        if (file) free(file->path);
+        free(file);
+
+        pthread_mutex_lock(&stream->mutex);
+        stream->open_files--;
+        pthread_mutex_unlock(&stream->mutex);
+        return false;
+    }
+
+    file->fd = fd;
+    file->refs = 1;
+    file->mtime.tv_sec = mtime;
+    file->stream = stream;
+
+    sha256_t sha;
+    sha256_init(&sha);
+    bool success = tzst_dispatch(stream, file, size, entry || store ? &sha : NULL);
+
+    uint8_t digest[SHA256_SIZE];
+    if (success && (entry || store)) sha256_final(&sha, digest);
+
+    if (success && entry && memcmp(digest, entry->hash, SHA256_SIZE) != 0) {
+        tzst_fail(stream, EBADMSG, "%s: %s does not match the manifest", stream->job->archive_path, path);
+        success = false;
+    }
+
+    /* The object name is only known once the parser has hashed the contents, which is always before the last write completes
+       since the parser holds a reference until here. */
+    if (success && store) {
+        char object_path[STORE_OBJECT_PATH_LENGTH];
+        store_object_path(digest, mode, object_path);
+        int res = store_prepare_object(stream->store_fd, object_path);
+        file->object_path = strdup(object_path);
+
+        if (res < 0) {
+            tzst_fail(stream, -res, "%s: %s", object_path, strerror(-res));
+        }
+        else if (!file->object_path || (stream->scan && !manifest_add_file(stream->scan, path, mode & 07777, size, digest))) {
+            tzst_fail(stream, ENOMEM, "out of memory");
+        }
+        else if (stream->scan) stream->scan->installed_size += size;
+    }
+
+    tzst_file_unref(file);
+    return success && !tzst_failed(stream);
+}
+
+static bool tzst_scan_entry(tzst_stream_t* stream, char type, bool regular, const char* path, char* link_name, int mode, uint64_t size) {
+    manifest_version_t* scan = stream->scan;
+    if (!*path || (!regular && type != TAR_TYPE_HARDLINK)) return tzst_skip(stream, size);
+
+    uint8_t digest[SHA256_SIZE];
+    uint64_t file_size = size;
+    if (regular) {
+        sha256_t sha;
+        sha256_init(&sha);
+        if (!tzst_dispatch(stream, NULL, size, &sha)) return false;
+        sha256_final(&sha, digest);
+    }
+    else {
+        /* The scanned files are not sorted yet, and archives only have a few of them. */
+        char* target = tzst_clean_path(link_name);
+        const manifest_file_t* entry = NULL;
+        for (int i = 0; target && i < scan->file_count && !entry; i++) {
+            if (strcmp(scan->files[i].path, target) == 0) entry = &scan->files[i];
+        }
+        if (!entry) {
+            tzst_fail(stream, EINVAL, "%s: %s links to a missing file", stream->job->archive_path, path);
+            return false;
+        }
+
+        memcpy(digest, entry->hash, SHA256_SIZE);
+        mode = entry->mode;
+        file_size = entry->size;
+        if (!tzst_skip(stream, size)) return false;
+    }
+
+    if (!manifest_add_file(scan, path, mode & 07777, file_size, digest)) {
+        tzst_fail(stream, ENOMEM, "out of memory");
+        return false;
+    }
+    scan->installed_size += file_size;
+    return true;
+}
+
+static bool tzst_extract_entry(tzst_stream_t* stream, char type, char* name, char* link_name, int mode, uint64_t size, time_t mtime) {
+    int dest_fd = stream->dest_fd;
+    char* path = tzst_clean_path(name);
+    if (!path) {
+        tzst_fail(stream, EINVAL, "%s: unsafe path %s", stream->job->archive_path, name);
+        return false;
+    }
+
+    bool regular = type == TAR_TYPE_FILE || type == '\0' || type == TAR_TYPE_CONTIGUOUS;
+    if (stream->dest_fd < 0) return tzst_scan_entry(stream, type, regular, path, link_name, mode, size);
+    if (!tzst_path_selected(stream->job, path)) return tzst_skip(stream, size);
+
+    const manifest_file_t* entry = NULL;
+    if (stream->manifest && *path && (regular || type == TAR_TYPE_HARDLINK)) {
+        entry = manifest_find_file(stream->manifest, path);
+        if (!entry || (regular && entry->size != size)) {
+            tzst_fail(stream, EBADMSG, "%s: %s does not match the manifest", stream->job->archive_path, path);
+            return false;
+        }
+        if (stream->present[entry - stream->manifest->files]) return tzst_skip(stream, size);
+    }
+
+    if (regular) {
+        if (!*path) return tzst_skip(stream, size);
+        return tzst_extract_file(stream, path, mode, size, mtime, entry);
+    }
+
+    /* A hard link is one more name for an object, store_link() creates it with the rest. */
+    if (stream->store_fd >= 0 && type == TAR_TYPE_HARDLINK) {
+        return stream->scan ? tzst_scan_entry(stream, type, false, path, link_name, mode, size) : tzst_skip(stream, size);
+    }
+
+    if (!*path || (type != TAR_TYPE_DIRECTORY && type != TAR_TYPE_SYMLINK && type != TAR_TYPE_HARDLINK)) return tzst_skip(stream, size);
+
+    const char* base;
+    int parent_fd = tzst_open_parent(dest_fd, path, true, &base);
+    int res = parent_fd >= 0 ? 0 : -1;
+    if (res == 0 && type == TAR_TYPE_DIRECTORY) {
+        res = mkdirat(parent_fd, base, (mode & 07777) | 0700);
+        if (res < 0 && errno == EEXIST) res = 0;
+    }
+    else if (res == 0 && type == TAR_TYPE_SYMLINK) {
+        unlinkat(parent_fd, base, 0);
+        res = symlinkat(link_name, parent_fd, base);
+    }
+    else if (res == 0) {
+        char* target = tzst_clean_path(link_name);
+        if (!target || !*target) {
+            close(parent_fd);
+            tzst_fail(stream, EINVAL, "%s: unsafe link %s", stream->job->archive_path, link_name);
+            return false;
+        }
+
+        const char* target_name;
+        int target_parent_fd = tzst_open_parent(dest_fd, target, false, &target_name);
+        res = target_parent_fd >= 0 ? 0 : -1;
+        if (res == 0) {
+            unlinkat(parent_fd, base, 0);
+            res = linkat(target_parent_fd, target_name, parent_fd, base, 0);
+        }
+        int error = errno;
+        if (target_parent_fd >= 0) close(target_parent_fd);
+        errno = error;
+    }
+
+    int error = errno;
+    if (parent_fd >= 0) close(parent_fd);
+    if (res < 0) {
+        tzst_fail(stream, error, "%s: %s", path, strerror(error));
+        return false;
+    }
+    return tzst_skip(stream, size);
+}
+
+static char* tzst_read_long_value(tzst_stream_t* stream, uint64_t size) {
+    if (size >= MAX_LONG_NAME) {
+        tzst_fail(stream, EINVAL, "%s: oversized extended header", stream->job->archive_path);
+        return NULL;
+    }
+
+    char* value = malloc(size + 1);
+    if (!value) {
+        tzst_fail(stream, ENOMEM, "out of memory");
+        return NULL;
+    }
+
+    if (!tzst_read(stream, value, size)) {
+        free(value);
+        return NULL;
+    }
+    value[size] = '\0';
+    return value;
+}
+
+/* Pax records are "<length> <key>=<value>\n", only the ones that change how an entry is extracted are applied. */
+static void tzst_apply_pax(const char* records, uint64_t size, char** long_name, char** long_link, uint64_t* pax_size) {
+    const char* end = records + size;
+    while (records < end) {
+        char* key;
+        long length = strtol(records, &key, 10);
+        if (length <= 0 || length > end - records || *key != ' ') break;
+
+        key++;
+        const char* value = memchr(key, '=', records + length - key);
+        if (value) {
+            int key_length = value - key;
+            int value_length = records + length - 1 - (value + 1);
+            value++;
+
+            if (key_length == 4 && memcmp(key, "path", 4) == 0) {
+                free(*long_name);
+                *long_name = strndup(value, value_length);
+            }
+            else if (key_length == 8 && memcmp(key, "linkpath", 8) == 0) {
+                free(*long_link);
+                *long_link = strndup(value, value_length);
+            }
+            else if (key_length == 4 && memcmp(key, "size", 4) == 0) {
+                *pax_size = strtoull(value, NULL, 10);
+            }
+        }
+        records += length;
+    }
+}
+
+static void tzst_parse(tzst_stream_t* stream) {
+    char* long_name = NULL;
+    char* long_link = NULL;
+    uint64_t pax_size = UINT64_MAX;
+
+    while (!tzst_failed(stream)) {
+        unsigned char header[TAR_RECORD_SIZE];
+        if (!tzst_current_block(stream)) break;
+        if (!tzst_read(stream, header, TAR_RECORD_SIZE)) break;
+
+        bool zero = true;
+        for (int i = 0; i < TAR_RECORD_SIZE && zero; i++) zero = header[i] == 0;
+        if (zero) break;
+
+        if (!tzst_verify_header(header)) {
+            tzst_fail(stream, EINVAL, "%s: bad tar header checksum", stream->job->archive_path);
+            break;
+        }
+
+        char type = header[156];
+        int mode = tzst_parse_number((char*)header + 100, 8);
+        uint64_t size = pax_size != UINT64_MAX ? pax_size : tzst_parse_number((char*)header + 124, 12);
+        time_t mtime = tzst_parse_number((char*)header + 136, 12);
+        uint64_t padding = (TAR_RECORD_SIZE - size % TAR_RECORD_SIZE) % TAR_RECORD_SIZE;
+
+        if (type == TAR_TYPE_GNU_LONG_NAME || type == TAR_TYPE_GNU_LONG_LINK || type == TAR_TYPE_PAX) {
+            char* value = tzst_read_long_value(stream, size);
+            if (!value || !tzst_skip(stream, padding)) {
+                free(value);
+                break;
+            }
+
+            if (type == TAR_TYPE_GNU_LONG_NAME) {
+                free(long_name);
+                long_name = value;
+            }
+            else if (type == TAR_TYPE_GNU_LONG_LINK) {
+                free(long_link);
+                long_link = value;
+            }
+            else {
+                tzst_apply_pax(value, size, &long_name, &long_link, &pax_size);
+                free(value);
+            }
+            continue;
+        }
+
+        char name[PATH_MAX];
+        char link_name[PATH_MAX];
+        if (long_name) {
+            snprintf(name, sizeof(name), "%s", long_name);
+        }
+        else if (memcmp(header + 257, "ustar\0", 6) == 0 && header[345]) {
+            snprintf(name, sizeof(name), "%.155s/%.100s", (char*)header + 345, (char*)header);
+        }
+        else snprintf(name, sizeof(name), "%.100s", (char*)header);
+        if (long_link) {
+            snprintf(link_name, sizeof(link_name), "%s", long_link);
+        }
+        else snprintf(link_name, sizeof(link_name), "%.100s", (char*)header + 157);
+
+        free(long_name);
+        free(long_link);
+        long_name = long_link = NULL;
+        pax_size = UINT64_MAX;
+
+        if (!tzst_extract_entry(stream, type, name, link_name, mode, size, mtime)) break;
+        if (!tzst_skip(stream, padding)) break;
+    }
+
+    free(long_name);
+    free(long_link);
+
+    /* Decompress the rest of the archive so that the frame checksum is still verified. */
+    while (!tzst_failed(stream) && tzst_current_block(stream)) stream->position = stream->current->length;
+
+    if (stream->current) {
+        tzst_block_unref(stream->current);
+        stream->current = NULL;
+    }
+}
+
+/* Marks the manifest files already installed with the same contents, or already in the store, and fails when the rest does not
+   fit. */
+static void tzst_check_installed(tzst_stream_t* stream) {
+    const manifest_version_t* manifest = stream->manifest;
+    stream->present = calloc(manifest->file_count + 1, sizeof(bool));
+    if (!stream->present) {
+        tzst_fail(stream, ENOMEM, "out of memory");
+        return;
+    }
+
+    struct stat archive_stat;
+    if (fstat(stream->archive_fd, &archive_stat) == 0 && archive_stat.st_size != manifest->archive_size) {
+        tzst_fail(stream, EBADMSG, "%s: archive does not match the manifest", stream->job->archive_path);
+        return;
+    }
+
+    uint64_t needed = 0;
+    for (int i = 0; i < manifest->file_count; i++) {
+        const manifest_file_t* entry = &manifest->files[i];
+        if (!tzst_path_selected(stream->job, entry->path)) {
+            stream->present[i] = true;
+            continue;
+        }
+
+        if (stream->store_fd >= 0) {
+            stream->present[i] = store_has_object(stream->store_fd, entry);
+        }
+        else stream->present[i] = tzst_has_file(stream->dest_fd, entry->path, entry->size, entry->hash);
+        if (!stream->present[i]) needed += entry->size;
+    }
+
+    struct statvfs vfs;
+    bool store = stream->store_fd >= 0;
+    if (fstatvfs(store ? stream->store_fd : stream->dest_fd, &vfs) == 0 && (uint64_t)vfs.f_bavail * vfs.f_frsize < needed) {
+        tzst_fail(stream, ENOSPC, "%s: needs %llu bytes, %llu available", store ? stream->job->store_path : stream->job->dest_path,
+                  (unsigned long long)needed,
+                  (unsigned long long)vfs.f_bavail * vfs.f_frsize);
+    }
+}
+
+static int tzst_open_dest(const char* path) {
+    char parent[PATH_MAX];
+    snprintf(parent, sizeof(parent), "%s", path);
+
+    for (char* slash = strchr(parent + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(parent, 0755);
+        *slash = '/';
+    }
+    mkdir(parent, 0755);
+
+    return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+static void tzst_run_job(tzst_job_t* job, tzst_writer_pool_t* writers) {
+    job->result = 0;
+    job->error[0] = '\0';
+
+    tzst_stream_t* stream = calloc(1, sizeof(tzst_stream_t));
+    if (!stream) {
+        job->result = -ENOMEM;
+        snprintf(job->error, sizeof(job->error), "out of memory");
+        return;
+    }
+
+    stream->job = job;
+    stream->writers = writers;
+    stream->dest_fd = -1;
+    stream->store_fd = -1;
+    stream->manifest = job->manifest;
+    if (!job->dest_path) {
+        stream->scan = job->scan;
+    }
+    else if (job->store_path && !job->manifest) stream->scan = &stream->collected;
+    sha256_init(&stream->archive_sha);
+    pthread_mutex_init(&stream->mutex, NULL);
+    pthread_cond_init(&stream->cond, NULL);
+
+    for (int i = 0; i < STREAM_BLOCK_COUNT; i++) {
+        tzst_block_t* block = &stream->blocks[i];
+        block->stream = stream;
+        block->data = malloc(BLOCK_SIZE);
+        if (!block->data) {
+            tzst_fail(stream, ENOMEM, "out of memory");
+            continue;
+        }
+        block->next = stream->free_blocks;
+        stream->free_blocks = block;
+        stream->free_block_count++;
+    }
+    int block_count = stream->free_block_count;
+
+    stream->archive_fd = open(job->archive_path, O_RDONLY | O_CLOEXEC);
+    if (stream->archive_fd < 0) tzst_fail(stream, errno, "%s: %s", job->archive_path, strerror(errno));
+
+    if (!tzst_failed(stream) && job->dest_path) {
+        stream->dest_fd = tzst_open_dest(job->dest_path);
+        if (stream->dest_fd < 0) tzst_fail(stream, errno, "%s: %s", job->dest_path, strerror(errno));
+    }
+    else if (!tzst_failed(stream) && !stream->scan) {
+        tzst_fail(stream, EINVAL, "%s: no destination", job->archive_path);
+    }
+
+    if (!tzst_failed(stream) && job->dest_path && job->store_path) {
+        stream->store_fd = store_open(job->store_path);
+        if (stream->store_fd < 0) tzst_fail(stream, -stream->store_fd, "%s: %s", job->store_path, strerror(-stream->store_fd));
+    }
+
+    /* A seekable archive gives the selected files without reading the others, unless a selected path is a link. */
+    bool streamed = true;
+    if (!tzst_failed(stream) && job->filter_count > 0 && stream->store_fd < 0 && !stream->scan) {
+        streamed = seekable_extract(job, stream->dest_fd, writers->thread_count) == -ENOTSUP;
+    }
+
+    if (!tzst_failed(stream) && streamed && stream->manifest && !stream->scan) tzst_check_installed(stream);
+
+    pthread_t decompress_thread;
+    if (!tzst_failed(stream) && streamed) {
+        posix_fadvise(stream->archive_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        int res = pthread_create(&decompress_thread, NULL, tzst_decompress_main, stream);
+        if (res != 0) {
+            tzst_fail(stream, res, "%s", strerror(res));
+        }
+        else {
+            tzst_parse(stream);
+            pthread_join(decompress_thread, NULL);
+        }
+    }
+
+    /* After a failure the queue may still hold blocks the parser never took. Then wait for the writes still in flight. */
+    pthread_mutex_lock(&stream->mutex);
+    tzst_block_t* leftover = stream->filled_head;
+    stream->filled_head = stream->filled_tail = NULL;
+    pthread_mutex_unlock(&stream->mutex);
+
+    while (leftover) {
+        tzst_block_t* next = leftover->next;
+        tzst_block_unref(leftover);
+        leftover = next;
+    }
+
+    pthread_mutex_lock(&stream->mutex);
+    while (stream->open_files > 0 || stream->free_block_count < block_count) pthread_cond_wait(&stream->cond, &stream->mutex);
+    pthread_mutex_unlock(&stream->mutex);
+
+    if (stream->store_fd >= 0 && !tzst_failed(stream)) {
+        const manifest_version_t* files = stream->manifest ? stream->manifest : &stream->collected;
+        int res = store_link(stream->store_fd, files, stream->dest_fd, job->error);
+        if (res < 0) job->result = res;
+    }
+
+    if (stream->archive_fd >= 0) close(stream->archive_fd);
+    if (stream->dest_fd >= 0) close(stream->dest_fd);
+    if (stream->store_fd >= 0) close(stream->store_fd);
+    for (int i = 0; i < STREAM_BLOCK_COUNT; i++) free(stream->blocks[i].data);
+    if (stream->scan && !tzst_failed(stream)) manifest_sort_files(stream->scan);
+    manifest_version_free(&stream->collected);
+    free(stream->present);
+    pthread_cond_destroy(&stream->cond);
+    pthread_mutex_destroy(&stream->mutex);
+    free(stream);
+}
+
+bool tzst_path_selected(const tzst_job_t* job, const char* path) {
+    if (job->filter_count == 0) return true;
+
+    for (int i = 0; i < job->filter_count; i++) {
+        const char* filter = job->filters[i];
+        size_t length = strlen(filter);
+        while (length > 0 && filter[length - 1] == '/') length--;
+        if (strncmp(path, filter, length) == 0 && (path[length] == '\0' || path[length] == '/')) return true;
+    }
+    return false;
+}
+
+static void* tzst_runner_main(void* param) {
+    tzst_runner_t* runner = param;
+
+    while (true) {
+        int index = __atomic_fetch_add(&runner->next, 1, __ATOMIC_RELAXED);
+        if (index >= runner->count) break;
+        tzst_run_job(&runner->jobs[index], runner->writers);
+    }
+    return NULL;
+}
+
+int tzst_extract(tzst_job_t* jobs, int count, int writer_count) {
+    if (count <= 0) return 0;
+
+    tzst_writer_pool_t pool;
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.mutex, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    if (writer_count <= 0) writer_count = DEFAULT_WRITERS;
+    if (writer_count > MAX_WRITERS) writer_count = MAX_WRITERS;
+
+    for (int i = 0; i < writer_count; i++) {
+        if (pthread_create(&pool.threads[pool.thread_count], NULL, tzst_writer_main, &pool) == 0) pool.thread_count++;
+    }
+
+    tzst_runner_t runner = {jobs, count, 0, &pool};
+    int runner_count = count < TZST_MAX_PARALLEL_ARCHIVES ? count : TZST_MAX_PARALLEL_ARCHIVES;
+    pthread_t runner_threads[TZST_MAX_PARALLEL_ARCHIVES];
+    int started = 0;
+
+    if (pool.thread_count > 0) {
+        for (int i = 1; i < runner_count; i++) {
+            if (pthread_create(&runner_threads[started], NULL, tzst_runner_main, &runner) == 0) started++;
+        }
+        tzst_runner_main(&runner);
+    }
+    else {
+        for (int i = 0; i < count; i++) {
+            jobs[i].result = -EAGAIN;
+            snprintf(jobs[i].error, sizeof(jobs[i].error), "cannot start writer threads");
+        }
+    }
+
+    for (int i = 0; i < started; i++) pthread_join(runner_threads[i], NULL);
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.stop = true;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.mutex);
+    for (int i = 0; i < pool.thread_count; i++) pthread_join(pool.threads[i], NULL);
+
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.mutex);
+
+    int result = 0;
+    for (int i = 0; i < count; i++) {
+        if (jobs[i].result != 0) result = -1;
+    }
+    return result;
+}
@@ -0,0 +1 @@
+/* Empty on the host, struct ipc_perm already comes from <sys/ipc.h>. */
@@ -0,0 +1 @@
+/* Empty on the host, struct msqid_ds already comes from <sys/msg.h>. */
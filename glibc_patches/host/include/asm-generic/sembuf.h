@@ -0,0 +1 @@
+/* Empty on the host, struct semid_ds already comes from <sys/sem.h>. */
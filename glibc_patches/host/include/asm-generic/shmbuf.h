@@ -0,0 +1 @@
+/* Empty on the host, struct shmid_ds already comes from <sys/shm.h>. */
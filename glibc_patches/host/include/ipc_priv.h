@@ -0,0 +1,20 @@
+#ifndef __HOST_IPC_PRIV_H
+#define __HOST_IPC_PRIV_H
+
+/* Host stand-in for glibc's internal ipc_priv.h, just enough for the shm, sem and msg files to build against the system headers.
+   glibc's own struct ipc_perm names the members key and seq, the installed headers prefix them. */
+
+#define __key key
+#define __seq seq
+
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/sem.h>
+#include <sys/msg.h>
+
+#define shmid_ds shmid_ds
+#define semid_ds semid_ds
+#define msqid_ds msqid_ds
+
+#endif
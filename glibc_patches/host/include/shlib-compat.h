@@ -0,0 +1,6 @@
+/* Host stand-in for glibc's internal shlib-compat.h. The preload library has no symbol versions, so the versioned names become
+   plain aliases and the compat ones are left out. */
+
+#define weak_alias(name, aliasname)
+#define versioned_symbol(lib, local, symbol, version) extern __typeof(local) symbol __attribute__((alias(#local)))
+#define OTHER_SHLIB_COMPAT(lib, introduced, obsoleted) 0
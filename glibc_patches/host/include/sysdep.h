@@ -0,0 +1 @@
+/* Host stand-in for glibc's internal sysdep.h, nothing from it is needed outside of glibc. */
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+/* Microbenchmarks for the shm shim, linked against the host build of android_sysvshm and run against sysvshm_server:
+   - latency: mean, median and 99th percentile of shmget(), shmat(), the first write, shmdt() and shmctl(IPC_RMID),
+   - throughput: full create/attach/detach/remove cycles per second with 1 to N threads,
+   - scaling: shmat()/shmdt() and IPC_STAT cost while the process already holds 16 to M attached segments.
+   usage: sysvshm_bench [-s segment size] [-n iterations] [-t max threads] [-c max segment count] */
+
+#define OP_SHMGET 0
+#define OP_SHMAT 1
+#define OP_TOUCH 2
+#define OP_SHMDT 3
+#define OP_RMID 4
+#define OP_COUNT 5
+
+static const char* op_names[OP_COUNT] = {"shmget", "shmat", "first write", "shmdt", "shmctl(IPC_RMID)"};
+
+static size_t segment_size = 64 * 1024;
+static int iterations = 10000;
+static int max_threads = 8;
+static int max_segments = 4096;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static bool run_cycle(uint64_t* times) {
+    uint64_t start = now_ns();
+    int shmid = shmget(IPC_PRIVATE, segment_size, IPC_CREAT | 0600);
+    if (shmid < 0) return false;
+    uint64_t after_shmget = now_ns();
+
+    char* addr = shmat(shmid, NULL, 0);
+    if (addr == (void*)-1) return false;
+    uint64_t after_shmat = now_ns();
+
+    addr[0] = 1;
+    uint64_t after_touch = now_ns();
+
+    shmdt(addr);
+    uint64_t after_shmdt = now_ns();
+
+    shmctl(shmid, IPC_RMID, NULL);
+    uint64_t after_rmid = now_ns();
+
+    if (times) {
+        times[OP_SHMGET] = after_shmget - start;
+        times[OP_SHMAT] = after_shmat - after_shmget;
+        times[OP_TOUCH] = after_touch - after_shmat;
+        times[OP_SHMDT] = after_shmdt - after_touch;
+        times[OP_RMID] = after_rmid - after_shmdt;
+    }
+    return true;
+}
+
+static void bench_latency(void) {
+    uint64_t* samples = malloc(sizeof(uint64_t) * OP_COUNT * iterations);
+    if (!samples) return;
+
+    for (int i = 0; i < iterations; i++) {
+        uint64_t times[OP_COUNT];
+        if (!run_cycle(times)) {
+            fprintf(stderr, "latency: cycle %d failed\n", i);
+            free(samples);
+            return;
+        }
+        for (int op = 0; op < OP_COUNT; op++) samples[op * iterations + i] = times[op];
+    }
+
+    printf("latency (%zu byte segments, %d cycles)\n", segment_size, iterations);
+    printf("  %-18s %10s %10s %10s\n", "operation", "mean ns", "p50 ns", "p99 ns");
+    for (int op = 0; op < OP_COUNT; op++) {
+        uint64_t* op_samples = samples + op * iterations;
+        qsort(op_samples, iterations, sizeof(uint64_t), compare_u64);
+
+        uint64_t total = 0;
+        for (int i = 0; i < iterations; i++) total += op_samples[i];
+
+        printf("  %-18s %10llu %10llu %10llu\n", op_names[op], (unsigned long long)(total / iterations),
+               (unsigned long long)op_samples[iterations / 2], (unsigned long long)op_samples[iterations * 99 / 100]);
+    }
+    free(samples);
+}
+
+static void* throughput_thread(void* param) {
+    int cycles = (intptr_t)param;
+    for (int i = 0; i < cycles; i++) {
+        if (!run_cycle(NULL)) return (void*)1;
+    }
+    return NULL;
+}
+
+static void bench_throughput(void) {
+    printf("throughput (%zu byte segments, %d cycles per thread)\n", segment_size, iterations);
+    printf("  %-8s %14s\n", "threads", "cycles/s");
+
+    for (int thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+        pthread_t threads[thread_count];
+        uint64_t start = now_ns();
+        for (int i = 0; i < thread_count; i++) {
+            pthread_create(&threads[i], NULL, throughput_thread, (void*)(intptr_t)iterations);
+        }
+
+        bool failed = false;
+        for (int i = 0; i < thread_count; i++) {
+            void* result;
+            pthread_join(threads[i], &result);
+            if (result) failed = true;
+        }
+
+        double seconds = (now_ns() - start) / 1e9;
+        if (failed) {
+            printf("  %-8d %14s\n", thread_count, "failed");
+        }
+        else printf("  %-8d %14.0f\n", thread_count, (double)thread_count * iterations / seconds);
+    }
+}
+
+static void bench_scaling(void) {
+    printf("scaling (%zu byte segments held attached)\n", segment_size);
+    printf("  %-8s %16s %16s\n", "segments", "shmat+shmdt ns", "IPC_STAT ns");
+
+    int* shmids = malloc(sizeof(int) * max_segments);
+    void** addrs = malloc(sizeof(void*) * max_segments);
+    if (!shmids || !addrs) {
+        free(shmids);
+        free(addrs);
+        return;
+    }
+
+    int held = 0;
+    for (int count = 16; count <= max_segments; count *= 4) {
+        for (; held < count; held++) {
+            shmids[held] = shmget(IPC_PRIVATE, segment_size, IPC_CREAT | 0600);
+            addrs[held] = shmids[held] >= 0 ? shmat(shmids[held], NULL, 0) : (void*)-1;
+            if (addrs[held] == (void*)-1) break;
+        }
+        if (held < count) {
+            printf("  %-8d %16s %16s\n", count, "failed", "failed");
+            break;
+        }
+
+        int shmid = shmids[count / 2];
+        uint64_t start = now_ns();
+        for (int i = 0; i < iterations; i++) {
+            void* addr = shmat(shmid, NULL, 0);
+            if (addr != (void*)-1) shmdt(addr);
+        }
+        uint64_t attach_ns = (now_ns() - start) / iterations;
+
+        struct shmid_ds stat;
+        unsigned int seed = count;
+        start = now_ns();
+        for (int i = 0; i < iterations; i++) shmctl(shmids[rand_r(&seed) % count], IPC_STAT, &stat);
+        uint64_t stat_ns = (now_ns() - start) / iterations;
+
+        printf("  %-8d %16llu %16llu\n", count, (unsigned long long)attach_ns, (unsigned long long)stat_ns);
+    }
+
+    for (int i = 0; i < held; i++) {
+        if (addrs[i] != (void*)-1) shmdt(addrs[i]);
+        if (shmids[i] >= 0) shmctl(shmids[i], IPC_RMID, NULL);
+    }
+    free(shmids);
+    free(addrs);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "s:n:t:c:")) != -1) {
+        switch (opt) {
+            case 's':
+                segment_size = strtoull(optarg, NULL, 0);
+                break;
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            case 't':
+                max_threads = atoi(optarg);
+                break;
+            case 'c':
+                max_segments = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-s segment size] [-n iterations] [-t max threads] [-c max segment count]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (!getenv("ANDROID_SYSVSHM_SERVER")) {
+        fprintf(stderr, "ANDROID_SYSVSHM_SERVER is not set, start sysvshm_server and point it to its socket\n");
+        return 1;
+    }
+
+    if (segment_size == 0 || iterations <= 0 || max_threads <= 0 || max_segments < 16) {
+        fprintf(stderr, "invalid arguments\n");
+        return 1;
+    }
+
+    bench_latency();
+    bench_throughput();
+    bench_scaling();
+    return 0;
+}
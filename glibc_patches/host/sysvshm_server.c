@@ -0,0 +1,497 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ipc.h>
+#include <fcntl.h>
+#include <limits.h>
+
+/* Stand-in for the sysvshm server of the Android app, for running the shim on host Linux. Segments are memfds numbered from 1,
+   POSIX shared memory objects are memfds looked up by name, and one thread serves each client. It speaks the same requests as
+   android_sysvshm.c: a 1-byte request code and a 4-byte argument, followed by the payload of the batched, keyed and named
+   requests. It listens on a SOCK_SEQPACKET socket, where every request is one packet, or with -s on a SOCK_STREAM socket like the
+   Android server does. With -l it plays a legacy server that only answers REQUEST_CODE_SHMGET, REQUEST_CODE_GET_FD and
+   REQUEST_CODE_DELETE and ignores the rest. */
+
+#define REQUEST_CODE_SHMGET 0
+#define REQUEST_CODE_GET_FD 1
+#define REQUEST_CODE_DELETE 2
+#define REQUEST_CODE_SHMGET_FD 3
+#define REQUEST_CODE_SHMGET_KEY 6
+#define REQUEST_CODE_DELETE_BATCH 7
+#define REQUEST_CODE_SHM_OPEN 8
+#define REQUEST_CODE_SHM_UNLINK 9
+#define REQUEST_CODE_VERSION 10
+
+#define PROTOCOL_VERSION 1
+
+#define MIN_REQUEST_LENGTH 5
+#define MAX_BATCH 64
+#define MAX_PACKET_LENGTH 1024
+#define NAMESPACE_MASK (3 << 24)
+
+typedef struct {
+    int fd;
+    uint64_t size;
+    key_t key;
+    int namespace;
+} segment_t;
+
+static segment_t* segments = NULL;
+static int segment_capacity = 0;
+static int next_id = 1;
+static pthread_mutex_t segment_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    char name[NAME_MAX + 1];
+    int fd;
+} shm_object_t;
+
+static shm_object_t* shm_objects = NULL;
+static int shm_object_count = 0;
+
+static bool packet_mode = true;
+static bool legacy_mode = false;
+static __thread char packet[MAX_PACKET_LENGTH];
+static __thread int packet_length = 0;
+static __thread int packet_offset = 0;
+
+static bool recv_all(int fd, void* data, int length) {
+    if (packet_mode) {
+        if (packet_length - packet_offset < length) return false;
+        memcpy(data, packet + packet_offset, length);
+        packet_offset += length;
+        return true;
+    }
+
+    int received = 0;
+    while (received < length) {
+        int res = recv(fd, (char*)data + received, length - received, 0);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) return false;
+        received += res;
+    }
+    return true;
+}
+
+static bool recv_request(int fd, char* request_code, int* arg, int* attached_fd) {
+    char request_data[MIN_REQUEST_LENGTH];
+    struct iovec iovmsg = {.iov_base = request_data, .iov_len = MIN_REQUEST_LENGTH};
+    if (packet_mode) iovmsg = (struct iovec){.iov_base = packet, .iov_len = sizeof(packet)};
+    char ctrlmsg[CMSG_SPACE(sizeof(int))];
+
+    struct msghdr msg = {
+        .msg_name = NULL,
+        .msg_namelen = 0,
+        .msg_iov = &iovmsg,
+        .msg_iovlen = 1,
+        .msg_flags = 0,
+        .msg_control = ctrlmsg,
+        .msg_controllen = sizeof(ctrlmsg)
+    };
+
+    int res;
+    do {
+        res = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    }
+    while (res < 0 && errno == EINTR);
+    if (res <= 0) return false;
+
+    *attached_fd = -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) *attached_fd = ((int*)CMSG_DATA(cmsg))[0];
+
+    if (packet_mode) {
+        packet_length = res;
+        packet_offset = 0;
+        if ((msg.msg_flags & MSG_TRUNC) || !recv_all(fd, request_data, MIN_REQUEST_LENGTH)) {
+            if (*attached_fd >= 0) close(*attached_fd);
+            return false;
+        }
+    }
+    else if (res < MIN_REQUEST_LENGTH && !recv_all(fd, request_data + res, MIN_REQUEST_LENGTH - res)) {
+        if (*attached_fd >= 0) close(*attached_fd);
+        return false;
+    }
+
+    *request_code = request_data[0];
+    *arg = *(int*)(request_data + 1);
+    return true;
+}
+
+static bool send_fds(int fd, const void* data, int length, const int* fds, int fd_count) {
+    struct iovec iovmsg = {.iov_base = (void*)data, .iov_len = length};
+    char ctrlmsg[CMSG_SPACE(sizeof(int) * MAX_BATCH)];
+
+    struct msghdr msg = {
+        .msg_name = NULL,
+        .msg_namelen = 0,
+        .msg_iov = &iovmsg,
+        .msg_iovlen = 1,
+        .msg_flags = 0,
+        .msg_control = fd_count > 0 ? ctrlmsg : NULL,
+        .msg_controllen = fd_count > 0 ? CMSG_SPACE(sizeof(int) * fd_count) : 0
+    };
+
+    if (fd_count > 0) {
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+    }
+
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == length;
+}
+
+static bool reserve_slots(int end) {
+    if (end <= segment_capacity) return true;
+
+    int capacity = segment_capacity > 0 ? segment_capacity : 256;
+    while (capacity < end) capacity *= 2;
+
+    segment_t* new_segments = realloc(segments, capacity * sizeof(segment_t));
+    if (!new_segments) return false;
+
+    for (int i = segment_capacity; i < capacity; i++) new_segments[i].fd = -1;
+    segments = new_segments;
+    segment_capacity = capacity;
+    return true;
+}
+
+static int add_segment(int fd, uint64_t size, key_t key, int namespace) {
+    pthread_mutex_lock(&segment_mutex);
+
+    int shmid = next_id;
+    if (!reserve_slots(shmid + 1)) {
+        pthread_mutex_unlock(&segment_mutex);
+        return 0;
+    }
+
+    next_id++;
+    segments[shmid] = (segment_t){fd, size, key, namespace};
+
+    pthread_mutex_unlock(&segment_mutex);
+    return shmid;
+}
+
+static int create_segment(uint64_t size, key_t key, int namespace, int* fd) {
+    *fd = memfd_create("sysvshm", MFD_CLOEXEC);
+    if (*fd < 0) return 0;
+
+    int shmid = 0;
+    if (ftruncate(*fd, size) == 0) shmid = add_segment(*fd, size, key, namespace);
+
+    if (shmid == 0) {
+        close(*fd);
+        *fd = -1;
+    }
+    return shmid;
+}
+
+static void delete_segment(int shmid) {
+    pthread_mutex_lock(&segment_mutex);
+
+    if (shmid > 0 && shmid < segment_capacity && segments[shmid].fd >= 0) {
+        close(segments[shmid].fd);
+        segments[shmid].fd = -1;
+    }
+
+    pthread_mutex_unlock(&segment_mutex);
+}
+
+static void handle_shmget(int client_fd, int size) {
+    int fd;
+    int shmid = create_segment((unsigned int)size, IPC_PRIVATE, 0, &fd);
+    send(client_fd, &shmid, 4, MSG_NOSIGNAL);
+}
+
+static void handle_get_fd(int client_fd, int shmid) {
+    pthread_mutex_lock(&segment_mutex);
+    int fd = shmid > 0 && shmid < segment_capacity ? segments[shmid].fd : -1;
+    if (fd >= 0) fd = dup(fd);
+    pthread_mutex_unlock(&segment_mutex);
+
+    char zero = 0;
+    send_fds(client_fd, &zero, 1, &fd, fd >= 0 ? 1 : 0);
+    if (fd >= 0) close(fd);
+}
+
+static bool handle_shmget_fd(int client_fd, int count) {
+    if (count <= 0 || count > MAX_BATCH) return false;
+
+    uint64_t sizes[MAX_BATCH];
+    if (!recv_all(client_fd, sizes, count * 8)) return false;
+
+    int shmids[MAX_BATCH];
+    int fds[MAX_BATCH];
+    int fd_count = 0;
+    for (int i = 0; i < count; i++) {
+        int fd;
+        shmids[i] = create_segment(sizes[i], IPC_PRIVATE, 0, &fd);
+        if (shmids[i] != 0) fds[fd_count++] = fd;
+    }
+
+    return send_fds(client_fd, shmids, count * 4, fds, fd_count);
+}
+
+static bool handle_shmget_key(int client_fd, key_t key) {
+    char request_data[12];
+    if (!recv_all(client_fd, request_data, sizeof(request_data))) return false;
+
+    uint64_t size = *(uint64_t*)request_data;
+    int flags = *(int*)(request_data + 8);
+    int namespace = flags & NAMESPACE_MASK;
+
+    pthread_mutex_lock(&segment_mutex);
+
+    int shmid = 0;
+    for (int i = 1; i < next_id && i < segment_capacity; i++) {
+        if (segments[i].fd >= 0 && segments[i].key == key && segments[i].namespace == namespace) {
+            shmid = i;
+            break;
+        }
+    }
+
+    int result = shmid;
+    uint64_t segment_size = 0;
+    int fd = -1;
+    if (shmid > 0) {
+        if ((flags & IPC_CREAT) && (flags & IPC_EXCL)) {
+            result = -EEXIST;
+        }
+        else if (size > segments[shmid].size) {
+            result = -EINVAL;
+        }
+        else {
+            segment_size = segments[shmid].size;
+            fd = dup(segments[shmid].fd);
+        }
+    }
+    else if (!(flags & IPC_CREAT)) result = -ENOENT;
+
+    pthread_mutex_unlock(&segment_mutex);
+
+    if (result == 0) {
+        int segment_fd;
+        result = create_segment(size, key, namespace, &segment_fd);
+        if (result > 0) {
+            segment_size = size;
+            fd = dup(segment_fd);
+        }
+        else result = -ENOMEM;
+    }
+
+    char reply_data[12];
+    *(int*)reply_data = result;
+    *(uint64_t*)(reply_data + 4) = segment_size;
+
+    bool sent = send_fds(client_fd, reply_data, sizeof(reply_data), &fd, fd >= 0 ? 1 : 0);
+    if (fd >= 0) close(fd);
+    return sent;
+}
+
+static bool handle_delete_batch(int client_fd, int count) {
+    if (count <= 0 || count > MAX_BATCH) return false;
+
+    int shmids[MAX_BATCH];
+    if (!recv_all(client_fd, shmids, count * 4)) return false;
+
+    for (int i = 0; i < count; i++) delete_segment(shmids[i]);
+    return true;
+}
+
+static shm_object_t* find_shm_object(const char* name) {
+    for (int i = 0; i < shm_object_count; i++) {
+        if (strcmp(shm_objects[i].name, name) == 0) return &shm_objects[i];
+    }
+    return NULL;
+}
+
+static bool recv_shm_name(int client_fd, int name_length, int* flags, char* name) {
+    if (name_length <= 0 || name_length > NAME_MAX) return false;
+    if (!recv_all(client_fd, flags, 4) || !recv_all(client_fd, name, name_length)) return false;
+    name[name_length] = '\0';
+    return true;
+}
+
+static bool handle_shm_open(int client_fd, int name_length) {
+    int flags;
+    char name[NAME_MAX + 1];
+    if (!recv_shm_name(client_fd, name_length, &flags, name)) return false;
+
+    pthread_mutex_lock(&segment_mutex);
+
+    int result = 0;
+    int fd = -1;
+    shm_object_t* shm_object = find_shm_object(name);
+    if (shm_object) {
+        if ((flags & O_CREAT) && (flags & O_EXCL)) {
+            result = -EEXIST;
+        }
+        else {
+            if (flags & O_TRUNC) ftruncate(shm_object->fd, 0);
+            fd = shm_object->fd;
+        }
+    }
+    else if (!(flags & O_CREAT)) {
+        result = -ENOENT;
+    }
+    else {
+        shm_object_t* new_objects = realloc(shm_objects, (shm_object_count + 1) * sizeof(shm_object_t));
+        fd = new_objects ? memfd_create(name, MFD_CLOEXEC) : -1;
+        if (new_objects) shm_objects = new_objects;
+
+        if (fd >= 0) {
+            shm_object = &shm_objects[shm_object_count++];
+            strcpy(shm_object->name, name);
+            shm_object->fd = fd;
+        }
+        else result = -ENOMEM;
+    }
+
+    bool sent = send_fds(client_fd, &result, 4, &fd, result == 0 ? 1 : 0);
+    pthread_mutex_unlock(&segment_mutex);
+    return sent;
+}
+
+static bool handle_shm_unlink(int client_fd, int name_length) {
+    int flags;
+    char name[NAME_MAX + 1];
+    if (!recv_shm_name(client_fd, name_length, &flags, name)) return false;
+
+    pthread_mutex_lock(&segment_mutex);
+
+    int result = -ENOENT;
+    shm_object_t* shm_object = find_shm_object(name);
+    if (shm_object) {
+        close(shm_object->fd);
+        *shm_object = shm_objects[--shm_object_count];
+        result = 0;
+    }
+
+    pthread_mutex_unlock(&segment_mutex);
+    return send(client_fd, &result, 4, MSG_NOSIGNAL) == 4;
+}
+
+static void* client_thread(void* param) {
+    int client_fd = (intptr_t)param;
+
+    bool connected = true;
+    while (connected) {
+        char request_code;
+        int arg, attached_fd;
+        if (!recv_request(client_fd, &request_code, &arg, &attached_fd)) break;
+
+        if (attached_fd >= 0) close(attached_fd);
+        if (legacy_mode && request_code > REQUEST_CODE_DELETE) continue;
+
+        switch (request_code) {
+            case REQUEST_CODE_SHMGET:
+                handle_shmget(client_fd, arg);
+                break;
+            case REQUEST_CODE_GET_FD:
+                handle_get_fd(client_fd, arg);
+                break;
+            case REQUEST_CODE_DELETE:
+                delete_segment(arg);
+                break;
+            case REQUEST_CODE_SHMGET_FD:
+                connected = handle_shmget_fd(client_fd, arg);
+                break;
+            case REQUEST_CODE_SHMGET_KEY:
+                connected = handle_shmget_key(client_fd, arg);
+                break;
+            case REQUEST_CODE_DELETE_BATCH:
+                connected = handle_delete_batch(client_fd, arg);
+                break;
+            case REQUEST_CODE_SHM_OPEN:
+                connected = handle_shm_open(client_fd, arg);
+                break;
+            case REQUEST_CODE_SHM_UNLINK:
+                connected = handle_shm_unlink(client_fd, arg);
+                break;
+            case REQUEST_CODE_VERSION: {
+                int version = PROTOCOL_VERSION;
+                connected = send(client_fd, &version, 4, MSG_NOSIGNAL) == 4;
+                break;
+            }
+            default:
+                fprintf(stderr, "sysvshm_server: unknown request code %d\n", request_code);
+                connected = false;
+                break;
+        }
+    }
+
+    close(client_fd);
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "sl")) != -1) {
+        if (opt == 's') {
+            packet_mode = false;
+        }
+        else if (opt == 'l') {
+            legacy_mode = true;
+        }
+        else {
+            optind = argc;
+            break;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-s] [-l] <socket path>\n", argv[0]);
+        return 1;
+    }
+    const char* path = argv[optind];
+
+    signal(SIGPIPE, SIG_IGN);
+
+    int server_fd = socket(AF_UNIX, (packet_mode ? SOCK_SEQPACKET : SOCK_STREAM) | SOCK_CLOEXEC, 0);
+    if (server_fd < 0) {
+        perror("socket");
+        return 1;
+    }
+
+    struct sockaddr_un server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sun_family = AF_LOCAL;
+    strncpy(server_addr.sun_path, path, sizeof(server_addr.sun_path) - 1);
+
+    unlink(path);
+    if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(struct sockaddr_un)) < 0 || listen(server_fd, 64) < 0) {
+        perror("bind");
+        return 1;
+    }
+
+    while (true) {
+        int client_fd = accept4(server_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, client_thread, (void*)(intptr_t)client_fd) != 0) {
+            close(client_fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(server_fd);
+    return 0;
+}
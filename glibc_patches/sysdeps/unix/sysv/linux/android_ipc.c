@@ -0,0 +1,357 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "android_ipc.h"
+
+typedef union {
+    struct cmsghdr align;
+    char data[CMSG_SPACE(sizeof(int) * ANDROID_IPC_MAX_FDS)];
+} android_ipc_control_t;
+
+typedef struct {
+    char header[ANDROID_IPC_HEADER_LENGTH];
+    struct iovec iov[2];
+    android_ipc_control_t control;
+} android_ipc_frame_t;
+
+/* Connections that several threads of a process share are kept in a pool keyed by server path. Each one has a mutex that the
+   caller holds around a request and its reply, and is opened lazily and reopened after a failure, which bumps its generation so
+   that callers can drop state the server tied to the previous connection. A forked child closes the inherited descriptors instead
+   of sharing the parent's socket. Pooled connections live as long as the process. */
+
+static android_ipc_connection_t* android_ipc_pool = NULL;
+static pthread_mutex_t android_ipc_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t android_ipc_atfork_once = PTHREAD_ONCE_INIT;
+
+int android_ipc_connect(const char* path, int* type) {
+    struct sockaddr_un server_addr;
+    if (!path || strlen(path) >= sizeof(server_addr.sun_path)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sun_family = AF_LOCAL;
+    strncpy(server_addr.sun_path, path, sizeof(server_addr.sun_path) - 1);
+
+    static const int types[] = {SOCK_SEQPACKET, SOCK_STREAM};
+    for (int i = *type == SOCK_STREAM ? 1 : 0; i < 2; i++) {
+        int fd = socket(AF_UNIX, types[i] | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+
+        int res;
+        do {
+            res = connect(fd, (struct sockaddr*)&server_addr, sizeof(struct sockaddr_un));
+        }
+        while (res < 0 && errno == EINTR);
+
+        if (res == 0) {
+            *type = types[i];
+            return fd;
+        }
+
+        int error = errno;
+        close(fd);
+        errno = error;
+        if (error != EPROTOTYPE) break;
+    }
+    return -1;
+}
+
+static int android_ipc_frame(android_ipc_frame_t* frame, struct msghdr* msg, const android_ipc_message_t* message) {
+    frame->header[0] = message->code;
+    memcpy(frame->header + 1, &message->arg, 4);
+    frame->iov[0] = (struct iovec){.iov_base = frame->header, .iov_len = ANDROID_IPC_HEADER_LENGTH};
+    frame->iov[1] = (struct iovec){.iov_base = (void*)message->payload, .iov_len = message->length};
+
+    memset(msg, 0, sizeof(struct msghdr));
+    msg->msg_iov = frame->iov;
+    msg->msg_iovlen = message->length > 0 ? 2 : 1;
+
+    if (message->fd_count > 0) {
+        msg->msg_control = &frame->control;
+        msg->msg_controllen = CMSG_SPACE(sizeof(int) * message->fd_count);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * message->fd_count);
+        memcpy(CMSG_DATA(cmsg), message->fds, sizeof(int) * message->fd_count);
+    }
+    return ANDROID_IPC_HEADER_LENGTH + message->length;
+}
+
+/* Only a stream socket can take part of a message. The rest is sent without the fds, which went with the first part. */
+static bool android_ipc_send_rest(int fd, struct msghdr* msg, size_t sent, size_t length) {
+    while (sent < length) {
+        msg->msg_control = NULL;
+        msg->msg_controllen = 0;
+
+        size_t skip = sent;
+        while (msg->msg_iovlen > 0 && skip >= msg->msg_iov->iov_len) {
+            skip -= msg->msg_iov->iov_len;
+            msg->msg_iov++;
+            msg->msg_iovlen--;
+        }
+        msg->msg_iov->iov_base = (char*)msg->msg_iov->iov_base + skip;
+        msg->msg_iov->iov_len -= skip;
+        length -= sent;
+
+        ssize_t res = sendmsg(fd, msg, MSG_NOSIGNAL);
+        if (res < 0 && errno == EINTR) {
+            sent = 0;
+            continue;
+        }
+        if (res <= 0) return false;
+        sent = res;
+    }
+    return true;
+}
+
+bool android_ipc_send(int fd, char code, int arg, const void* payload, int length, const int* fds, int fd_count) {
+    if (length < 0 || fd_count < 0 || fd_count > ANDROID_IPC_MAX_FDS) {
+        errno = EINVAL;
+        return false;
+    }
+
+    android_ipc_message_t message = {code, arg, payload, length, fds, fd_count};
+    android_ipc_frame_t frame;
+    struct msghdr msg;
+    size_t total = android_ipc_frame(&frame, &msg, &message);
+
+    ssize_t res;
+    do {
+        res = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    }
+    while (res < 0 && errno == EINTR);
+
+    return res >= 0 && android_ipc_send_rest(fd, &msg, res, total);
+}
+
+/* A batch goes out with one sendmmsg(), every message still being its own packet on a SOCK_SEQPACKET connection and carrying
+   its own fds. A stream socket that took only part of a message other than the last one cannot be recovered from, since the
+   next message has already followed it, so that fails and the caller drops the connection. */
+bool android_ipc_send_batch(int fd, const android_ipc_message_t* messages, int count) {
+    if (count == 1) {
+        return android_ipc_send(fd, messages->code, messages->arg, messages->payload, messages->length, messages->fds,
+                                messages->fd_count);
+    }
+
+    if (count <= 0 || count > ANDROID_IPC_MAX_BATCH) {
+        errno = EINVAL;
+        return false;
+    }
+
+    android_ipc_frame_t frames[ANDROID_IPC_MAX_BATCH];
+    struct mmsghdr msgs[ANDROID_IPC_MAX_BATCH];
+    size_t lengths[ANDROID_IPC_MAX_BATCH];
+    for (int i = 0; i < count; i++) {
+        if (messages[i].length < 0 || messages[i].fd_count < 0 || messages[i].fd_count > ANDROID_IPC_MAX_FDS) {
+            errno = EINVAL;
+            return false;
+        }
+        lengths[i] = android_ipc_frame(&frames[i], &msgs[i].msg_hdr, &messages[i]);
+        msgs[i].msg_len = 0;
+    }
+
+    int done = 0;
+    while (done < count) {
+        int res = sendmmsg(fd, msgs + done, count - done, MSG_NOSIGNAL);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) return false;
+
+        for (int i = done; i < done + res - 1; i++) {
+            if (msgs[i].msg_len != lengths[i]) {
+                errno = EPIPE;
+                return false;
+            }
+        }
+
+        done += res;
+        if (!android_ipc_send_rest(fd, &msgs[done - 1].msg_hdr, msgs[done - 1].msg_len, lengths[done - 1])) return false;
+    }
+    return true;
+}
+
+/* Receives a reply of exactly length bytes. The fds that come with it are stored in fds, the ones beyond max_fds are closed, and
+   their count is returned. A reply that does not fit, or whose fds were cut off, fails with EPROTO. */
+int android_ipc_recv(int fd, void* data, int length, int* fds, int max_fds) {
+    int fd_count = 0;
+    int received = 0;
+    int error = 0;
+
+    while (received < length && !error) {
+        android_ipc_control_t control;
+        struct iovec iov = {.iov_base = (char*)data + received, .iov_len = length - received};
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = &control,
+            .msg_controllen = sizeof(control)
+        };
+
+        ssize_t res = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (res < 0 && errno == EINTR) continue;
+
+        if (res > 0) {
+            for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+
+                int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                for (int i = 0; i < count; i++) {
+                    int received_fd;
+                    memcpy(&received_fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                    if (fd_count < max_fds) {
+                        fds[fd_count++] = received_fd;
+                    }
+                    else close(received_fd);
+                }
+            }
+            received += res;
+        }
+
+        if (res < 0) {
+            error = errno;
+        }
+        else if (res == 0) {
+            error = ECONNRESET;
+        }
+        else if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) error = EPROTO;
+    }
+
+    if (error) {
+        for (int i = 0; i < fd_count; i++) close(fds[i]);
+        errno = error;
+        return -1;
+    }
+    return fd_count;
+}
+
+/* Waits up to timeout_ms for a reply to arrive, for requests that a server predating them would leave unanswered. Fails with
+   ETIMEDOUT when nothing came. */
+bool android_ipc_wait(int fd, int timeout_ms) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+
+    while (true) {
+        int res = poll(&pfd, 1, timeout_ms);
+        if (res > 0) return true;
+        if (res == 0) {
+            errno = ETIMEDOUT;
+            return false;
+        }
+        if (errno != EINTR) return false;
+    }
+}
+
+static void android_ipc_atfork_prepare(void) {
+    pthread_mutex_lock(&android_ipc_pool_mutex);
+    for (android_ipc_connection_t* connection = android_ipc_pool; connection; connection = connection->next) {
+        pthread_mutex_lock(&connection->mutex);
+    }
+}
+
+static void android_ipc_atfork_parent(void) {
+    for (android_ipc_connection_t* connection = android_ipc_pool; connection; connection = connection->next) {
+        pthread_mutex_unlock(&connection->mutex);
+    }
+    pthread_mutex_unlock(&android_ipc_pool_mutex);
+}
+
+static void android_ipc_atfork_child(void) {
+    for (android_ipc_connection_t* connection = android_ipc_pool; connection; connection = connection->next) {
+        if (connection->fd >= 0) {
+            close(connection->fd);
+            connection->fd = -1;
+            connection->generation++;
+        }
+        pthread_mutex_init(&connection->mutex, NULL);
+    }
+    pthread_mutex_init(&android_ipc_pool_mutex, NULL);
+}
+
+static void android_ipc_register_atfork(void) {
+    pthread_atfork(android_ipc_atfork_prepare, android_ipc_atfork_parent, android_ipc_atfork_child);
+}
+
+android_ipc_connection_t* android_ipc_pool_get(const char* path) {
+    if (!path) path = "";
+    pthread_once(&android_ipc_atfork_once, android_ipc_register_atfork);
+    pthread_mutex_lock(&android_ipc_pool_mutex);
+
+    android_ipc_connection_t* connection;
+    for (connection = android_ipc_pool; connection; connection = connection->next) {
+        if (strncmp(connection->path, path, sizeof(connection->path)) == 0) break;
+    }
+
+    if (!connection) {
+        connection = calloc(1, sizeof(android_ipc_connection_t));
+        if (connection) {
+            strncpy(connection->path, path, sizeof(connection->path) - 1);
+            connection->fd = -1;
+            pthread_mutex_init(&connection->mutex, NULL);
+            connection->next = android_ipc_pool;
+            android_ipc_pool = connection;
+        }
+    }
+
+    pthread_mutex_unlock(&android_ipc_pool_mutex);
+    return connection;
+}
+
+void android_ipc_lock(android_ipc_connection_t* connection) {
+    pthread_mutex_lock(&connection->mutex);
+}
+
+void android_ipc_unlock(android_ipc_connection_t* connection) {
+    pthread_mutex_unlock(&connection->mutex);
+}
+
+bool android_ipc_open(android_ipc_connection_t* connection) {
+    if (connection->fd >= 0) return true;
+    if (!connection->path[0]) {
+        errno = ENOENT;
+        return false;
+    }
+
+    int fd = android_ipc_connect(connection->path, &connection->type);
+    if (fd < 0) return false;
+
+    connection->fd = fd;
+    connection->generation++;
+    return true;
+}
+
+void android_ipc_close(android_ipc_connection_t* connection) {
+    if (connection->fd >= 0) {
+        close(connection->fd);
+        connection->fd = -1;
+    }
+}
+
+/* Sends the messages, reconnecting once if the connection turns out to be broken. */
+bool android_ipc_request(android_ipc_connection_t* connection, const android_ipc_message_t* messages, int count) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (!android_ipc_open(connection)) return false;
+        if (android_ipc_send_batch(connection->fd, messages, count)) return true;
+        android_ipc_close(connection);
+    }
+    return false;
+}
+
+int android_ipc_reply(android_ipc_connection_t* connection, void* data, int length, int* fds, int max_fds) {
+    if (connection->fd < 0) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    int fd_count = android_ipc_recv(connection->fd, data, length, fds, max_fds);
+    if (fd_count < 0) android_ipc_close(connection);
+    return fd_count;
+}
@@ -0,0 +1,50 @@
+#ifndef __ANDROID_IPC
+#define __ANDROID_IPC
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/* Transport shared by the clients of the app's Unix socket servers (sysvshm, ALSA). A message is a 1-byte code and a 4-byte
+   argument, followed by an optional payload and optional fds, and is always written with a single sendmsg(). Connections are
+   SOCK_SEQPACKET when the server accepts it, so that every message and every reply is one packet, and SOCK_STREAM otherwise, in
+   which case short reads and writes are completed here. Functions return false or -1 with errno set on failure. */
+
+#define ANDROID_IPC_HEADER_LENGTH 5
+#define ANDROID_IPC_MAX_FDS 64
+#define ANDROID_IPC_MAX_BATCH 16
+
+typedef struct {
+    char code;
+    int arg;
+    const void* payload;
+    int length;
+    const int* fds;
+    int fd_count;
+} android_ipc_message_t;
+
+typedef struct android_ipc_connection {
+    char path[108];
+    int fd;
+    int type;
+    unsigned int generation;
+    pthread_mutex_t mutex;
+    struct android_ipc_connection* next;
+} android_ipc_connection_t;
+
+extern int android_ipc_connect(const char* path, int* type);
+extern bool android_ipc_send(int fd, char code, int arg, const void* payload, int length, const int* fds, int fd_count);
+extern bool android_ipc_send_batch(int fd, const android_ipc_message_t* messages, int count);
+extern int android_ipc_recv(int fd, void* data, int length, int* fds, int max_fds);
+extern bool android_ipc_wait(int fd, int timeout_ms);
+
+extern android_ipc_connection_t* android_ipc_pool_get(const char* path);
+extern void android_ipc_lock(android_ipc_connection_t* connection);
+extern void android_ipc_unlock(android_ipc_connection_t* connection);
+extern bool android_ipc_open(android_ipc_connection_t* connection);
+extern void android_ipc_close(android_ipc_connection_t* connection);
+extern bool android_ipc_request(android_ipc_connection_t* connection, const android_ipc_message_t* messages, int count);
+extern int android_ipc_reply(android_ipc_connection_t* connection, void* data, int length, int* fds, int max_fds);
+
+#endif
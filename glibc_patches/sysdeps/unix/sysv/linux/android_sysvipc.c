@@ -0,0 +1,226 @@
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "android_sysvipc.h"
+
+#define OBJECT_BUCKETS 64
+#define INIT_TIMEOUT_MS 1000
+
+#define ROUND_UP(N, S) ((((N) + (S) - 1) / (S)) * (S))
+
+/* Every object starts with a sysvipc_header_t. Its lock word is a three-state futex mutex (0 free, 1 locked, 2 contended) and
+   every change that may unblock someone bumps seq, which blocked callers wait on with FUTEX_WAIT, so an uncontended semop() or
+   msgsnd() costs two atomic operations and no system call. The futexes are not private because the memory is shared between
+   processes. A process that dies while holding the lock leaves the object locked, the lock is only held for a few loads and
+   stores so this needs a kill in that exact window.
+
+   Processes map an object the first time they use its id and keep the mapping in a small table. A removed object stays mapped
+   so that threads still blocked on it wake up with EIDRM instead of faulting. */
+
+typedef struct sysvipc_object {
+    int id;
+    void* addr;
+    size_t size;
+    struct sysvipc_object* next;
+} sysvipc_object_t;
+
+static sysvipc_object_t* sysvipc_objects[OBJECT_BUCKETS];
+static pthread_rwlock_t sysvipc_objects_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static int futex(uint32_t* addr, int op, uint32_t value, const struct timespec* timeout, uint32_t bitset) {
+    return syscall(SYS_futex, addr, op, value, timeout, NULL, bitset);
+}
+
+void sysvipc_lock(sysvipc_header_t* header) {
+    uint32_t state = 0;
+    if (__atomic_compare_exchange_n(&header->lock, &state, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+
+    if (state != 2) state = __atomic_exchange_n(&header->lock, 2, __ATOMIC_ACQUIRE);
+    while (state != 0) {
+        futex(&header->lock, FUTEX_WAIT, 2, NULL, 0);
+        state = __atomic_exchange_n(&header->lock, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+void sysvipc_unlock(sysvipc_header_t* header) {
+    if (__atomic_exchange_n(&header->lock, 0, __ATOMIC_RELEASE) == 2) futex(&header->lock, FUTEX_WAKE, 1, NULL, 0);
+}
+
+void sysvipc_notify(sysvipc_header_t* header) {
+    __atomic_add_fetch(&header->seq, 1, __ATOMIC_RELEASE);
+    if (header->waiters > 0) futex(&header->seq, FUTEX_WAKE, INT_MAX, NULL, 0);
+}
+
+void sysvipc_deadline(const struct timespec* timeout, struct timespec* deadline) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout->tv_sec;
+    deadline->tv_nsec += timeout->tv_nsec;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/* Called with the object locked, returns with it locked again. The deadline is absolute on CLOCK_MONOTONIC. */
+int sysvipc_wait(sysvipc_header_t* header, const struct timespec* deadline) {
+    uint32_t seq = header->seq;
+    header->waiters++;
+    sysvipc_unlock(header);
+
+    int res = futex(&header->seq, FUTEX_WAIT_BITSET, seq, deadline, FUTEX_BITSET_MATCH_ANY);
+    int error = res < 0 ? errno : 0;
+
+    sysvipc_lock(header);
+    header->waiters--;
+
+    if (header->removed) return EIDRM;
+    if (error == ETIMEDOUT) return EAGAIN;
+    if (error == EINTR) return EINTR;
+    return 0;
+}
+
+static bool sysvipc_wait_initialized(sysvipc_header_t* header, uint32_t magic) {
+    struct timespec timeout = {0, 10 * 1000000L};
+    for (int elapsed = 0; elapsed < INIT_TIMEOUT_MS; elapsed += 10) {
+        uint32_t current = __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE);
+        if (current != 0 && current != SYSVIPC_INITIALIZING) return current == magic;
+        futex(&header->magic, FUTEX_WAIT, current, &timeout, 0);
+    }
+    return false;
+}
+
+static void* sysvipc_insert(int id, void* addr, size_t size) {
+    sysvipc_object_t* object = malloc(sizeof(sysvipc_object_t));
+    if (!object) {
+        munmap(addr, size);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    pthread_rwlock_wrlock(&sysvipc_objects_lock);
+
+    sysvipc_object_t** bucket = &sysvipc_objects[(unsigned int)id % OBJECT_BUCKETS];
+    for (sysvipc_object_t* existing = *bucket; existing; existing = existing->next) {
+        if (existing->id == id) {
+            pthread_rwlock_unlock(&sysvipc_objects_lock);
+            munmap(addr, size);
+            free(object);
+            return existing->addr;
+        }
+    }
+
+    object->id = id;
+    object->addr = addr;
+    object->size = size;
+    object->next = *bucket;
+    *bucket = object;
+
+    pthread_rwlock_unlock(&sysvipc_objects_lock);
+    return addr;
+}
+
+static void* sysvipc_find(int id) {
+    void* addr = NULL;
+    pthread_rwlock_rdlock(&sysvipc_objects_lock);
+
+    for (sysvipc_object_t* object = sysvipc_objects[(unsigned int)id % OBJECT_BUCKETS]; object; object = object->next) {
+        if (object->id == id) {
+            addr = object->addr;
+            break;
+        }
+    }
+
+    pthread_rwlock_unlock(&sysvipc_objects_lock);
+    return addr;
+}
+
+int sysvipc_get(key_t key, int flags, uint32_t magic, size_t size, void (*init)(void* object, void* param), void* param) {
+    size = ROUND_UP(size, getpagesize());
+
+    int id, fd;
+    size_t segment_size = size;
+    bool creator;
+    if (key == IPC_PRIVATE) {
+        id = sysvshm_shmget_fd_request(size, &fd);
+        if (id == 0) {
+            errno = ENOSPC;
+            return -1;
+        }
+        creator = true;
+    }
+    else {
+        int namespace = magic == SYSVIPC_SEM_MAGIC ? SYSVSHM_NAMESPACE_SEM : SYSVSHM_NAMESPACE_MSG;
+        id = sysvshm_shmget_key_request(key, size, flags | namespace, &fd, &segment_size);
+        if (id <= 0) {
+            errno = id < 0 ? -id : EIO;
+            return -1;
+        }
+        creator = (flags & IPC_CREAT) != 0;
+    }
+
+    void* addr = mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        if (key == IPC_PRIVATE) sysvshm_delete_request(id);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* Of the processes racing to create a keyed object, the first to claim the magic word initializes it, the others wait. */
+    sysvipc_header_t* header = addr;
+    uint32_t expected = 0;
+    if (creator && __atomic_compare_exchange_n(&header->magic, &expected, SYSVIPC_INITIALIZING, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        header->key = key;
+        header->ctime = time(NULL);
+        init(addr, param);
+        __atomic_store_n(&header->magic, magic, __ATOMIC_RELEASE);
+        futex(&header->magic, FUTEX_WAKE, INT_MAX, NULL, 0);
+    }
+    else if (!sysvipc_wait_initialized(header, magic)) {
+        munmap(addr, segment_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    return sysvipc_insert(id, addr, segment_size) ? id : -1;
+}
+
+void* sysvipc_lookup(int id, uint32_t magic) {
+    void* addr = id > 0 ? sysvipc_find(id) : NULL;
+    if (!addr && id > 0) {
+        int fd = sysvshm_get_fd_request(id);
+        struct stat stat;
+        if (fd >= 0 && fstat(fd, &stat) == 0 && stat.st_size >= sizeof(sysvipc_header_t)) {
+            addr = mmap(NULL, stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED) {
+                addr = NULL;
+            }
+            else if (!sysvipc_wait_initialized(addr, magic)) {
+                munmap(addr, stat.st_size);
+                addr = NULL;
+            }
+            else addr = sysvipc_insert(id, addr, stat.st_size);
+        }
+        if (fd >= 0) close(fd);
+    }
+
+    if (!addr || __atomic_load_n(&((sysvipc_header_t*)addr)->magic, __ATOMIC_ACQUIRE) != magic) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (__atomic_load_n(&((sysvipc_header_t*)addr)->removed, __ATOMIC_ACQUIRE)) {
+        errno = EIDRM;
+        return NULL;
+    }
+    return addr;
+}
+
+void sysvipc_remove(int id, sysvipc_header_t* header) {
+    sysvipc_lock(header);
+    header->removed = 1;
+    sysvipc_notify(header);
+    sysvipc_unlock(header);
+
+    sysvshm_delete_request(id);
+}
@@ -0,0 +1,73 @@
+#ifndef __ANDROID_SYSVIPC
+#define __ANDROID_SYSVIPC
+
+#include <time.h>
+#include <android_sysvshm.h>
+
+/* SysV semaphore sets and message queues live in segments allocated through the sysvshm server, so every process maps the
+   same memory and synchronizes with futexes on it. The id of an object is the shmid of its segment. */
+
+#define SYSVIPC_SEM_MAGIC 0x53454d31
+#define SYSVIPC_MSG_MAGIC 0x4d534731
+#define SYSVIPC_INITIALIZING 1
+
+#define SYSVIPC_SEMMSL 32000
+#define SYSVIPC_SEMVMX 32767
+#define SYSVIPC_SEMOPM 500
+#define SYSVIPC_MSGMAX 8192
+#define SYSVIPC_MSGMNB 16384
+#define SYSVIPC_MSG_RING_SIZE 65536
+
+typedef struct {
+    uint32_t magic;
+    uint32_t lock;
+    uint32_t seq;
+    uint32_t waiters;
+    uint32_t removed;
+    key_t key;
+    int64_t otime;
+    int64_t rtime;
+    int64_t ctime;
+} sysvipc_header_t;
+
+typedef struct {
+    uint32_t value;
+    int32_t pid;
+    uint32_t ncnt;
+    uint32_t zcnt;
+} sysvipc_sem_t;
+
+typedef struct {
+    sysvipc_header_t header;
+    int nsems;
+    sysvipc_sem_t sems[];
+} sysvipc_sem_set_t;
+
+typedef struct {
+    uint32_t size;
+    uint32_t length;
+    int64_t mtype;
+} sysvipc_msg_t;
+
+typedef struct {
+    sysvipc_header_t header;
+    uint32_t qbytes;
+    uint32_t cbytes;
+    uint32_t qnum;
+    uint32_t head;
+    uint32_t tail;
+    int32_t lspid;
+    int32_t lrpid;
+    char ring[SYSVIPC_MSG_RING_SIZE] __attribute__((aligned(16)));
+} sysvipc_msg_queue_t;
+
+extern int sysvipc_get(key_t key, int flags, uint32_t magic, size_t size, void (*init)(void* object, void* param), void* param);
+extern void* sysvipc_lookup(int id, uint32_t magic);
+extern void sysvipc_remove(int id, sysvipc_header_t* header);
+extern void sysvipc_lock(sysvipc_header_t* header);
+extern void sysvipc_unlock(sysvipc_header_t* header);
+extern int sysvipc_wait(sysvipc_header_t* header, const struct timespec* deadline);
+extern void sysvipc_notify(sysvipc_header_t* header);
+extern void sysvipc_deadline(const struct timespec* timeout, struct timespec* deadline);
+
+#endif
@@ -1,127 +1,699 @@
 #include "android_sysvshm.h"
+#include "android_ipc.h"
 
 #define REQUEST_CODE_SHMGET 0
 #define REQUEST_CODE_GET_FD 1
 #define REQUEST_CODE_DELETE 2
+#define REQUEST_CODE_SHMGET_FD 3
+#define REQUEST_CODE_SHMGET_KEY 6
+#define REQUEST_CODE_DELETE_BATCH 7
+#define REQUEST_CODE_SHM_OPEN 8
+#define REQUEST_CODE_SHM_UNLINK 9
+#define REQUEST_CODE_VERSION 10
+
+#define PROTOCOL_VERSION 1
+#define VERSION_TIMEOUT_MS 250
 
 /* based on https://github.com/pelya/android-shmem */
 
-#define MIN_REQUEST_LENGTH 5
+#define TABLE_MIN_CAPACITY 64
+#define LARGE_SEGMENT_SIZE (2 << 20)
+#define DELETE_QUEUE_MAX_BYTES (16 << 20)
+#define TRACE_BUCKETS 40
+#define TRACE_MAX_LEAKS 32
+
+#define MAP_POLICY_POPULATE 1
+#define MAP_POLICY_HUGEPAGE 2
+
+#ifndef MADV_POPULATE_READ
+# define MADV_POPULATE_READ 22
+# define MADV_POPULATE_WRITE 23
+#endif
+
+typedef struct {
+    void** slots;
+    unsigned int capacity;
+    unsigned int count;
+    uintptr_t (*key_of)(const void* entry);
+} shmemory_table_t;
+
+/* Locking: sysvshm_lock protects the segment and attachment tables and the per-segment bookkeeping, the lock of the pooled server
+   connection (sysvshm_io_lock()) protects the connection and the state tied to it. Server I/O is never done while sysvshm_lock is
+   held, so a thread waiting on the server never blocks other threads' shmat()/shmdt()/shmctl(). Segments are reference counted:
+   the registry holds one reference, and a thread that works on a segment outside sysvshm_lock holds another, so its fd stays open
+   until the last reference is dropped. */
+
+/* Segments are kept in an open-addressing table keyed by shmid and their attachments in another one keyed by attach address
+   (linear probing, backward-shift removal), so lookups, inserts and removals stay O(1) no matter how many segments a process
+   holds. Every shmat() creates its own attachment, linked from the segment, and nattch counts them. */
+
+static uintptr_t shmemory_id_key(const void* entry) {
+    return (unsigned int)((const shmemory_t*)entry)->id;
+}
+
+static uintptr_t shmattach_addr_key(const void* entry) {
+    return (uintptr_t)((const shmattach_t*)entry)->addr;
+}
+
+static shmemory_table_t shmemory_id_table = {.key_of = shmemory_id_key};
+static shmemory_table_t shmattach_addr_table = {.key_of = shmattach_addr_key};
 
-shmemory_t* shmemories = NULL;
 int shmemory_count = 0;
-int sysvshm_server_fd = -1;
-pthread_mutex_t sysvshm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t shmemory_bytes = 0;
+static int shmemory_peak_count = 0;
+static size_t shmemory_peak_bytes = 0;
+pthread_rwlock_t sysvshm_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_once_t sysvshm_map_policy_once = PTHREAD_ONCE_INIT;
+static int sysvshm_map_policy = MAP_POLICY_HUGEPAGE;
+
+static unsigned int table_hash(const shmemory_table_t* table, uintptr_t key) {
+    uint64_t hash = (uint64_t)key * 0x9E3779B97F4A7C15ULL;
+    return (unsigned int)(hash >> 32) & (table->capacity - 1);
+}
+
+static void* table_find(const shmemory_table_t* table, uintptr_t key) {
+    if (table->count == 0) return NULL;
+
+    for (unsigned int i = table_hash(table, key);; i = (i + 1) & (table->capacity - 1)) {
+        void* entry = table->slots[i];
+        if (!entry) return NULL;
+        if (table->key_of(entry) == key) return entry;
+    }
+}
+
+static void table_place(shmemory_table_t* table, void* entry) {
+    unsigned int i = table_hash(table, table->key_of(entry));
+    while (table->slots[i]) i = (i + 1) & (table->capacity - 1);
+    table->slots[i] = entry;
+}
+
+static bool table_insert(shmemory_table_t* table, void* entry) {
+    if ((table->count + 1) * 2 > table->capacity) {
+        unsigned int old_capacity = table->capacity;
+        void** old_slots = table->slots;
+        unsigned int capacity = old_capacity ? old_capacity * 2 : TABLE_MIN_CAPACITY;
+
+        void** slots = calloc(capacity, sizeof(void*));
+        if (!slots) return false;
+
+        table->slots = slots;
+        table->capacity = capacity;
+        for (unsigned int i = 0; i < old_capacity; i++) if (old_slots[i]) table_place(table, old_slots[i]);
+        free(old_slots);
+    }
+
+    table_place(table, entry);
+    table->count++;
+    return true;
+}
+
+static void table_remove(shmemory_table_t* table, void* entry) {
+    if (table->count == 0) return;
+
+    unsigned int mask = table->capacity - 1;
+    unsigned int i = table_hash(table, table->key_of(entry));
+    while (table->slots[i] != entry) {
+        if (!table->slots[i]) return;
+        i = (i + 1) & mask;
+    }
+
+    table->slots[i] = NULL;
+    table->count--;
+
+    for (unsigned int j = (i + 1) & mask; table->slots[j]; j = (j + 1) & mask) {
+        unsigned int home = table_hash(table, table->key_of(table->slots[j]));
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            table->slots[i] = table->slots[j];
+            table->slots[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+shmemory_t* find_shmemory(int shmid) {
+    return table_find(&shmemory_id_table, (unsigned int)shmid);
+}
+
+shmattach_t* find_shmattach(void const* addr) {
+    return addr ? table_find(&shmattach_addr_table, (uintptr_t)addr) : NULL;
+}
+
+shmemory_t* sysvshm_insert(int shmid, int fd, size_t size) {
+    shmemory_t* shmemory = malloc(sizeof(shmemory_t));
+    if (!shmemory) return NULL;
+
+    shmemory->id = shmid;
+    shmemory->fd = fd;
+    shmemory->nattch = 0;
+    shmemory->attachments = NULL;
+    shmemory->size = size;
+    shmemory->key = IPC_PRIVATE;
+    shmemory->refs = 1;
+    shmemory->marked_for_delete = 0;
+    shmemory->removed = 0;
+    shmemory->populated = 0;
+
+    if (!table_insert(&shmemory_id_table, shmemory)) {
+        free(shmemory);
+        return NULL;
+    }
+
+    shmemory_count++;
+    shmemory_bytes += size;
+    if (shmemory_count > shmemory_peak_count) shmemory_peak_count = shmemory_count;
+    if (shmemory_bytes > shmemory_peak_bytes) shmemory_peak_bytes = shmemory_bytes;
+    return shmemory;
+}
+
+shmattach_t* sysvshm_attach(shmemory_t* shmemory, void* addr) {
+    shmattach_t* shmattach = malloc(sizeof(shmattach_t));
+    if (!shmattach) return NULL;
 
-int find_shmemory_index(int shmid) {
-    for (int i = 0; i < shmemory_count; i++) if (shmemories[i].id == shmid) return i;
-    return -1;
+    shmattach->addr = addr;
+    shmattach->shmemory = shmemory;
+
+    if (!table_insert(&shmattach_addr_table, shmattach)) {
+        free(shmattach);
+        return NULL;
+    }
+
+    shmattach->next = shmemory->attachments;
+    shmemory->attachments = shmattach;
+    shmemory->nattch++;
+    return shmattach;
+}
+
+void sysvshm_detach(shmattach_t* shmattach) {
+    shmemory_t* shmemory = shmattach->shmemory;
+    shmattach_t** link = &shmemory->attachments;
+    while (*link != shmattach) link = &(*link)->next;
+    *link = shmattach->next;
+    shmemory->nattch--;
+
+    table_remove(&shmattach_addr_table, shmattach);
+    free(shmattach);
+}
+
+void sysvshm_ref(shmemory_t* shmemory) {
+    __atomic_add_fetch(&shmemory->refs, 1, __ATOMIC_RELAXED);
+}
+
+void sysvshm_unref(shmemory_t* shmemory) {
+    if (__atomic_sub_fetch(&shmemory->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (shmemory->fd >= 0) close(shmemory->fd);
+        free(shmemory);
+    }
 }
 
-void sysvshm_connect(void) {
-    if (sysvshm_server_fd >= 0) return;
-    char* path = getenv("ANDROID_SYSVSHM_SERVER");
+bool sysvshm_remove(shmemory_t* shmemory) {
+    if (shmemory->removed || shmemory->nattch > 0 || !shmemory->marked_for_delete) return false;
+
+    table_remove(&shmemory_id_table, shmemory);
+    shmemory->removed = 1;
+    shmemory_count--;
+    shmemory_bytes -= shmemory->size;
+    return true;
+}
+
+/* Setting ANDROID_SYSVSHM_TRACE enables tracing: "1" reports to stderr, any other value is a file the report is appended to.
+   shmget(), shmat(), shmdt(), shmctl() and every exchange with the server (the time the connection is held to talk to it) are
+   timed into power-of-two latency histograms. At exit the report lists them, the peak and remaining segment count and bytes, and
+   the segments that were never removed. */
+
+int sysvshm_trace_fd = -1;
+static uint64_t sysvshm_trace_histograms[SYSVSHM_OP_COUNT][TRACE_BUCKETS];
+static uint64_t sysvshm_trace_totals[SYSVSHM_OP_COUNT];
+static uint64_t sysvshm_trace_max[SYSVSHM_OP_COUNT];
+static uint64_t sysvshm_io_start = 0;
+
+static const char* sysvshm_op_names[SYSVSHM_OP_COUNT] = {"shmget", "shmat", "shmdt", "shmctl", "server"};
+
+__attribute__((constructor)) static void sysvshm_trace_init(void) {
+    char* value = getenv("ANDROID_SYSVSHM_TRACE");
+    if (!value || !*value || strcmp(value, "0") == 0) return;
     
-    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (fd < 0) return;
+    if (strcmp(value, "1") == 0) {
+        sysvshm_trace_fd = STDERR_FILENO;
+    }
+    else sysvshm_trace_fd = open(value, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+}
+
+uint64_t sysvshm_trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void sysvshm_trace_record(int op, uint64_t start) {
+    uint64_t elapsed = sysvshm_trace_now() - start;
+    int bucket = elapsed > 0 ? 64 - __builtin_clzll(elapsed) : 0;
+    if (bucket >= TRACE_BUCKETS) bucket = TRACE_BUCKETS - 1;
+    
+    __atomic_add_fetch(&sysvshm_trace_histograms[op][bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sysvshm_trace_totals[op], elapsed, __ATOMIC_RELAXED);
+    
+    uint64_t max = __atomic_load_n(&sysvshm_trace_max[op], __ATOMIC_RELAXED);
+    while (elapsed > max && !__atomic_compare_exchange_n(&sysvshm_trace_max[op], &max, elapsed, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static double sysvshm_trace_percentile(int op, uint64_t count, int percent) {
+    uint64_t rank = (count * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < TRACE_BUCKETS; i++) {
+        seen += sysvshm_trace_histograms[op][i];
+        if (seen >= rank) return (i < 63 && (1ULL << i) < sysvshm_trace_max[op] ? (1ULL << i) : sysvshm_trace_max[op]) / 1000.0;
+    }
+    return 0;
+}
+
+static void sysvshm_trace_report(void) {
+    int fd = sysvshm_trace_fd;
+    int pid = getpid();
+    
+    /* Processes that never touched shared memory, like the launchers that inherited the environment, stay silent. */
+    if (shmemory_peak_count == 0) return;
+    
+    dprintf(fd, "sysvshm[%d]: %-8s %10s %12s %12s %12s %12s\n", pid, "op", "count", "mean us", "p50 us <=", "p99 us <=", "max us");
+    for (int op = 0; op < SYSVSHM_OP_COUNT; op++) {
+        uint64_t count = 0;
+        for (int i = 0; i < TRACE_BUCKETS; i++) count += sysvshm_trace_histograms[op][i];
+        if (count == 0) continue;
+        
+        dprintf(fd, "sysvshm[%d]: %-8s %10llu %12.1f %12.1f %12.1f %12.1f\n", pid, sysvshm_op_names[op], (unsigned long long)count,
+                sysvshm_trace_totals[op] / 1000.0 / count, sysvshm_trace_percentile(op, count, 50),
+                sysvshm_trace_percentile(op, count, 99), sysvshm_trace_max[op] / 1000.0);
+    }
     
-    struct sockaddr_un server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sun_family = AF_LOCAL;
+    pthread_rwlock_rdlock(&sysvshm_lock);
     
-    strncpy(server_addr.sun_path, path, sizeof(server_addr.sun_path) - 1);
+    dprintf(fd, "sysvshm[%d]: peak %d segments, %zu bytes; at exit %d segments, %zu bytes\n", pid, shmemory_peak_count,
+            shmemory_peak_bytes, shmemory_count, shmemory_bytes);
+    
+    int leaks = 0;
+    for (unsigned int i = 0; i < shmemory_id_table.capacity; i++) {
+        shmemory_t* shmemory = shmemory_id_table.slots[i];
+        if (!shmemory) continue;
+        
+        if (leaks++ < TRACE_MAX_LEAKS) {
+            dprintf(fd, "sysvshm[%d]: leaked shmid %d key 0x%x size %zu nattch %d%s\n", pid, shmemory->id, shmemory->key, 
+                    shmemory->size, shmemory->nattch, shmemory->marked_for_delete ? " (removed, still attached)" : "");
+        }
+    }
+    if (leaks > TRACE_MAX_LEAKS) dprintf(fd, "sysvshm[%d]: ... and %d more\n", pid, leaks - TRACE_MAX_LEAKS);
+    
+    pthread_rwlock_unlock(&sysvshm_lock);
+}
+
+/* The server connection comes from the android_ipc pool and is opened lazily, reopened after a failure and dropped by a forked
+   child. The request functions below hold it through sysvshm_io_lock(), which also guards the delete queue. */
+
+static pthread_once_t sysvshm_connection_once = PTHREAD_ONCE_INIT;
+static android_ipc_connection_t* sysvshm_connection = NULL;
+static android_ipc_connection_t sysvshm_no_connection = {.fd = -1, .mutex = PTHREAD_MUTEX_INITIALIZER};
+static int sysvshm_pending_deletes[SYSVSHM_MAX_BATCH];
+static int sysvshm_pending_delete_count = 0;
+static size_t sysvshm_pending_delete_bytes = 0;
+static int sysvshm_server_version = -1;
+
+static void sysvshm_atfork_prepare(void) {
+    pthread_rwlock_wrlock(&sysvshm_lock);
+}
+
+static void sysvshm_atfork_parent(void) {
+    pthread_rwlock_unlock(&sysvshm_lock);
+}
+
+static void sysvshm_atfork_child(void) {
+    sysvshm_pending_delete_count = 0;
+    sysvshm_pending_delete_bytes = 0;
     
-    int res;
-    do {
-        res = 0;
-        if (connect(fd, (struct sockaddr*)&server_addr, sizeof(struct sockaddr_un)) < 0) res = -errno;
-    } 
-    while (res == -EINTR);        
+    /* A write-locked rwlock records the owner's tid, which is different in the child, so reinitialize instead of unlocking. */
+    pthread_rwlock_init(&sysvshm_lock, NULL);
+}
+
+static void sysvshm_init_connection(void) {
+    sysvshm_connection = android_ipc_pool_get(getenv("ANDROID_SYSVSHM_SERVER"));
+    if (!sysvshm_connection) sysvshm_connection = &sysvshm_no_connection;
+    pthread_atfork(sysvshm_atfork_prepare, sysvshm_atfork_parent, sysvshm_atfork_child);
+}
+
+/* Segment deletions are not sent from shmdt()/shmctl(). They are queued and go out as one REQUEST_CODE_DELETE_BATCH (count in
+   place of the argument, followed by one 4-byte shmid each) when the queue fills up or holds DELETE_QUEUE_MAX_BYTES of segments,
+   in the same sendmmsg() as the next request sent by any thread, and when the process exits. The byte bound keeps a process that
+   goes idle after freeing a few large images from pinning them in the server. A forked child drops the queue inherited from its
+   parent.
+
+   The queue is only emptied once its batch has been sent, a failed send leaves it for the next request. android_ipc_request()
+   may have sent part of the batch before failing, the server does not reuse shmids and ignores deletes of unknown ones. */
+
+static int sysvshm_batch_deletes(android_ipc_message_t* message) {
+    int count = sysvshm_pending_delete_count;
+    if (count == 0) return 0;
     
-    if (res < 0) {
-        close(fd);
-        return;
+    *message = (android_ipc_message_t){REQUEST_CODE_DELETE_BATCH, count, sysvshm_pending_deletes, count * 4};
+    return 1;
+}
+
+static void sysvshm_clear_deletes(void) {
+    sysvshm_pending_delete_count = 0;
+    sysvshm_pending_delete_bytes = 0;
+}
+
+static void sysvshm_flush_deletes(void) {
+    android_ipc_message_t message;
+    if (sysvshm_batch_deletes(&message)) {
+        ANDROID_TRACE_BEGIN("sysvshm delete batch");
+        if (android_ipc_request(sysvshm_connection, &message, 1)) sysvshm_clear_deletes();
+        ANDROID_TRACE_END();
     }
+}
+
+static bool sysvshm_send(char request_code, int arg, const void* payload, int length, const int* fds, int fd_count) {
+    android_ipc_message_t messages[2];
+    int count = sysvshm_batch_deletes(&messages[0]);
+    bool deletes = count > 0;
+    messages[count++] = (android_ipc_message_t){request_code, arg, payload, length, fds, fd_count};
+    
+    if (!android_ipc_request(sysvshm_connection, messages, count)) return false;
+    if (deletes) sysvshm_clear_deletes();
+    return true;
+}
 
-    sysvshm_server_fd = fd;    
+static int sysvshm_reply(void* data, int length, int* fds, int max_fds) {
+    return android_ipc_reply(sysvshm_connection, data, length, fds, max_fds);
 }
 
-void sysvshm_close(void) {
-    if (sysvshm_server_fd >= 0) {
-        close(sysvshm_server_fd);
-        sysvshm_server_fd = -1;
+/* Servers that predate REQUEST_CODE_SHMGET_FD only know REQUEST_CODE_SHMGET, REQUEST_CODE_GET_FD and REQUEST_CODE_DELETE, and
+   leave any other request unanswered. The first request that needs more asks for the server's protocol version with
+   REQUEST_CODE_VERSION (the client's version in place of the argument, reply: the server's version), waits a bounded time for
+   the reply, reconnecting when it does not come, and keeps the answer for the life of the process. Against a legacy server
+   IPC_PRIVATE segments are allocated with REQUEST_CODE_SHMGET and REQUEST_CODE_GET_FD, deletions are sent one at a time, keyed
+   segments, semaphores and message queues fail with ENOSYS, and POSIX shared memory objects are files in
+   SYSVSHM_SHM_DIRECTORY. */
+
+static bool sysvshm_probe_locked(void) {
+    if (sysvshm_server_version >= 0) return sysvshm_server_version >= PROTOCOL_VERSION;
+    if (!sysvshm_send(REQUEST_CODE_VERSION, PROTOCOL_VERSION, NULL, 0, NULL, 0)) return false;
+    
+    /* A late reply would be read as the answer to the next request, so a connection that timed out is dropped and the next
+       request opens a new one. */
+    int version = 0;
+    if (!android_ipc_wait(sysvshm_connection->fd, VERSION_TIMEOUT_MS)) android_ipc_close(sysvshm_connection);
+    else if (sysvshm_reply(&version, 4, NULL, 0) < 0) version = 0;
+    sysvshm_server_version = version > 0 ? version : 0;
+    return sysvshm_server_version >= PROTOCOL_VERSION;
+}
+
+static void sysvshm_io_lock(void) {
+    pthread_once(&sysvshm_connection_once, sysvshm_init_connection);
+    android_ipc_lock(sysvshm_connection);
+    sysvshm_io_start = SYSVSHM_TRACE_BEGIN();
+    ANDROID_TRACE_BEGIN("sysvshm server");
+}
+
+static void sysvshm_io_unlock(void) {
+    ANDROID_TRACE_END();
+    SYSVSHM_TRACE_END(SYSVSHM_OP_SERVER, sysvshm_io_start);
+    android_ipc_unlock(sysvshm_connection);
+}
+
+__attribute__((destructor)) static void sysvshm_flush_at_exit(void) {
+    if (sysvshm_connection) {
+        android_ipc_lock(sysvshm_connection);
+        sysvshm_flush_deletes();
+        android_ipc_unlock(sysvshm_connection);
     }
+    
+    if (sysvshm_trace_fd >= 0) sysvshm_trace_report();
+}
+
+static int shmget_request_locked(size_t size) {
+    if (size > INT_MAX || !sysvshm_send(REQUEST_CODE_SHMGET, size, NULL, 0, NULL, 0)) return 0;
+    
+    int shmid;
+    if (sysvshm_reply(&shmid, 4, NULL, 0) < 0) return 0;
+    return shmid;
 }
 
 int sysvshm_shmget_request(size_t size) {
-    if (sysvshm_server_fd < 0) return 0;
+    sysvshm_io_lock();
+    int shmid = shmget_request_locked(size);
+    sysvshm_io_unlock();
+    return shmid;
+}
+
+static int get_fd_request_locked(int shmid) {
+    if (!sysvshm_send(REQUEST_CODE_GET_FD, shmid, NULL, 0, NULL, 0)) return -1;
     
-    char request_data[MIN_REQUEST_LENGTH];
-    request_data[0] = REQUEST_CODE_SHMGET;
-    *(int*)(request_data + 1) = size;
+    char zero;
+    int fd = -1;
+    if (sysvshm_reply(&zero, 1, &fd, 1) < 0) return -1;
+    return fd;
+}
+
+int sysvshm_get_fd_request(int shmid) {
+    sysvshm_io_lock();
+    int fd = get_fd_request_locked(shmid);
+    sysvshm_io_unlock();
+    return fd;
+}
+
+/* REQUEST_CODE_SHMGET_FD carries the segment count in place of the size, followed by one 8-byte size per segment. The server
+   answers with a single message holding the shmids, with the segment fds attached as SCM_RIGHTS in the same order. A shmid of 0
+   means that the allocation failed and no fd was attached for it. */
+
+static int shmget_legacy_locked(const size_t* sizes, int count, int* shmids, int* fds) {
+    int allocated = 0;
+    for (int i = 0; i < count; i++) {
+        shmids[i] = shmget_request_locked(sizes[i]);
+        fds[i] = shmids[i] != 0 ? get_fd_request_locked(shmids[i]) : -1;
+        
+        if (shmids[i] != 0 && fds[i] < 0) {
+            sysvshm_send(REQUEST_CODE_DELETE, shmids[i], NULL, 0, NULL, 0);
+            shmids[i] = 0;
+        }
+        if (shmids[i] != 0) allocated++;
+    }
+    return allocated;
+}
+
+static int shmget_batch_request_locked(const size_t* sizes, int count, int* shmids, int* fds) {
+    if (count <= 0 || count > SYSVSHM_MAX_BATCH) return 0;
+    if (!sysvshm_probe_locked()) return shmget_legacy_locked(sizes, count, shmids, fds);
+    
+    uint64_t request_sizes[SYSVSHM_MAX_BATCH];
+    for (int i = 0; i < count; i++) request_sizes[i] = sizes[i];
+    if (!sysvshm_send(REQUEST_CODE_SHMGET_FD, count, request_sizes, count * 8, NULL, 0)) return 0;
     
-    int res = write(sysvshm_server_fd, request_data, sizeof(request_data));
-    if (res < 0) return 0;
+    int received_fds[SYSVSHM_MAX_BATCH];
+    int fd_count = sysvshm_reply(shmids, count * 4, received_fds, count);
+    if (fd_count < 0) return 0;
     
+    int allocated = 0;
+    int j = 0;
+    for (int i = 0; i < count; i++) {
+        fds[i] = -1;
+        if (shmids[i] != 0 && j < fd_count) {
+            fds[i] = received_fds[j++];
+            allocated++;
+        }
+    }
+    while (j < fd_count) close(received_fds[j++]);
+    return allocated;
+}
+
+int sysvshm_shmget_batch_request(const size_t* sizes, int count, int* shmids, int* fds) {
+    sysvshm_io_lock();
+    int allocated = shmget_batch_request_locked(sizes, count, shmids, fds);
+    sysvshm_io_unlock();
+    return allocated;
+}
+
+int sysvshm_shmget_fd_request(size_t size, int* fd) {
     int shmid;
-    res = read(sysvshm_server_fd, &shmid, 4);
-    return res == 4 ? shmid : 0;
+    if (sysvshm_shmget_batch_request(&size, 1, &shmid, fd) != 1) return 0;
+    return shmid;
 }
 
-int sysvshm_get_fd_request(int shmid) {
-    if (sysvshm_server_fd < 0) return 0;
-    
-    char request_data[MIN_REQUEST_LENGTH];
-    request_data[0] = REQUEST_CODE_GET_FD;
-    *(int*)(request_data + 1) = shmid;
-    
-    int res = write(sysvshm_server_fd, request_data, sizeof(request_data));
-    if (res < 0) return -1;
-    
-    char zero = 0;
-    struct iovec iovmsg = {.iov_base = &zero, .iov_len = 1};
-    struct {
-        struct cmsghdr align;
-        int fds[1];
-    } ctrlmsg;
-
-    struct msghdr msg = {
-        .msg_name = NULL,
-        .msg_namelen = 0,
-        .msg_iov = &iovmsg,
-        .msg_iovlen = 1,
-        .msg_flags = 0,
-        .msg_control = &ctrlmsg,
-        .msg_controllen = sizeof(struct cmsghdr) + sizeof(int)
-    };
-
-    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-    cmsg->cmsg_level = SOL_SOCKET;
-    cmsg->cmsg_type = SCM_RIGHTS;
-    cmsg->cmsg_len = msg.msg_controllen;
-    ((int*)CMSG_DATA(cmsg))[0] = -1;
-
-    recvmsg(sysvshm_server_fd, &msg, 0);
-    return ((int*)CMSG_DATA(cmsg))[0];
+/* REQUEST_CODE_SHMGET_KEY carries the key in place of the size, followed by the requested 8-byte size and the IPC_CREAT/IPC_EXCL
+   flags. The server keeps the key to segment mapping: it creates the segment when IPC_CREAT is set and the key is unknown, and
+   fails with EEXIST (IPC_CREAT | IPC_EXCL on a known key), ENOENT (unknown key without IPC_CREAT) or EINVAL (requested size larger
+   than the segment). Semaphore sets and message queues pass SYSVSHM_NAMESPACE_SEM or SYSVSHM_NAMESPACE_MSG along with the flags
+   so their keys do not clash with shared memory keys. The reply is the shmid or a negative errno followed by the 8-byte segment
+   size, with the fd attached on success. */
+
+static int shmget_key_request_locked(key_t key, size_t size, int flags, int* fd, size_t* segment_size) {
+    char request_data[12];
+    *(uint64_t*)request_data = size;
+    *(int*)(request_data + 8) = flags & (IPC_CREAT | IPC_EXCL | SYSVSHM_NAMESPACE_MASK);
+    if (!sysvshm_probe_locked()) return -ENOSYS;
+    if (!sysvshm_send(REQUEST_CODE_SHMGET_KEY, key, request_data, sizeof(request_data), NULL, 0)) return -ENOSYS;
+    
+    char reply_data[12];
+    *fd = -1;
+    if (sysvshm_reply(reply_data, sizeof(reply_data), fd, 1) < 0) return -EIO;
+    
+    int shmid = *(int*)reply_data;
+    if (shmid > 0 && *fd < 0) return -EIO;
+    *segment_size = *(uint64_t*)(reply_data + 4);
+    return shmid;
+}
+
+int sysvshm_shmget_key_request(key_t key, size_t size, int flags, int* fd, size_t* segment_size) {
+    sysvshm_io_lock();
+    int shmid = shmget_key_request_locked(key, size, flags, fd, segment_size);
+    sysvshm_io_unlock();
+    return shmid;
+}
+
+/* POSIX shared memory objects live in the server as named memfds, separate from the SysV keys. REQUEST_CODE_SHM_OPEN and
+   REQUEST_CODE_SHM_UNLINK carry the name length in place of the argument, followed by the O_CREAT/O_EXCL/O_TRUNC flags and the
+   name without its leading slash. The reply is 0 or a negative errno, REQUEST_CODE_SHM_OPEN attaches the object's fd on success.
+   The object size is the memfd size, so ftruncate() on any of its fds is seen by every process. When the server does not know
+   these requests, the requests return -ENOSYS and shm_open()/shm_unlink() use files in SYSVSHM_SHM_DIRECTORY the way the generic
+   glibc implementation does, which only works where a tmpfs is mounted there. */
+
+const char* sysvshm_shm_name(const char* name) {
+    while (*name == '/') name++;
+    
+    size_t name_length = strlen(name);
+    if (name_length == 0 || strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    
+    if (name_length > NAME_MAX) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    return name;
+}
+
+static int named_request_locked(char request_code, int flags, const char* name, int* fd) {
+    int name_length = strlen(name);
+    char request_data[4 + NAME_MAX];
+    *(int*)request_data = flags & (O_CREAT | O_EXCL | O_TRUNC);
+    memcpy(request_data + 4, name, name_length);
+    if (!sysvshm_probe_locked()) return -ENOSYS;
+    if (!sysvshm_send(request_code, name_length, request_data, 4 + name_length, NULL, 0)) return -ENOSYS;
+    
+    int result;
+    int received_fd = -1;
+    if (sysvshm_reply(&result, 4, &received_fd, 1) < 0) return -EIO;
+    
+    if (fd) {
+        *fd = received_fd;
+        if (result == 0 && received_fd < 0) return -EIO;
+    }
+    else if (received_fd >= 0) close(received_fd);
+    return result;
+}
+
+int sysvshm_shm_open_request(const char* name, int flags, int* fd) {
+    sysvshm_io_lock();
+    int result = named_request_locked(REQUEST_CODE_SHM_OPEN, flags, name, fd);
+    sysvshm_io_unlock();
+    return result;
+}
+
+int sysvshm_shm_unlink_request(const char* name) {
+    sysvshm_io_lock();
+    int result = named_request_locked(REQUEST_CODE_SHM_UNLINK, 0, name, NULL);
+    sysvshm_io_unlock();
+    return result;
 }
 
 bool sysvshm_delete_request(int shmid) {
-    if (sysvshm_server_fd < 0) return false;
+    ANDROID_TRACE_BEGIN("sysvshm delete");
+    sysvshm_io_lock();
+    bool sent = sysvshm_send(REQUEST_CODE_DELETE, shmid, NULL, 0, NULL, 0);
+    sysvshm_io_unlock();
+    ANDROID_TRACE_END();
+    return sent;
+}
+
+static void sysvshm_queue_delete(shmemory_t* shmemory) {
+    if (!sysvshm_connection) return;
     
-    char request_data[MIN_REQUEST_LENGTH];
-    request_data[0] = REQUEST_CODE_DELETE;
-    *(int*)(request_data + 1) = shmid;
+    android_ipc_lock(sysvshm_connection);
+    if (!sysvshm_probe_locked()) {
+        sysvshm_send(REQUEST_CODE_DELETE, shmemory->id, NULL, 0, NULL, 0);
+    }
+    else {
+        /* A full queue is only left behind by a server that could not be reached, which frees nothing of it either. */
+        if (sysvshm_pending_delete_count == SYSVSHM_MAX_BATCH) sysvshm_clear_deletes();
+        
+        sysvshm_pending_deletes[sysvshm_pending_delete_count++] = shmemory->id;
+        sysvshm_pending_delete_bytes += shmemory->size;
+        if (sysvshm_pending_delete_count == SYSVSHM_MAX_BATCH || sysvshm_pending_delete_bytes >= DELETE_QUEUE_MAX_BYTES) {
+            sysvshm_flush_deletes();
+        }
+    }
+    android_ipc_unlock(sysvshm_connection);
+}
+
+void sysvshm_release(shmemory_t* shmemory) {
+    sysvshm_queue_delete(shmemory);
+    sysvshm_unref(shmemory);
+}
+
+/* Segments of LARGE_SEGMENT_SIZE and more are mapped according to ANDROID_SYSVSHM_MAP_POLICY, a comma separated list of:
+   populate - prefault the whole segment in its first shmat() so that the first frame drawn into it does not take a page fault per
+              page, later attaches of the same segment map it lazily,
+   hugepage - advise transparent huge pages for the mapping (effective when shmem_enabled is "advise" or "always").
+   The default is "hugepage", since prefaulting adds its whole cost to shmat() whether or not the pages are needed soon. An empty
+   value or "none" disables all of them. */
+
+static void sysvshm_read_map_policy(void) {
+    char* value = getenv("ANDROID_SYSVSHM_MAP_POLICY");
+    if (!value) return;
     
-    int res = write(sysvshm_server_fd, request_data, sizeof(request_data));
-    return res > 0 ? true : false;
+    sysvshm_map_policy = 0;
+    while (*value) {
+        size_t length = strcspn(value, ",");
+        if (length == 8 && strncmp(value, "populate", 8) == 0) {
+            sysvshm_map_policy |= MAP_POLICY_POPULATE;
+        }
+        else if (length == 8 && strncmp(value, "hugepage", 8) == 0) {
+            sysvshm_map_policy |= MAP_POLICY_HUGEPAGE;
+        }
+        
+        value += length;
+        if (*value == ',') value++;
+    }
 }
 
-void sysvshm_delete(int index) {
-    sysvshm_connect();
-    sysvshm_delete_request(shmemories[index].id);
-    sysvshm_close();
+static void sysvshm_prefault(void* addr, size_t size, int prot) {
+    if (madvise(addr, size, prot & PROT_WRITE ? MADV_POPULATE_WRITE : MADV_POPULATE_READ) == 0) return;
+    
+    /* MADV_POPULATE_* needs Linux 5.14, touch every page on older kernels. */
+    int page_size = getpagesize();
+    for (size_t offset = 0; offset < size; offset += page_size) {
+        char* page = (char*)addr + offset;
+        if (prot & PROT_WRITE) {
+            __atomic_fetch_add(page, 0, __ATOMIC_RELAXED);
+        }
+        else (void)*(volatile char*)page;
+    }
+}
 
-    if (shmemories[index].fd >= 0) close(shmemories[index].fd);
-    shmemory_count--;
-    memmove(&shmemories[index], &shmemories[index+1], (shmemory_count - index) * sizeof(shmemory_t));
+void* sysvshm_map(shmemory_t* shmemory, void* addr, int prot, int flags) {
+    pthread_once(&sysvshm_map_policy_once, sysvshm_read_map_policy);
+    
+    bool large = shmemory->size >= LARGE_SEGMENT_SIZE;
+    bool hugepage = large && (sysvshm_map_policy & MAP_POLICY_HUGEPAGE);
+    bool populate = large && (sysvshm_map_policy & MAP_POLICY_POPULATE) &&
+                    !__atomic_exchange_n(&shmemory->populated, 1, __ATOMIC_RELAXED);
+    
+    /* With huge pages the advice has to be given before the pages are faulted in, so populate after madvise() instead. */
+    if (populate && !hugepage) flags |= MAP_POPULATE;
+    
+    void* mapped = mmap(addr, shmemory->size, prot, flags, shmemory->fd, 0);
+    if (mapped == MAP_FAILED) return MAP_FAILED;
+    
+    if (hugepage) {
+        madvise(mapped, shmemory->size, MADV_HUGEPAGE);
+        if (populate) sysvshm_prefault(mapped, shmemory->size, prot);
+    }
+    return mapped;
 }
\ No newline at end of file
@@ -2,37 +2,89 @@
 #define __ANDROID_SYSVSHM
 
 #include <stdio.h>
-#include <stdbool.h> 
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/ipc.h>
 #include <errno.h>
+#include "android_trace.h"
 
 /* based on https://github.com/pelya/android-shmem */
 
+#define SYSVSHM_MAX_BATCH 64
+#define SYSVSHM_SHM_DIRECTORY "/dev/shm/"
+
+#define SYSVSHM_NAMESPACE_SEM (1 << 24)
+#define SYSVSHM_NAMESPACE_MSG (2 << 24)
+#define SYSVSHM_NAMESPACE_MASK (3 << 24)
+
+#define SYSVSHM_OP_SHMGET 0
+#define SYSVSHM_OP_SHMAT 1
+#define SYSVSHM_OP_SHMDT 2
+#define SYSVSHM_OP_SHMCTL 3
+#define SYSVSHM_OP_SERVER 4
+#define SYSVSHM_OP_COUNT 5
+
+/* Tracing costs a single branch when ANDROID_SYSVSHM_TRACE is not set. The public calls are also marked as trace_marker slices,
+   see android_trace.h. */
+#define SYSVSHM_TRACE_BEGIN() (sysvshm_trace_fd >= 0 ? sysvshm_trace_now() : 0)
+#define SYSVSHM_TRACE_END(op, start) do { if (sysvshm_trace_fd >= 0) sysvshm_trace_record(op, start); } while (0)
+
+typedef struct shmattach shmattach_t;
+
 typedef struct {
     int id;
-    void* addr;
+    key_t key;
     int fd;
     size_t size;
+    int nattch;
+    int refs;
+    shmattach_t* attachments;
     char marked_for_delete;
+    char removed;
+    char populated;
 } shmemory_t;
 
-extern shmemory_t* shmemories;
+struct shmattach {
+    void* addr;
+    shmemory_t* shmemory;
+    shmattach_t* next;
+};
+
 extern int shmemory_count;
-extern int sysvshm_server_fd;
-extern pthread_mutex_t sysvshm_mutex;
+extern pthread_rwlock_t sysvshm_lock;
+extern int sysvshm_trace_fd;
 
-extern int find_shmemory_index(int shmid);
-extern void sysvshm_connect(void);
-extern void sysvshm_close(void);
+extern uint64_t sysvshm_trace_now(void);
+extern void sysvshm_trace_record(int op, uint64_t start);
+extern shmemory_t* find_shmemory(int shmid);
+extern shmattach_t* find_shmattach(void const* addr);
+extern shmemory_t* sysvshm_insert(int shmid, int fd, size_t size);
+extern shmattach_t* sysvshm_attach(shmemory_t* shmemory, void* addr);
+extern void sysvshm_detach(shmattach_t* shmattach);
+extern void sysvshm_ref(shmemory_t* shmemory);
+extern void sysvshm_unref(shmemory_t* shmemory);
+extern bool sysvshm_remove(shmemory_t* shmemory);
 extern int sysvshm_shmget_request(size_t size);
 extern int sysvshm_get_fd_request(int shmid);
+extern int sysvshm_shmget_batch_request(const size_t* sizes, int count, int* shmids, int* fds);
+extern int sysvshm_shmget_fd_request(size_t size, int* fd);
+extern int sysvshm_shmget_key_request(key_t key, size_t size, int flags, int* fd, size_t* segment_size);
+extern const char* sysvshm_shm_name(const char* name);
+extern int sysvshm_shm_open_request(const char* name, int flags, int* fd);
+extern int sysvshm_shm_unlink_request(const char* name);
 extern bool sysvshm_delete_request(int shmid);
-extern void sysvshm_delete(int index);
+extern void sysvshm_release(shmemory_t* shmemory);
+extern void* sysvshm_map(shmemory_t* shmemory, void* addr, int prot, int flags);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,52 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "android_trace.h"
+
+#define TRACE_MESSAGE_LENGTH 128
+
+int android_trace_fd = -1;
+
+static const char* android_trace_markers[] = {"/sys/kernel/tracing/trace_marker", "/sys/kernel/debug/tracing/trace_marker"};
+
+__attribute__((constructor)) static void android_trace_init(void) {
+    /* Every library built with this file runs its own constructor, the first one to open the marker wins. */
+    if (android_trace_fd >= 0) return;
+    
+    char* value = getenv("ANDROID_TRACE_MARKER");
+    if (!value || !*value || strcmp(value, "0") == 0) return;
+    
+    if (strcmp(value, "1") != 0) {
+        android_trace_fd = open(value, O_WRONLY | O_APPEND | O_CLOEXEC);
+        return;
+    }
+    
+    for (int i = 0; i < sizeof(android_trace_markers) / sizeof(android_trace_markers[0]) && android_trace_fd < 0; i++) {
+        android_trace_fd = open(android_trace_markers[i], O_WRONLY | O_CLOEXEC);
+    }
+}
+
+/* The kernel takes each write() to trace_marker as one event, so an event must not be split. The pid is not cached because a
+   forked child writes under its own pid. */
+static void android_trace_write(const char* message, int length) {
+    if (length >= TRACE_MESSAGE_LENGTH) length = TRACE_MESSAGE_LENGTH - 1;
+    if (write(android_trace_fd, message, length) < 0) return;
+}
+
+void android_trace_begin(const char* name) {
+    char message[TRACE_MESSAGE_LENGTH];
+    int length = snprintf(message, sizeof(message), "B|%d|%s", getpid(), name);
+    android_trace_write(message, length);
+}
+
+void android_trace_end(void) {
+    char message[TRACE_MESSAGE_LENGTH];
+    int length = snprintf(message, sizeof(message), "E|%d", getpid());
+    android_trace_write(message, length);
+}
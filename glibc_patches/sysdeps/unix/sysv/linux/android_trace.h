@@ -0,0 +1,17 @@
+#ifndef __ANDROID_TRACE
+#define __ANDROID_TRACE
+
+/* Begin/end slices written to the kernel trace_marker in the atrace format ("B|pid|name" and "E|pid"), so that Perfetto and
+   systrace show them on the same timeline as SurfaceFlinger and AudioFlinger. Setting ANDROID_TRACE_MARKER to 1 opens the tracefs
+   (or debugfs) trace_marker, any other value is the path of the file to write to. Without it the fd stays -1 and each event is a
+   single branch. Slices nest per thread, so a slice has to end on the thread that began it. */
+
+#define ANDROID_TRACE_BEGIN(name) do { if (android_trace_fd >= 0) android_trace_begin(name); } while (0)
+#define ANDROID_TRACE_END() do { if (android_trace_fd >= 0) android_trace_end(); } while (0)
+
+extern int android_trace_fd;
+
+extern void android_trace_begin(const char* name);
+extern void android_trace_end(void);
+
+#endif
@@ -0,0 +1,76 @@
+#include <ipc_priv.h>
+#include <sys/msg.h>
+#include <sysdep.h>
+#include <shlib-compat.h>
+#include <errno.h>
+#include <asm-generic/ipcbuf.h>
+#include <asm-generic/msgbuf.h>
+#include <android_sysvipc.h>
+
+#ifndef msqid_ds
+# define msqid_ds msqid64_ds
+#endif
+
+static int do_msgctl(int msqid, int cmd, struct msqid_ds *buf) {
+    sysvipc_msg_queue_t* queue = sysvipc_lookup(msqid, SYSVIPC_MSG_MAGIC);
+    if (!queue) return -1;
+
+    if (cmd == IPC_RMID) {
+        sysvipc_remove(msqid, &queue->header);
+        return 0;
+    }
+    else if (cmd == IPC_STAT) {
+        if (!buf) {
+            errno = EFAULT;
+            return -1;
+        }
+
+        memset(buf, 0, sizeof(struct msqid_ds));
+        sysvipc_lock(&queue->header);
+        buf->msg_perm.key = queue->header.key;
+        buf->msg_perm.uid = geteuid();
+        buf->msg_perm.gid = getegid();
+        buf->msg_perm.cuid = geteuid();
+        buf->msg_perm.cgid = getegid();
+        buf->msg_perm.mode = 0666;
+        buf->msg_perm.seq = 1;
+        buf->msg_stime = queue->header.otime;
+        buf->msg_rtime = queue->header.rtime;
+        buf->msg_ctime = queue->header.ctime;
+        buf->msg_cbytes = queue->cbytes;
+        buf->msg_qnum = queue->qnum;
+        buf->msg_qbytes = queue->qbytes;
+        buf->msg_lspid = queue->lspid;
+        buf->msg_lrpid = queue->lrpid;
+        sysvipc_unlock(&queue->header);
+        return 0;
+    }
+    else if (cmd == IPC_SET) {
+        if (!buf) {
+            errno = EFAULT;
+            return -1;
+        }
+
+        /* The ring has to hold qbytes of text plus the record headers and the padding at the wrap, so half of it is the limit. */
+        if (buf->msg_qbytes > SYSVIPC_MSG_RING_SIZE / 2) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        sysvipc_lock(&queue->header);
+        queue->qbytes = buf->msg_qbytes;
+        queue->header.ctime = time(NULL);
+        sysvipc_notify(&queue->header);
+        sysvipc_unlock(&queue->header);
+        return 0;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+int msgctl(int msqid, int cmd, struct msqid_ds *buf) {
+    return do_msgctl(msqid, cmd, buf);
+}
+
+weak_alias (msgctl, __msgctl64)
@@ -0,0 +1,17 @@
+#include <sys/msg.h>
+#include <stddef.h>
+#include <ipc_priv.h>
+#include <sysdep.h>
+#include <android_sysvipc.h>
+
+/* Return descriptor for message queue associated with KEY.  The MSGFLG
+   parameter describes how to proceed with clashing of key values.  */
+
+static void msg_queue_init(void* object, void* param) {
+    sysvipc_msg_queue_t* queue = object;
+    queue->qbytes = SYSVIPC_MSGMNB;
+}
+
+int msgget(key_t key, int flags) {
+    return sysvipc_get(key, flags, SYSVIPC_MSG_MAGIC, sizeof(sysvipc_msg_queue_t), msg_queue_init, NULL);
+}
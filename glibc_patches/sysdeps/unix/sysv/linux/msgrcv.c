@@ -0,0 +1,92 @@
+#include <sys/msg.h>
+#include <stddef.h>
+#include <ipc_priv.h>
+#include <sysdep.h>
+#include <errno.h>
+#include <android_sysvipc.h>
+
+/* Read a message from the queue associated with the message queue
+   descriptor MSQID.  */
+
+static sysvipc_msg_t* msg_find(sysvipc_msg_queue_t* queue, long msgtyp, int msgflg) {
+    sysvipc_msg_t* found = NULL;
+    for (uint32_t position = queue->head; position != queue->tail;) {
+        sysvipc_msg_t* msg = (sysvipc_msg_t*)(queue->ring + position % SYSVIPC_MSG_RING_SIZE);
+        position += msg->size;
+        if (msg->mtype == 0) continue;
+
+        if (msgtyp == 0) return msg;
+        if (msgtyp > 0) {
+            if ((msgflg & MSG_EXCEPT) ? msg->mtype != msgtyp : msg->mtype == msgtyp) return msg;
+        }
+        else if (msg->mtype <= -msgtyp && (!found || msg->mtype < found->mtype)) found = msg;
+    }
+    return found;
+}
+
+static void msg_consume(sysvipc_msg_queue_t* queue, sysvipc_msg_t* msg) {
+    msg->mtype = 0;
+    queue->cbytes -= msg->length;
+    queue->qnum--;
+
+    while (queue->head != queue->tail) {
+        sysvipc_msg_t* first = (sysvipc_msg_t*)(queue->ring + queue->head % SYSVIPC_MSG_RING_SIZE);
+        if (first->mtype != 0) break;
+        queue->head += first->size;
+    }
+}
+
+ssize_t msgrcv(int msqid, void *msgp, size_t msgsz, long msgtyp, int msgflg) {
+    if ((ssize_t)msgsz < 0 || (msgflg & MSG_COPY)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    sysvipc_msg_queue_t* queue = sysvipc_lookup(msqid, SYSVIPC_MSG_MAGIC);
+    if (!queue) return -1;
+
+    ssize_t length = -1;
+    int error = 0;
+    sysvipc_lock(&queue->header);
+
+    while (true) {
+        if (queue->header.removed) {
+            error = EIDRM;
+            break;
+        }
+
+        sysvipc_msg_t* msg = msg_find(queue, msgtyp, msgflg);
+        if (msg) {
+            if (msg->length > msgsz && !(msgflg & MSG_NOERROR)) {
+                error = E2BIG;
+                break;
+            }
+
+            length = msg->length < msgsz ? msg->length : msgsz;
+            *(long*)msgp = msg->mtype;
+            memcpy((char*)msgp + sizeof(long), msg + 1, length);
+
+            msg_consume(queue, msg);
+            queue->lrpid = getpid();
+            queue->header.rtime = time(NULL);
+            sysvipc_notify(&queue->header);
+            break;
+        }
+
+        if (msgflg & IPC_NOWAIT) {
+            error = ENOMSG;
+            break;
+        }
+
+        error = sysvipc_wait(&queue->header, NULL);
+        if (error) break;
+    }
+
+    sysvipc_unlock(&queue->header);
+
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return length;
+}
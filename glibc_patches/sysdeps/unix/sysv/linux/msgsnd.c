@@ -0,0 +1,133 @@
+#include <sys/msg.h>
+#include <stddef.h>
+#include <ipc_priv.h>
+#include <sysdep.h>
+#include <errno.h>
+#include <android_sysvipc.h>
+
+#define ROUND_UP(N, S) ((((N) + (S) - 1) / (S)) * (S))
+
+/* Send a message to the queue associated with the message queue
+   descriptor MSQID.
+
+   Messages are stored in the ring of the queue as a sysvipc_msg_t record followed by the text, padded to 16 bytes. head and tail
+   are free running byte counters. A record that does not fit before the end of the ring is preceded by a padding record (mtype 0)
+   that fills the rest of it. The queue is guarded by its futex lock instead of being lock-free because msgrcv() may take any
+   record that matches its type, not just the oldest one. */
+
+static void msg_pad(sysvipc_msg_queue_t* queue, uint32_t position, uint32_t size) {
+    sysvipc_msg_t* padding = (sysvipc_msg_t*)(queue->ring + position);
+    padding->size = size;
+    padding->length = 0;
+    padding->mtype = 0;
+}
+
+static bool msg_reserve(sysvipc_msg_queue_t* queue, uint32_t size, uint32_t* offset) {
+    uint32_t used = queue->tail - queue->head;
+    uint32_t position = queue->tail % SYSVIPC_MSG_RING_SIZE;
+    uint32_t contiguous = SYSVIPC_MSG_RING_SIZE - position;
+
+    if (contiguous < size) {
+        if (used + contiguous + size > SYSVIPC_MSG_RING_SIZE) return false;
+
+        msg_pad(queue, position, contiguous);
+        queue->tail += contiguous;
+        position = 0;
+    }
+    else if (used + size > SYSVIPC_MSG_RING_SIZE) return false;
+
+    *offset = position;
+    queue->tail += size;
+    return true;
+}
+
+/* msgrcv() only advances head past consumed records at the front, so a message left unread by receivers that select another
+   type keeps the space of everything consumed behind it. When a message fits in qbytes but not in the ring, the live records are
+   moved down to head in their order, which leaves all of the free space after tail. A record only moves towards head, never over
+   one that has not been moved yet. */
+
+static void msg_compact(sysvipc_msg_queue_t* queue) {
+    uint32_t write = queue->head;
+    for (uint32_t read = queue->head; read != queue->tail;) {
+        sysvipc_msg_t* msg = (sysvipc_msg_t*)(queue->ring + read % SYSVIPC_MSG_RING_SIZE);
+        uint32_t size = msg->size;
+        read += size;
+        if (msg->mtype == 0) continue;
+
+        uint32_t position = write % SYSVIPC_MSG_RING_SIZE;
+        if (SYSVIPC_MSG_RING_SIZE - position < size) {
+            msg_pad(queue, position, SYSVIPC_MSG_RING_SIZE - position);
+            write += SYSVIPC_MSG_RING_SIZE - position;
+            position = 0;
+        }
+
+        if (queue->ring + position != (char*)msg) memmove(queue->ring + position, msg, size);
+        write += size;
+    }
+    queue->tail = write;
+}
+
+int msgsnd(int msqid, const void *msgp, size_t msgsz, int msgflg) {
+    if (msgsz > SYSVIPC_MSGMAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    long mtype = *(const long*)msgp;
+    if (mtype < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    sysvipc_msg_queue_t* queue = sysvipc_lookup(msqid, SYSVIPC_MSG_MAGIC);
+    if (!queue) return -1;
+
+    uint32_t size = ROUND_UP(sizeof(sysvipc_msg_t) + msgsz, 16);
+    uint32_t offset;
+    int error = 0;
+    sysvipc_lock(&queue->header);
+
+    while (true) {
+        if (queue->header.removed) {
+            error = EIDRM;
+            break;
+        }
+
+        if (queue->cbytes + msgsz <= queue->qbytes) {
+            if (msg_reserve(queue, size, &offset)) break;
+
+            msg_compact(queue);
+            if (msg_reserve(queue, size, &offset)) break;
+        }
+
+        if (msgflg & IPC_NOWAIT) {
+            error = EAGAIN;
+            break;
+        }
+
+        error = sysvipc_wait(&queue->header, NULL);
+        if (error) break;
+    }
+
+    if (!error) {
+        sysvipc_msg_t* msg = (sysvipc_msg_t*)(queue->ring + offset);
+        msg->size = size;
+        msg->length = msgsz;
+        msg->mtype = mtype;
+        memcpy(msg + 1, (const char*)msgp + sizeof(long), msgsz);
+
+        queue->cbytes += msgsz;
+        queue->qnum++;
+        queue->lspid = getpid();
+        queue->header.otime = time(NULL);
+        sysvipc_notify(&queue->header);
+    }
+
+    sysvipc_unlock(&queue->header);
+
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include <stdarg.h>
+#include <ipc_priv.h>
+#include <sys/sem.h>
+#include <sysdep.h>
+#include <shlib-compat.h>
+#include <errno.h>
+#include <asm-generic/ipcbuf.h>
+#include <asm-generic/sembuf.h>
+#include <android_sysvipc.h>
+
+#ifndef semid_ds
+# define semid_ds semid64_ds
+#endif
+
+union semun {
+    int val;
+    struct semid_ds *buf;
+    unsigned short *array;
+    struct seminfo *__buf;
+};
+
+static int do_semctl(int semid, int semnum, int cmd, union semun arg) {
+    sysvipc_sem_set_t* set = sysvipc_lookup(semid, SYSVIPC_SEM_MAGIC);
+    if (!set) return -1;
+
+    if (cmd == IPC_RMID) {
+        sysvipc_remove(semid, &set->header);
+        return 0;
+    }
+    else if (cmd == IPC_STAT) {
+        if (!arg.buf) {
+            errno = EFAULT;
+            return -1;
+        }
+
+        memset(arg.buf, 0, sizeof(struct semid_ds));
+        arg.buf->sem_perm.key = set->header.key;
+        arg.buf->sem_perm.uid = geteuid();
+        arg.buf->sem_perm.gid = getegid();
+        arg.buf->sem_perm.cuid = geteuid();
+        arg.buf->sem_perm.cgid = getegid();
+        arg.buf->sem_perm.mode = 0666;
+        arg.buf->sem_perm.seq = 1;
+        arg.buf->sem_otime = set->header.otime;
+        arg.buf->sem_ctime = set->header.ctime;
+        arg.buf->sem_nsems = set->nsems;
+        return 0;
+    }
+    else if (cmd == IPC_SET) {
+        set->header.ctime = time(NULL);
+        return 0;
+    }
+    else if (cmd == GETALL || cmd == SETALL) {
+        if (!arg.array) {
+            errno = EFAULT;
+            return -1;
+        }
+
+        if (cmd == SETALL) {
+            for (int i = 0; i < set->nsems; i++) {
+                if (arg.array[i] > SYSVIPC_SEMVMX) {
+                    errno = ERANGE;
+                    return -1;
+                }
+            }
+        }
+
+        sysvipc_lock(&set->header);
+        if (cmd == SETALL) {
+            for (int i = 0; i < set->nsems; i++) set->sems[i].value = arg.array[i];
+            set->header.ctime = time(NULL);
+            sysvipc_notify(&set->header);
+        }
+        else for (int i = 0; i < set->nsems; i++) arg.array[i] = set->sems[i].value;
+        sysvipc_unlock(&set->header);
+        return 0;
+    }
+
+    if (semnum < 0 || semnum >= set->nsems) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    sysvipc_sem_t* sem = &set->sems[semnum];
+    switch (cmd) {
+        case GETVAL:
+            return __atomic_load_n(&sem->value, __ATOMIC_ACQUIRE);
+        case GETPID:
+            return __atomic_load_n(&sem->pid, __ATOMIC_ACQUIRE);
+        case GETNCNT:
+            return __atomic_load_n(&sem->ncnt, __ATOMIC_ACQUIRE);
+        case GETZCNT:
+            return __atomic_load_n(&sem->zcnt, __ATOMIC_ACQUIRE);
+        case SETVAL:
+            if (arg.val < 0 || arg.val > SYSVIPC_SEMVMX) {
+                errno = ERANGE;
+                return -1;
+            }
+
+            sysvipc_lock(&set->header);
+            sem->value = arg.val;
+            sem->pid = getpid();
+            set->header.ctime = time(NULL);
+            sysvipc_notify(&set->header);
+            sysvipc_unlock(&set->header);
+            return 0;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+int semctl(int semid, int semnum, int cmd, ...) {
+    union semun arg = {0};
+
+    switch (cmd) {
+        case SETVAL:
+        case GETALL:
+        case SETALL:
+        case IPC_STAT:
+        case IPC_SET: {
+            va_list ap;
+            va_start(ap, cmd);
+            arg = va_arg(ap, union semun);
+            va_end(ap);
+            break;
+        }
+    }
+
+    return do_semctl(semid, semnum, cmd, arg);
+}
+
+weak_alias (semctl, __semctl64)
@@ -0,0 +1,34 @@
+#include <sys/sem.h>
+#include <stddef.h>
+#include <ipc_priv.h>
+#include <sysdep.h>
+#include <errno.h>
+#include <android_sysvipc.h>
+
+/* Return identifier for array of NSEMS semaphores associated with
+   KEY.  */
+
+static void sem_set_init(void* object, void* param) {
+    sysvipc_sem_set_t* set = object;
+    set->nsems = *(int*)param;
+}
+
+int semget(key_t key, int nsems, int flags) {
+    if (nsems < 0 || nsems > SYSVIPC_SEMMSL || (nsems == 0 && key == IPC_PRIVATE)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t size = sizeof(sysvipc_sem_set_t) + nsems * sizeof(sysvipc_sem_t);
+    int semid = sysvipc_get(key, flags, SYSVIPC_SEM_MAGIC, size, sem_set_init, &nsems);
+    if (semid < 0) return -1;
+
+    sysvipc_sem_set_t* set = sysvipc_lookup(semid, SYSVIPC_SEM_MAGIC);
+    if (!set) return -1;
+
+    if (set->nsems < nsems) {
+        errno = EINVAL;
+        return -1;
+    }
+    return semid;
+}
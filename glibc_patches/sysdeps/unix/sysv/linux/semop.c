@@ -0,0 +1,10 @@
+#include <sys/sem.h>
+#include <stddef.h>
+#include <ipc_priv.h>
+#include <sysdep.h>
+
+/* Perform user-defined atomical operation of array of semaphores.  */
+
+int semop(int semid, struct sembuf *sops, size_t nsops) {
+    return semtimedop(semid, sops, nsops, NULL);
+}
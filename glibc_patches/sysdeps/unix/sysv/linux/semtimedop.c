@@ -0,0 +1,94 @@
+#include <sys/sem.h>
+#include <stddef.h>
+#include <ipc_priv.h>
+#include <sysdep.h>
+#include <shlib-compat.h>
+#include <errno.h>
+#include <android_sysvipc.h>
+
+/* Perform user-defined atomical operation of array of semaphores.
+
+   The operations are applied in order to the values in the shared set and rolled back if one of them would block, so a caller
+   either sees all of them take effect or none. A blocked caller counts itself in semncnt or semzcnt of the semaphore it waits on
+   and sleeps until the set changes. SEM_UNDO is accepted but the adjustments are not undone when the process exits. */
+
+int semtimedop(int semid, struct sembuf *sops, size_t nsops, const struct timespec *timeout) {
+    if (nsops == 0 || nsops > SYSVIPC_SEMOPM) {
+        errno = nsops == 0 ? EINVAL : E2BIG;
+        return -1;
+    }
+
+    if (timeout && (timeout->tv_sec < 0 || timeout->tv_nsec < 0 || timeout->tv_nsec >= 1000000000L)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    sysvipc_sem_set_t* set = sysvipc_lookup(semid, SYSVIPC_SEM_MAGIC);
+    if (!set) return -1;
+
+    for (size_t i = 0; i < nsops; i++) {
+        if (sops[i].sem_num >= set->nsems) {
+            errno = EFBIG;
+            return -1;
+        }
+    }
+
+    struct timespec deadline;
+    if (timeout) sysvipc_deadline(timeout, &deadline);
+
+    int error = 0;
+    sysvipc_lock(&set->header);
+
+    while (!set->header.removed) {
+        size_t i;
+        for (i = 0; i < nsops; i++) {
+            sysvipc_sem_t* sem = &set->sems[sops[i].sem_num];
+            int value = (int)sem->value + sops[i].sem_op;
+            if (sops[i].sem_op == 0 ? sem->value != 0 : value < 0) break;
+            if (value > SYSVIPC_SEMVMX) {
+                error = ERANGE;
+                break;
+            }
+            sem->value = value;
+        }
+
+        if (i == nsops) {
+            bool changed = false;
+            pid_t pid = getpid();
+            for (i = 0; i < nsops; i++) {
+                set->sems[sops[i].sem_num].pid = pid;
+                if (sops[i].sem_op != 0) changed = true;
+            }
+            set->header.otime = time(NULL);
+            if (changed) sysvipc_notify(&set->header);
+            break;
+        }
+
+        size_t blocking = i;
+        while (i-- > 0) set->sems[sops[i].sem_num].value -= sops[i].sem_op;
+        if (error) break;
+
+        if (sops[blocking].sem_flg & IPC_NOWAIT) {
+            error = EAGAIN;
+            break;
+        }
+
+        sysvipc_sem_t* sem = &set->sems[sops[blocking].sem_num];
+        uint32_t* count = sops[blocking].sem_op == 0 ? &sem->zcnt : &sem->ncnt;
+        (*count)++;
+        error = sysvipc_wait(&set->header, timeout ? &deadline : NULL);
+        (*count)--;
+        if (error) break;
+    }
+
+    if (!error && set->header.removed) error = EIDRM;
+    sysvipc_unlock(&set->header);
+
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+weak_alias (semtimedop, __semtimedop64)
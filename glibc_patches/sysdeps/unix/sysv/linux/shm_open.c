@@ -0,0 +1,50 @@
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <shlib-compat.h>
+#include <android_sysvshm.h>
+
+/* Open shared memory object.  The object is a memfd kept by the sysvshm
+   server under NAME, so every process that opens it shares the memory.
+   Without a server that supports it, the object is a file in /dev/shm.  */
+
+int __shm_open(const char* name, int oflag, mode_t mode) {
+    const char* object_name = sysvshm_shm_name(name);
+    if (!object_name) return -1;
+    
+    int fd;
+    int result = sysvshm_shm_open_request(object_name, oflag, &fd);
+    if (result == -ENOSYS) {
+        char path[sizeof(SYSVSHM_SHM_DIRECTORY) + NAME_MAX];
+        snprintf(path, sizeof(path), SYSVSHM_SHM_DIRECTORY "%s", object_name);
+        
+        fd = open(path, oflag | O_NOFOLLOW | O_CLOEXEC, mode);
+        if (fd < 0 && errno == EISDIR) errno = EINVAL;
+        return fd;
+    }
+    
+    if (result < 0) {
+        errno = -result;
+        return -1;
+    }
+    
+    /* The server always hands out a read/write fd, reopen it to honour O_RDONLY. */
+    if ((oflag & O_ACCMODE) == O_RDONLY) {
+        char path[32];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        
+        int rdonly_fd = open(path, O_RDONLY | O_CLOEXEC);
+        int error = errno;
+        close(fd);
+        
+        if (rdonly_fd < 0) errno = error;
+        fd = rdonly_fd;
+    }
+    return fd;
+}
+
+versioned_symbol (libc, __shm_open, shm_open, GLIBC_2_34);
+#if OTHER_SHLIB_COMPAT (librt, GLIBC_2_2, GLIBC_2_34)
+compat_symbol (libc, __shm_open, shm_open, GLIBC_2_2);
+#endif
@@ -0,0 +1,37 @@
+#include <errno.h>
+#include <sys/mman.h>
+#include <shlib-compat.h>
+#include <android_sysvshm.h>
+
+/* Remove shared memory object.  Processes that still have it open or
+   mapped keep using the memory, a later shm_open of NAME creates a new
+   object.  */
+
+int __shm_unlink(const char* name) {
+    const char* object_name = sysvshm_shm_name(name);
+    if (!object_name) {
+        if (errno == EINVAL) errno = ENOENT;
+        return -1;
+    }
+    
+    int result = sysvshm_shm_unlink_request(object_name);
+    if (result == -ENOSYS) {
+        char path[sizeof(SYSVSHM_SHM_DIRECTORY) + NAME_MAX];
+        snprintf(path, sizeof(path), SYSVSHM_SHM_DIRECTORY "%s", object_name);
+        
+        result = unlink(path);
+        if (result < 0 && errno == EPERM) errno = EACCES;
+        return result;
+    }
+    
+    if (result < 0) {
+        errno = -result;
+        return -1;
+    }
+    return 0;
+}
+
+versioned_symbol (libc, __shm_unlink, shm_unlink, GLIBC_2_34);
+#if OTHER_SHLIB_COMPAT (librt, GLIBC_2_2, GLIBC_2_34)
+compat_symbol (libc, __shm_unlink, shm_unlink, GLIBC_2_2);
+#endif
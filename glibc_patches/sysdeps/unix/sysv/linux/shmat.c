@@ -2,26 +2,78 @@
 #include <sysdep.h>
 #include <errno.h>
 #include <sys/mman.h>
+#include <sys/shm.h>
 #include <android_sysvshm.h>
 
+#ifndef MAP_FIXED_NOREPLACE
+# define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
 /* Attach the shared memory segment associated with SHMID to the data
    segment of the calling process.  SHMADDR and SHMFLG determine how
    and where the segment is attached.  */
 
-void* shmat(int shmid, void const* shmaddr, int shmflg)
-{
-    pthread_mutex_lock(&sysvshm_mutex);
-
-    void* addr = NULL;
-    int index = find_shmemory_index(shmid);
-    if (index != -1) {
-        if (shmemories[index].addr == NULL) {
-            shmemories[index].addr = mmap(NULL, shmemories[index].size, PROT_READ | (shmflg == 0 ? PROT_WRITE : 0), MAP_SHARED, shmemories[index].fd, 0);
-            if (shmemories[index].addr == MAP_FAILED) shmemories[index].addr = NULL;
+static void* do_shmat(int shmid, void const* shmaddr, int shmflg) {
+    int prot = PROT_READ;
+    if (!(shmflg & SHM_RDONLY)) prot |= PROT_WRITE;
+    if (shmflg & SHM_EXEC) prot |= PROT_EXEC;
+    
+    int flags = MAP_SHARED;
+    uintptr_t fixed_addr = (uintptr_t)shmaddr;
+    if (fixed_addr) {
+        if (shmflg & SHM_RND) fixed_addr &= ~((uintptr_t)SHMLBA - 1);
+        if (fixed_addr == 0 || fixed_addr & (getpagesize() - 1)) {
+            errno = EINVAL;
+            return (void *)-1;
         }
-        addr = shmemories[index].addr;
+        flags |= shmflg & SHM_REMAP ? MAP_FIXED : MAP_FIXED_NOREPLACE;
+    }
+    
+    pthread_rwlock_rdlock(&sysvshm_lock);
+    shmemory_t* shmemory = find_shmemory(shmid);
+    if (shmemory) sysvshm_ref(shmemory);
+    pthread_rwlock_unlock(&sysvshm_lock);
+    
+    if (!shmemory) {
+        errno = EINVAL;
+        return (void *)-1;
     }
     
-    pthread_mutex_unlock(&sysvshm_mutex);
-    return addr ? addr : (void *)-1;
+    /* mmap may fault in page tables, which is not done under sysvshm_lock. The reference keeps the fd open even if another
+       thread removes the segment meanwhile. */
+    void* addr = sysvshm_map(shmemory, (void*)fixed_addr, prot, flags);
+    
+    if (addr != MAP_FAILED && fixed_addr && addr != (void*)fixed_addr) {
+        munmap(addr, shmemory->size);
+        addr = MAP_FAILED;
+        errno = EINVAL;
+    }
+    
+    if (addr != MAP_FAILED) {
+        pthread_rwlock_wrlock(&sysvshm_lock);
+        int error = 0;
+        if (shmemory->removed) {
+            error = EINVAL;
+        }
+        else if (!sysvshm_attach(shmemory, addr)) error = ENOMEM;
+        pthread_rwlock_unlock(&sysvshm_lock);
+        
+        if (error) {
+            munmap(addr, shmemory->size);
+            addr = MAP_FAILED;
+            errno = error;
+        }
+    }
+    
+    sysvshm_unref(shmemory);
+    return addr != MAP_FAILED ? addr : (void *)-1;
+}
+
+void* shmat(int shmid, void const* shmaddr, int shmflg) {
+    uint64_t trace_start = SYSVSHM_TRACE_BEGIN();
+    ANDROID_TRACE_BEGIN("shmat");
+    void* addr = do_shmat(shmid, shmaddr, shmflg);
+    ANDROID_TRACE_END();
+    SYSVSHM_TRACE_END(SYSVSHM_OP_SHMAT, trace_start);
+    return addr;
 }
@@ -11,34 +11,35 @@
 # define shmid_ds shmid64_ds
 #endif
 
-int shmctl(int shmid, int cmd, struct shmid_ds *buf) {
+static int do_shmctl(int shmid, int cmd, struct shmid_ds *buf) {
     if (cmd == IPC_RMID) {
-        pthread_mutex_lock(&sysvshm_mutex);
+        pthread_rwlock_wrlock(&sysvshm_lock);
+        
+        bool removed = false;
+        shmemory_t* shmemory = find_shmemory(shmid);
+        if (shmemory) {
+            shmemory->marked_for_delete = 1;
+            removed = sysvshm_remove(shmemory);
+        }
         
-        int index = find_shmemory_index(shmid);
-        if (index != -1) {
-            if (shmemories[index].addr) {
-                shmemories[index].marked_for_delete = 1;
-            } 
-            else sysvshm_delete(index);                
-        }        
+        pthread_rwlock_unlock(&sysvshm_lock);
         
-        pthread_mutex_unlock(&sysvshm_mutex);
+        if (removed) sysvshm_release(shmemory);
         return 0;
     } 
     else if (cmd == IPC_STAT) {
-        pthread_mutex_lock(&sysvshm_mutex);
+        pthread_rwlock_rdlock(&sysvshm_lock);
         
-        int index = find_shmemory_index(shmid);
-        if (!buf || index == -1) {
-            pthread_mutex_unlock(&sysvshm_mutex);
+        shmemory_t* shmemory = find_shmemory(shmid);
+        if (!buf || !shmemory) {
+            pthread_rwlock_unlock(&sysvshm_lock);
             return -1;
         }
         
         memset(buf, 0, sizeof(struct shmid_ds));
-        buf->shm_segsz = shmemories[index].size;
-        buf->shm_nattch = 1;
-        buf->shm_perm.key = IPC_PRIVATE;
+        buf->shm_segsz = shmemory->size;
+        buf->shm_nattch = shmemory->nattch;
+        buf->shm_perm.key = shmemory->key;
         buf->shm_perm.uid = geteuid();
         buf->shm_perm.gid = getegid();
         buf->shm_perm.cuid = geteuid();
@@ -46,10 +47,19 @@ int shmctl(int shmid, int cmd, struct shmid_ds *buf) {
         buf->shm_perm.mode = 0666;
         buf->shm_perm.seq = 1;
         
-        pthread_mutex_unlock(&sysvshm_mutex);
+        pthread_rwlock_unlock(&sysvshm_lock);
         return 0;
     }
     return -1;
 }
 
+int shmctl(int shmid, int cmd, struct shmid_ds *buf) {
+    uint64_t trace_start = SYSVSHM_TRACE_BEGIN();
+    ANDROID_TRACE_BEGIN("shmctl");
+    int res = do_shmctl(shmid, cmd, buf);
+    ANDROID_TRACE_END();
+    SYSVSHM_TRACE_END(SYSVSHM_OP_SHMCTL, trace_start);
+    return res;
+}
+
 weak_alias (shmctl, __shmctl64)
@@ -7,18 +7,34 @@
 /* Detach shared memory segment starting at address specified by SHMADDR
    from the caller's data segment.  */
 
-int shmdt(void const* shmaddr) {
-    pthread_mutex_lock(&sysvshm_mutex);
+static int do_shmdt(void const* shmaddr) {
+    pthread_rwlock_wrlock(&sysvshm_lock);
+    
+    shmattach_t* shmattach = find_shmattach(shmaddr);
+    if (!shmattach) {
+        pthread_rwlock_unlock(&sysvshm_lock);
+        errno = EINVAL;
+        return -1;
+    }
+    
+    shmemory_t* shmemory = shmattach->shmemory;
+    void* addr = shmattach->addr;
+    size_t size = shmemory->size;
+    sysvshm_detach(shmattach);
+    bool removed = sysvshm_remove(shmemory);
     
-    for (int i = 0; i < shmemory_count; i++) {
-        if (shmemories[i].addr == shmaddr) {
-            munmap(shmemories[i].addr, shmemories[i].size);
-            shmemories[i].addr = NULL;
-            if (shmemories[i].marked_for_delete) sysvshm_delete(i);
-            break;
-        }
-    }    
+    pthread_rwlock_unlock(&sysvshm_lock);
     
-    pthread_mutex_unlock(&sysvshm_mutex);
+    munmap(addr, size);
+    if (removed) sysvshm_release(shmemory);
     return 0;
 }
+
+int shmdt(void const* shmaddr) {
+    uint64_t trace_start = SYSVSHM_TRACE_BEGIN();
+    ANDROID_TRACE_BEGIN("shmdt");
+    int res = do_shmdt(shmaddr);
+    ANDROID_TRACE_END();
+    SYSVSHM_TRACE_END(SYSVSHM_OP_SHMDT, trace_start);
+    return res;
+}
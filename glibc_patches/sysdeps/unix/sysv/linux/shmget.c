@@ -9,38 +9,64 @@
 /* Return an identifier for an shared memory segment of at least size SIZE
    which is associated with KEY.  */
 
-int shmget(key_t key, size_t size, int flags) {
-    if (key != IPC_PRIVATE) return -1;
-    
-    pthread_mutex_lock(&sysvshm_mutex);
-        
-    sysvshm_connect();
-    int shmid = sysvshm_shmget_request(size);
-    if (shmid == 0) {
-        sysvshm_close();
-        pthread_mutex_unlock(&sysvshm_mutex);
+static int shmget_key(key_t key, size_t size, int flags) {
+    int fd;
+    size_t segment_size;
+    int shmid = sysvshm_shmget_key_request(key, size, flags, &fd, &segment_size);
+    if (shmid <= 0) {
+        errno = shmid < 0 ? -shmid : EIO;
         return -1;
     }
     
-    size = ROUND_UP(size, getpagesize());
-    int index = shmemory_count;
-    shmemory_count++;
-    shmemories = realloc(shmemories, shmemory_count * sizeof(shmemory_t));
-    shmemories[index].size = size;
-    shmemories[index].fd = sysvshm_get_fd_request(shmid);
-    shmemories[index].addr = NULL;
-    shmemories[index].id = shmid;
-    shmemories[index].marked_for_delete = 0;
-    
-    sysvshm_close();
-    
-    if (shmemories[index].fd < 0) {
-        shmemory_count--;
-        shmemories = realloc(shmemories, shmemory_count * sizeof(shmemory_t));
-        pthread_mutex_unlock(&sysvshm_mutex);
+    pthread_rwlock_wrlock(&sysvshm_lock);
+    
+    if (find_shmemory(shmid)) {
+        pthread_rwlock_unlock(&sysvshm_lock);
+        close(fd);
+        return shmid;
+    }
+    
+    shmemory_t* shmemory = sysvshm_insert(shmid, fd, ROUND_UP(segment_size, getpagesize()));
+    if (shmemory) shmemory->key = key;
+    
+    pthread_rwlock_unlock(&sysvshm_lock);
+    
+    if (!shmemory) {
+        close(fd);
+        errno = ENOMEM;
         return -1;
     }
+    return shmid;
+}
+
+static int shmget_private(size_t size) {
+    if (size > SIZE_MAX - getpagesize()) {
+        errno = EINVAL;
+        return -1;
+    }
+    size = ROUND_UP(size, getpagesize());
+    
+    int fd;
+    int shmid = sysvshm_shmget_fd_request(size, &fd);
+    if (shmid == 0) return -1;
     
-    pthread_mutex_unlock(&sysvshm_mutex);
+    pthread_rwlock_wrlock(&sysvshm_lock);
+    shmemory_t* shmemory = sysvshm_insert(shmid, fd, size);
+    pthread_rwlock_unlock(&sysvshm_lock);
+    
+    if (!shmemory) {
+        close(fd);
+        sysvshm_delete_request(shmid);
+        return -1;
+    }
+    return shmid;
+}
+
+int shmget(key_t key, size_t size, int flags) {
+    uint64_t trace_start = SYSVSHM_TRACE_BEGIN();
+    ANDROID_TRACE_BEGIN("shmget");
+    int shmid = key != IPC_PRIVATE ? shmget_key(key, size, flags) : shmget_private(size);
+    ANDROID_TRACE_END();
+    SYSVSHM_TRACE_END(SYSVSHM_OP_SHMGET, trace_start);
     return shmid;
 }